@@ -5,6 +5,155 @@
 #include "Endian.h"
 #include "Aes.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define AES_AESNI
+#include <immintrin.h>
+#endif
+
+#ifdef AES_AESNI
+// AES-NI versions of the block functions. The round keys are the byte
+// order of _erk / _drk, with the inner decryption keys run through aesimc.
+
+__attribute__((target("aes,sse2")))
+static inline __m128i EncryptBlockNI(__m128i b, const uint8_t *rk, int nr)
+{
+	int r;
+
+	b = _mm_xor_si128(b, _mm_load_si128(reinterpret_cast<const __m128i *>(rk)));
+	for (r = 1; r < nr; r++)
+		b = _mm_aesenc_si128(b, _mm_load_si128(reinterpret_cast<const __m128i *>(rk + 16 * r)));
+	return _mm_aesenclast_si128(b, _mm_load_si128(reinterpret_cast<const __m128i *>(rk + 16 * nr)));
+}
+
+__attribute__((target("aes,sse2")))
+static inline __m128i DecryptBlockNI(__m128i b, const uint8_t *rk, int nr)
+{
+	int r;
+
+	b = _mm_xor_si128(b, _mm_load_si128(reinterpret_cast<const __m128i *>(rk)));
+	for (r = 1; r < nr; r++)
+		b = _mm_aesdec_si128(b, _mm_load_si128(reinterpret_cast<const __m128i *>(rk + 16 * r)));
+	return _mm_aesdeclast_si128(b, _mm_load_si128(reinterpret_cast<const __m128i *>(rk + 16 * nr)));
+}
+
+__attribute__((target("aes,sse2")))
+static void EncryptNI(const void *src, void *dst, const uint8_t *rk, int nr)
+{
+	__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src));
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(dst), EncryptBlockNI(b, rk, nr));
+}
+
+__attribute__((target("aes,sse2")))
+static void DecryptNI(const void *src, void *dst, const uint8_t *rk, int nr)
+{
+	__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src));
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(dst), DecryptBlockNI(b, rk, nr));
+}
+
+__attribute__((target("aes,sse2")))
+static void InvMixKeysNI(uint8_t *drk, int nr)
+{
+	int r;
+
+	for (r = 1; r < nr; r++) {
+		__m128i k = _mm_load_si128(reinterpret_cast<const __m128i *>(drk + 16 * r));
+		_mm_store_si128(reinterpret_cast<__m128i *>(drk + 16 * r), _mm_aesimc_si128(k));
+	}
+}
+
+// ECB over many blocks, eight at a time so that the aesenc / aesdec
+// latency is hidden.
+template<bool enc>
+__attribute__((target("aes,sse2")))
+static void CryptBlocksNI(const uint8_t *src, uint8_t *dst, size_t count, const uint8_t *rk, int nr)
+{
+	const __m128i *s = reinterpret_cast<const __m128i *>(src);
+	__m128i *d = reinterpret_cast<__m128i *>(dst);
+	__m128i b[8];
+	__m128i k;
+	size_t i = 0;
+	int r;
+	int j;
+
+	for (; i + 8 <= count; i += 8) {
+		k = _mm_load_si128(reinterpret_cast<const __m128i *>(rk));
+		for (j = 0; j < 8; j++)
+			b[j] = _mm_xor_si128(_mm_loadu_si128(s + i + j), k);
+
+		for (r = 1; r < nr; r++) {
+			k = _mm_load_si128(reinterpret_cast<const __m128i *>(rk + 16 * r));
+			for (j = 0; j < 8; j++)
+				b[j] = enc ? _mm_aesenc_si128(b[j], k) : _mm_aesdec_si128(b[j], k);
+		}
+
+		k = _mm_load_si128(reinterpret_cast<const __m128i *>(rk + 16 * nr));
+		for (j = 0; j < 8; j++)
+			_mm_storeu_si128(d + i + j, enc ? _mm_aesenclast_si128(b[j], k) : _mm_aesdeclast_si128(b[j], k));
+	}
+
+	for (; i < count; i++) {
+		k = _mm_loadu_si128(s + i);
+		_mm_storeu_si128(d + i, enc ? EncryptBlockNI(k, rk, nr) : DecryptBlockNI(k, rk, nr));
+	}
+}
+
+// CBC decryption has no dependency between blocks, so four are kept in
+// flight to hide the latency of aesdec. chain is updated to the last
+// ciphertext block.
+__attribute__((target("aes,sse2")))
+static void DecryptCBCNI(const uint8_t *src, uint8_t *dst, size_t size, uint8_t *chain, const uint8_t *rk, int nr)
+{
+	const __m128i *s = reinterpret_cast<const __m128i *>(src);
+	__m128i *d = reinterpret_cast<__m128i *>(dst);
+	__m128i iv = _mm_loadu_si128(reinterpret_cast<const __m128i *>(chain));
+	__m128i c0, c1, c2, c3, b0, b1, b2, b3, k;
+	size_t n = size / 16;
+	size_t i = 0;
+	int r;
+
+	for (; i + 4 <= n; i += 4) {
+		c0 = _mm_loadu_si128(s + i);
+		c1 = _mm_loadu_si128(s + i + 1);
+		c2 = _mm_loadu_si128(s + i + 2);
+		c3 = _mm_loadu_si128(s + i + 3);
+
+		k = _mm_load_si128(reinterpret_cast<const __m128i *>(rk));
+		b0 = _mm_xor_si128(c0, k);
+		b1 = _mm_xor_si128(c1, k);
+		b2 = _mm_xor_si128(c2, k);
+		b3 = _mm_xor_si128(c3, k);
+
+		for (r = 1; r < nr; r++) {
+			k = _mm_load_si128(reinterpret_cast<const __m128i *>(rk + 16 * r));
+			b0 = _mm_aesdec_si128(b0, k);
+			b1 = _mm_aesdec_si128(b1, k);
+			b2 = _mm_aesdec_si128(b2, k);
+			b3 = _mm_aesdec_si128(b3, k);
+		}
+
+		k = _mm_load_si128(reinterpret_cast<const __m128i *>(rk + 16 * nr));
+		b0 = _mm_aesdeclast_si128(b0, k);
+		b1 = _mm_aesdeclast_si128(b1, k);
+		b2 = _mm_aesdeclast_si128(b2, k);
+		b3 = _mm_aesdeclast_si128(b3, k);
+
+		_mm_storeu_si128(d + i, _mm_xor_si128(b0, iv));
+		_mm_storeu_si128(d + i + 1, _mm_xor_si128(b1, c0));
+		_mm_storeu_si128(d + i + 2, _mm_xor_si128(b2, c1));
+		_mm_storeu_si128(d + i + 3, _mm_xor_si128(b3, c2));
+		iv = c3;
+	}
+
+	for (; i < n; i++) {
+		c0 = _mm_loadu_si128(s + i);
+		_mm_storeu_si128(d + i, _mm_xor_si128(DecryptBlockNI(c0, rk, nr), iv));
+		iv = c0;
+	}
+
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(chain), iv);
+}
+#endif
+
 const uint32_t AES::Te0[256] = {
 	0xC66363A5U, 0xF87C7C84U, 0xEE777799U, 0xF67B7B8DU, 0xFFF2F20DU, 0xD66B6BBDU, 0xDE6F6FB1U, 0x91C5C554U,
 	0x60303050U, 0x02010103U, 0xCE6767A9U, 0x562B2B7DU, 0xE7FEFE19U, 0xB5D7D762U, 0x4DABABE6U, 0xEC76769AU,
@@ -369,8 +518,15 @@ AES::AES()
 	std::fill_n(_iv, 16, 0);
 	std::fill_n(_erk, 60, 0);
 	std::fill_n(_drk, 60, 0);
+	std::fill_n(_erk_ni, 240, 0);
+	std::fill_n(_drk_ni, 240, 0);
 
 	_tp = 0;
+	_aesni = false;
+
+#ifdef AES_AESNI
+	_aesni = __builtin_cpu_supports("aes") && __builtin_cpu_supports("sse2");
+#endif
 }
 
 AES::~AES()
@@ -383,6 +539,8 @@ void AES::CleanUp()
 	std::fill_n(_iv, 16, 0);
 	std::fill_n(_erk, 60, 0);
 	std::fill_n(_drk, 60, 0);
+	std::fill_n(_erk_ni, 240, 0);
+	std::fill_n(_drk_ni, 240, 0);
 	_tp = 0;
 }
 
@@ -425,16 +583,39 @@ void AES::SetKey(const uint8_t *key, Mode mode)
 		_drk[i] = Td0[Te4[(_drk[i] >> 24)] & 0xFF] ^ Td1[Te4[(_drk[i] >> 16) & 0xFF] & 0xFF] ^ Td2[Te4[(_drk[i] >> 8) & 0xFF] & 0xFF] ^ Td3[Te4[_drk[i] & 0xFF] & 0xFF];
 	}
 
+#ifdef AES_AESNI
+	if (_aesni) {
+		// Same schedule, stored as bytes. aesdec wants the encryption keys
+		// in reverse order with InvMixColumns applied to the inner ones.
+		for (i = 0; i < ks_sz; i += 4) {
+			for (int j = 0; j < 4; j++) {
+				uint32_t ek = htobe32(_erk[i + j]);
+				uint32_t dk = htobe32(_erk[ks_sz - i - 4 + j]);
+				std::copy_n(reinterpret_cast<const uint8_t *>(&ek), 4, _erk_ni + 4 * (i + j));
+				std::copy_n(reinterpret_cast<const uint8_t *>(&dk), 4, _drk_ni + 4 * (i + j));
+			}
+		}
+		InvMixKeysNI(_drk_ni, Nr);
+	}
+#endif
+
 	SetIV(0);
 }
 
-void AES::Encrypt(const void *src, void *dst)
+void AES::Encrypt(const void *src, void *dst) const
 {
 	const uint32_t * const s = reinterpret_cast<const uint32_t *>(src);
 	uint32_t * const d = reinterpret_cast<uint32_t *>(dst);
 	uint32_t s0, s1, s2, s3, t0, t1, t2, t3;
 	int r, ki;
 
+#ifdef AES_AESNI
+	if (_aesni) {
+		EncryptNI(src, dst, _erk_ni, Nr);
+		return;
+	}
+#endif
+
 	s0 = be32toh(s[0]) ^ _erk[0];
 	s1 = be32toh(s[1]) ^ _erk[1];
 	s2 = be32toh(s[2]) ^ _erk[2];
@@ -466,13 +647,20 @@ void AES::Encrypt(const void *src, void *dst)
 	d[3] = htobe32(s3);
 }
 
-void AES::Decrypt(const void *src, void *dst)
+void AES::Decrypt(const void *src, void *dst) const
 {
 	const uint32_t * const s = reinterpret_cast<const uint32_t *>(src);
 	uint32_t * const d = reinterpret_cast<uint32_t *>(dst);
 	uint32_t s0, s1, s2, s3, t0, t1, t2, t3;
 	int r, ki;
 
+#ifdef AES_AESNI
+	if (_aesni) {
+		DecryptNI(src, dst, _drk_ni, Nr);
+		return;
+	}
+#endif
+
 	s0 = be32toh(s[0]) ^ _drk[0];
 	s1 = be32toh(s[1]) ^ _drk[1];
 	s2 = be32toh(s[2]) ^ _drk[2];
@@ -504,6 +692,36 @@ void AES::Decrypt(const void *src, void *dst)
 	d[3] = htobe32(s3);
 }
 
+void AES::EncryptBlocks(const uint8_t *src, uint8_t *dst, size_t count) const
+{
+	size_t i;
+
+#ifdef AES_AESNI
+	if (_aesni) {
+		CryptBlocksNI<true>(src, dst, count, _erk_ni, Nr);
+		return;
+	}
+#endif
+
+	for (i = 0; i < count; i++)
+		Encrypt(src + 16 * i, dst + 16 * i);
+}
+
+void AES::DecryptBlocks(const uint8_t *src, uint8_t *dst, size_t count) const
+{
+	size_t i;
+
+#ifdef AES_AESNI
+	if (_aesni) {
+		CryptBlocksNI<false>(src, dst, count, _drk_ni, Nr);
+		return;
+	}
+#endif
+
+	for (i = 0; i < count; i++)
+		Decrypt(src + 16 * i, dst + 16 * i);
+}
+
 void AES::SetIV(const uint8_t *iv)
 {
 	size_t j;
@@ -533,6 +751,13 @@ void AES::DecryptCBC(const uint8_t *src, uint8_t *dst, size_t size)
 	size_t i, j;
 	uint8_t tmp[16];
 
+#ifdef AES_AESNI
+	if (_aesni) {
+		DecryptCBCNI(src, dst, size, _iv, _drk_ni, Nr);
+		return;
+	}
+#endif
+
 	for (i = 0; i < size; i += 16) {
 		for (j = 0; j < 16; j++) tmp[j] = src[i+j];
 		Decrypt(&src[i], &dst[i]);
@@ -543,6 +768,31 @@ void AES::DecryptCBC(const uint8_t *src, uint8_t *dst, size_t size)
 	}
 }
 
+void AES::DecryptCBC(const uint8_t *src, uint8_t *dst, size_t size, const uint8_t *iv) const
+{
+	size_t i, j;
+	uint8_t chain[16];
+	uint8_t tmp[16];
+
+	for (j = 0; j < 16; j++) chain[j] = iv[j];
+
+#ifdef AES_AESNI
+	if (_aesni) {
+		DecryptCBCNI(src, dst, size, chain, _drk_ni, Nr);
+		return;
+	}
+#endif
+
+	for (i = 0; i < size; i += 16) {
+		for (j = 0; j < 16; j++) tmp[j] = src[i+j];
+		Decrypt(&src[i], &dst[i]);
+		for (j = 0; j < 16; j++) {
+			dst[i+j] ^= chain[j];
+			chain[j] = tmp[j];
+		}
+	}
+}
+
 void AES::EncryptCFB(const uint8_t *src, uint8_t *dst, size_t size)
 {
 	size_t i;
@@ -11,6 +11,9 @@
  *
  * Several chaining modes are supported, namely ECB, CBC, CFB and OFB.
  *
+ * On x86 CPUs with AES-NI, the hardware instructions are used; otherwise
+ * the table implementation.
+ *
  * Usage:
  *
  * @li Set a key with SetKey.
@@ -72,7 +75,7 @@ public:
 	 * @param src Plaintext block (128 bits, 16 bytes)
 	 * @param dst Encrypted block (128 bits, 16 bytes)
 	 */
-	void Encrypt(const void *src, void *dst);
+	void Encrypt(const void *src, void *dst) const;
 
 	/**
 	 * @brief Decrypt Block
@@ -82,7 +85,31 @@ public:
 	 * @param src Encrypted block (128 bits, 16 bytes)
 	 * @param dst Decrypted block (128 bits, 16 bytes)
 	 */
-	void Decrypt(const void *src, void *dst);
+	void Decrypt(const void *src, void *dst) const;
+
+	/**
+	 * @brief Encrypt Blocks
+	 *
+	 * Encrypts count independent blocks of 16 bytes (ECB mode). Faster than
+	 * calling Encrypt for each block, as several blocks are processed at
+	 * once.
+	 *
+	 * @param src Plaintext data.
+	 * @param dst Encrypted data.
+	 * @param count Number of blocks.
+	 */
+	void EncryptBlocks(const uint8_t *src, uint8_t *dst, size_t count) const;
+
+	/**
+	 * @brief Decrypt Blocks
+	 *
+	 * Decrypts count independent blocks of 16 bytes (ECB mode).
+	 *
+	 * @param src Encrypted data.
+	 * @param dst Decrypted data.
+	 * @param count Number of blocks.
+	 */
+	void DecryptBlocks(const uint8_t *src, uint8_t *dst, size_t count) const;
 
 	/**
 	 * @brief Encrypt CBC
@@ -106,6 +133,20 @@ public:
 	 */
 	void DecryptCBC(const uint8_t *src, uint8_t *dst, size_t size);
 
+	/**
+	 * @brief Decrypt CBC with explicit IV
+	 *
+	 * Decrypt data in CBC mode, starting from the given IV. The IV stored
+	 * in the instance is neither used nor modified, so several threads may
+	 * call this on the same instance at the same time.
+	 *
+	 * @param src Encrypted data.
+	 * @param dst Decrypted data.
+	 * @param size Number of bytes. Must be a multiple of 16.
+	 * @param iv Initialization Vector (16 bytes).
+	 */
+	void DecryptCBC(const uint8_t *src, uint8_t *dst, size_t size, const uint8_t *iv) const;
+
 	/**
 	 * @brief Encrypt CFB
 	 *
@@ -144,6 +185,12 @@ private:
 	uint32_t _erk[60];
 	/// Decryption round key.
 	uint32_t _drk[60];
+	/// Encryption round key in AES-NI layout.
+	alignas(16) uint8_t _erk_ni[240];
+	/// Decryption round key in AES-NI layout.
+	alignas(16) uint8_t _drk_ni[240];
+	/// Use the AES-NI instructions instead of the tables.
+	bool _aesni;
 	/// Initialization vector.
 	uint8_t _iv[16];
 	/// Byte counter for CFB / OFB modes.
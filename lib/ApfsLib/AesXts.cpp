@@ -67,6 +67,73 @@ void AesXts::Decrypt(uint8_t* plain, const uint8_t* cipher, std::size_t size, ui
 	}
 }
 
+bool AesXts::DecryptUnits(uint8_t* plain, const uint8_t* cipher, std::size_t size, std::size_t unit_size, uint64_t unit_no) const
+{
+	// Number of blocks handled per batch
+	constexpr size_t batch_blocks = 0x100;
+
+	alignas(16) uint64_t tweaks[batch_blocks * 2];
+	alignas(16) uint64_t start[batch_blocks * 2];
+	size_t unit_blocks;
+	size_t batch_units;
+	size_t units;
+	size_t blocks;
+	size_t u;
+	size_t b;
+	size_t n;
+
+	if (unit_size == 0 || (unit_size & 0xF) != 0 || unit_size > batch_blocks * 0x10 || (size % unit_size) != 0)
+		return false;
+
+	unit_blocks = unit_size / 0x10;
+	batch_units = batch_blocks / unit_blocks;
+
+	while (size > 0)
+	{
+		units = std::min(batch_units, size / unit_size);
+		blocks = units * unit_blocks;
+
+		// Initial tweak of every unit in the batch
+		for (u = 0; u < units; u++)
+		{
+			start[2 * u] = htole64(unit_no + u);
+			start[2 * u + 1] = 0;
+		}
+
+		m_aes_2.EncryptBlocks(reinterpret_cast<const uint8_t *>(start), reinterpret_cast<uint8_t *>(start), units);
+
+		// The following tweaks of each unit are multiples of it
+		for (u = 0; u < units; u++)
+		{
+			uint64_t *t = tweaks + 2 * u * unit_blocks;
+
+			t[0] = start[2 * u];
+			t[1] = start[2 * u + 1];
+			for (b = 1; b < unit_blocks; b++)
+			{
+				t[2 * b] = t[2 * b - 2];
+				t[2 * b + 1] = t[2 * b - 1];
+				MultiplyTweak(t + 2 * b);
+			}
+		}
+
+		for (n = 0; n < blocks; n++)
+			Xor128(plain + 0x10 * n, cipher + 0x10 * n, tweaks + 2 * n);
+
+		m_aes_1.DecryptBlocks(plain, plain, blocks);
+
+		for (n = 0; n < blocks; n++)
+			Xor128(plain + 0x10 * n, plain + 0x10 * n, tweaks + 2 * n);
+
+		plain += blocks * 0x10;
+		cipher += blocks * 0x10;
+		size -= blocks * 0x10;
+		unit_no += units;
+	}
+
+	return true;
+}
+
 void AesXts::Xor128(void *out, const void *op1, const void *op2)
 {
 	uint64_t *val64 = reinterpret_cast<uint64_t *>(out);
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 
 #include "Aes.h"
@@ -17,9 +18,17 @@ public:
 	void Encrypt(uint8_t *cipher, const uint8_t *plain, size_t size, uint64_t unit_no);
 	void Decrypt(uint8_t *plain, const uint8_t *cipher, size_t size, uint64_t unit_no);
 
+	// Decrypts consecutive data units of unit_size bytes, starting at
+	// unit_no. unit_size must be a multiple of 16 and at most 4096, and
+	// size a multiple of unit_size; otherwise nothing is decrypted and
+	// false is returned. The tweaks are computed in batches and the blocks
+	// decrypted several at a time, so this is much faster than calling
+	// Decrypt per unit. Safe to call from several threads at once.
+	bool DecryptUnits(uint8_t *plain, const uint8_t *cipher, size_t size, size_t unit_size, uint64_t unit_no) const;
+
 private:
-	void Xor128(void *out, const void *op1, const void *op2);
-	void MultiplyTweak(uint64_t *tweak);
+	static void Xor128(void *out, const void *op1, const void *op2);
+	static void MultiplyTweak(uint64_t *tweak);
 
 	AES m_aes_1;
 	AES m_aes_2;
@@ -0,0 +1,69 @@
+#include <algorithm>
+
+#include "ApfsCatalog.h"
+
+ApfsCatalog::ApfsCatalog()
+{
+}
+
+ApfsCatalog::~ApfsCatalog()
+{
+}
+
+void ApfsCatalog::Clear()
+{
+	m_inodes.clear();
+	m_children.clear();
+	m_names.clear();
+	m_attrs.clear();
+	m_xdata.clear();
+	m_streams.clear();
+	m_extents.clear();
+}
+
+const ApfsCatalog::Inode *ApfsCatalog::GetInode(uint64_t id) const
+{
+	auto it = std::lower_bound(m_inodes.begin(), m_inodes.end(), id, [](const Inode &ino, uint64_t id) { return ino.obj_id < id; });
+
+	if (it == m_inodes.end() || it->obj_id != id)
+		return nullptr;
+
+	return &*it;
+}
+
+const ApfsCatalog::Attr *ApfsCatalog::GetAttr(const Inode &ino, AttrType type) const
+{
+	for (uint32_t k = 0; k < ino.attr_cnt; k++)
+	{
+		if (m_attrs[ino.attr_idx + k].type == type)
+			return &m_attrs[ino.attr_idx + k];
+	}
+
+	return nullptr;
+}
+
+const ApfsCatalog::Extent *ApfsCatalog::FindExtent(uint64_t id, uint64_t offs) const
+{
+	auto st = std::lower_bound(m_streams.begin(), m_streams.end(), id, [](const Stream &s, uint64_t id) { return s.id < id; });
+
+	if (st == m_streams.end() || st->id != id)
+		return nullptr;
+
+	const Extent *beg = m_extents.data() + st->ext_idx;
+	const Extent *end = beg + st->ext_cnt;
+	const Extent *ext = std::upper_bound(beg, end, offs, [](uint64_t offs, const Extent &e) { return offs < e.logical_addr; });
+
+	if (ext == beg)
+		return nullptr;
+
+	return ext - 1;
+}
+
+void ApfsCatalog::AddExtent(uint64_t id, const Extent &ext)
+{
+	if (m_streams.empty() || m_streams.back().id != id)
+		m_streams.push_back(Stream{ id, m_extents.size(), 0 });
+
+	m_extents.push_back(ext);
+	m_streams.back().ext_cnt++;
+}
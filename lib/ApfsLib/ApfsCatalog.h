@@ -0,0 +1,105 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "ApfsTypes.h"
+
+class ApfsDir;
+
+// In-memory copy of the metadata of a volume that is needed to extract it:
+// the inodes, the directory entries, a few attributes and the file extents.
+// It is filled by ApfsDir::BuildCatalog in a single pass over the leaves of
+// the fs tree. Records of one object are adjacent in key order, so children
+// and attributes are stored as ranges of the inode they belong to, and
+// inodes and extents are sorted by id. The arrays can grow past 4 GiB on
+// large volumes, so the indices into them are size_t.
+class ApfsCatalog
+{
+public:
+	enum AttrType
+	{
+		ATTR_DECMPFS,
+		ATTR_RSRC_FORK,
+		ATTR_SYMLINK
+	};
+
+	struct Inode
+	{
+		uint64_t obj_id;
+		uint64_t private_id;
+		uint64_t size;
+		size_t attr_idx;
+		size_t child_idx;
+		size_t child_cnt;
+		uint32_t bsd_flags;
+		uint16_t mode;
+		uint16_t attr_cnt;
+	};
+
+	struct Child
+	{
+		uint64_t file_id;
+		size_t name_idx;
+		uint16_t flags;
+	};
+
+	struct Attr
+	{
+		uint16_t type;
+		uint16_t flags;
+		// Embedded data, index into m_xdata
+		size_t data_idx;
+		uint64_t size;
+		// Only for XATTR_DATA_STREAM
+		uint64_t alloced_size;
+		uint64_t stream_id;
+	};
+
+	struct Extent
+	{
+		uint64_t logical_addr;
+		uint64_t len;
+		paddr_t paddr;
+		uint64_t crypto_id;
+	};
+
+	ApfsCatalog();
+	~ApfsCatalog();
+
+	ApfsCatalog(const ApfsCatalog &o) = delete;
+	ApfsCatalog &operator=(const ApfsCatalog &o) = delete;
+
+	void Clear();
+
+	size_t GetInodeCnt() const { return m_inodes.size(); }
+	const Inode *GetInode(uint64_t id) const;
+	const Child &GetChild(const Inode &ino, size_t k) const { return m_children[ino.child_idx + k]; }
+	const char *GetName(const Child &c) const { return m_names.data() + c.name_idx; }
+	const Attr *GetAttr(const Inode &ino, AttrType type) const;
+	const uint8_t *GetAttrData(const Attr &attr) const { return m_xdata.data() + attr.data_idx; }
+	// Returns the extent of stream id that starts at or before offs.
+	const Extent *FindExtent(uint64_t id, uint64_t offs) const;
+
+private:
+	friend class ApfsDir;
+
+	struct Stream
+	{
+		uint64_t id;
+		size_t ext_idx;
+		size_t ext_cnt;
+	};
+
+	// Extents have to be added in (id, logical_addr) order.
+	void AddExtent(uint64_t id, const Extent &ext);
+
+	std::vector<Inode> m_inodes;
+	std::vector<Child> m_children;
+	std::vector<char> m_names;
+	std::vector<Attr> m_attrs;
+	std::vector<uint8_t> m_xdata;
+	std::vector<Stream> m_streams;
+	std::vector<Extent> m_extents;
+};
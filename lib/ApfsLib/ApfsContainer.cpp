@@ -23,6 +23,7 @@
 
 #include "ApfsContainer.h"
 #include "ApfsVolume.h"
+#include "BTreeNodeCache.h"
 #include "Util.h"
 #include "BlockDumper.h"
 #include "Global.h"
@@ -37,6 +38,7 @@ ApfsContainer::ApfsContainer(Device *disk_main, uint64_t main_start, uint64_t ma
 	m_tier2_disk(disk_tier2),
 	m_tier2_part_start(tier2_start),
 	m_tier2_part_len(tier2_len),
+	m_cache_domain(BTreeNodeCache::NewDomain()),
 	m_cpm(*this),
 	m_omap(*this),
 	// m_omap_tree(*this),
@@ -45,10 +47,20 @@ ApfsContainer::ApfsContainer(Device *disk_main, uint64_t main_start, uint64_t ma
 	m_keymgr(*this)
 {
 	m_sm = nullptr;
+	m_prefetch_pool = nullptr;
+
+	if (g_threads != 1 && g_btree_readahead > 0)
+		m_prefetch_pool = &ThreadPool::Get();
 }
 
 ApfsContainer::~ApfsContainer()
 {
+	// Running prefetches would refill the cache after the purge. The
+	// volumes have already waited for theirs.
+	m_omap.WaitPrefetch();
+	m_fq_tree_mgr.WaitPrefetch();
+	m_fq_tree_vol.WaitPrefetch();
+	BTreeNodeCache::Get().Purge(m_cache_domain);
 }
 
 bool ApfsContainer::Init(xid_t req_xid)
@@ -307,6 +319,30 @@ bool ApfsContainer::ReadBlocks(uint8_t * data, paddr_t paddr, uint64_t blkcnt) c
 	}
 }
 
+const uint8_t *ApfsContainer::MapBlocks(paddr_t paddr, uint64_t blkcnt) const
+{
+	uint64_t offs;
+	uint64_t size;
+
+	offs = m_nx.nx_block_size * paddr;
+	size = m_nx.nx_block_size * blkcnt;
+
+	if (offs & FUSION_TIER2_DEVICE_BYTE_ADDR)
+	{
+		if (!m_tier2_disk)
+			return nullptr;
+
+		return m_tier2_disk->GetMapping(offs - FUSION_TIER2_DEVICE_BYTE_ADDR + m_tier2_part_start, size);
+	}
+	else
+	{
+		if (!m_main_disk)
+			return nullptr;
+
+		return m_main_disk->GetMapping(offs + m_main_part_start, size);
+	}
+}
+
 bool ApfsContainer::ReadAndVerifyHeaderBlock(uint8_t * data, paddr_t paddr) const
 {
 	if (!ReadBlocks(data, paddr))
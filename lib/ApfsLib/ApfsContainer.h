@@ -26,8 +26,10 @@
 #include "CheckPointMap.h"
 #include "ApfsNodeMapperBTree.h"
 #include "KeyMgmt.h"
+#include "ThreadPool.h"
 
 #include <cstdint>
+#include <memory>
 #include <vector>
 
 class ApfsVolume;
@@ -47,10 +49,16 @@ public:
 
 	bool ReadBlocks(uint8_t *data, paddr_t paddr, uint64_t blkcnt = 1) const;
 	bool ReadAndVerifyHeaderBlock(uint8_t *data, paddr_t paddr) const;
+	// Pointer to the blocks if the device is memory mapped, else nullptr.
+	const uint8_t *MapBlocks(paddr_t paddr, uint64_t blkcnt = 1) const;
 
 	uint32_t GetBlocksize() const { return m_nx.nx_block_size; }
 	uint64_t GetBlockCount() const { return m_nx.nx_block_count; }
 	uint64_t GetFreeBlocks() const { return m_sm->sm_dev[SD_MAIN].sm_free_count + m_sm->sm_dev[SD_TIER2].sm_free_count; }
+	// Physical trees of this container share this node cache domain.
+	uint64_t GetCacheDomain() const { return m_cache_domain; }
+	// Pool for B-tree readahead, nullptr if disabled.
+	ThreadPool *GetPrefetchPool() const { return m_prefetch_pool; }
 
 	bool GetVolumeKey(uint8_t *key, const apfs_uuid_t &vol_uuid, const char *password = nullptr);
 	bool GetPasswordHint(std::string &hint, const apfs_uuid_t &vol_uuid);
@@ -68,6 +76,8 @@ private:
 
 	std::string m_passphrase;
 
+	const uint64_t m_cache_domain;
+
 	nx_superblock_t m_nx;
 
 	CheckPointMap m_cpm;
@@ -82,4 +92,7 @@ private:
 	BTree m_fq_tree_vol;
 
 	KeyManager m_keymgr;
+
+	// Runs the prefetches of all trees of the container and its volumes
+	ThreadPool *m_prefetch_pool;
 };
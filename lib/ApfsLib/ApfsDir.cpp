@@ -39,6 +39,23 @@ void strcpy_s(char (&dst)[L], const char *src)
 }
 #endif
 
+struct ApfsDir::StdDirKeyCompare
+{
+	static constexpr bool u64_pair = false;
+
+	int operator()(const void *skey, size_t skey_len, const void *ekey, size_t ekey_len) const { return CompareStdDirKey(skey, skey_len, ekey, ekey_len, dir); }
+
+	ApfsDir *dir;
+};
+
+struct ApfsDir::FextKeyCompare
+{
+	// (private_id, logical_addr)
+	static constexpr bool u64_pair = true;
+
+	int operator()(const void *skey, size_t skey_len, const void *ekey, size_t ekey_len) const { return CompareFextKey(skey, skey_len, ekey, ekey_len, nullptr); }
+};
+
 ApfsDir::Inode::Inode()
 {
 	obj_id = 0;
@@ -189,13 +206,20 @@ bool ApfsDir::GetInode(ApfsDir::Inode& res, uint64_t inode)
 
 	key.hdr.obj_id_and_type = APFS_TYPE_ID(APFS_TYPE_INODE, inode);
 
-	rc = m_fs_tree.Lookup(bte, &key, sizeof(j_inode_key_t), CompareStdDirKey, this, true);
+	rc = m_fs_tree.Lookup(bte, &key, sizeof(j_inode_key_t), StdDirKeyCompare{ this }, true);
 
 	if (!rc || (bte.val == nullptr))
 		return false;
 
-	// const uint8_t *idata = reinterpret_cast<const uint8_t *>(bte.val);
-	const j_inode_val_t *obj = reinterpret_cast<const j_inode_val_t *>(bte.val);
+	ParseInode(res, inode, bte.val, bte.val_len);
+
+	return true;
+}
+
+void ApfsDir::ParseInode(ApfsDir::Inode &res, uint64_t inode, const void *val, size_t val_len)
+{
+	// const uint8_t *idata = reinterpret_cast<const uint8_t *>(val);
+	const j_inode_val_t *obj = reinterpret_cast<const j_inode_val_t *>(val);
 
 	res.obj_id = inode;
 
@@ -220,7 +244,7 @@ bool ApfsDir::GetInode(ApfsDir::Inode& res, uint64_t inode)
 
 	// internal_flags & 0x00200000 => pad2 = uncompressed_size ?
 
-	if (bte.val_len > sizeof(j_inode_val_t))
+	if (val_len > sizeof(j_inode_val_t))
 	{
 		const xf_blob_t *xf_hdr = reinterpret_cast<const xf_blob_t *>(obj->xfields);
 		const x_field_t *xf = reinterpret_cast<const x_field_t *>(xf_hdr->xf_data);
@@ -291,21 +315,15 @@ bool ApfsDir::GetInode(ApfsDir::Inode& res, uint64_t inode)
 			xdata += ((xf[n].x_size + 7) & ~7);
 		}
 	}
-
-	return true;
 }
 
 bool ApfsDir::ListDirectory(std::vector<DirRec> &dir, uint64_t inode)
 {
 	uint8_t skey_buf[0x500];
 
-	BTreeIterator it;
-	BTreeEntry bte;
 	bool rc;
 	uint64_t skey;
-
-	const j_key_t *k;
-	const j_drec_val_t *v;
+	size_t skey_len;
 
 	skey = APFS_TYPE_ID(APFS_TYPE_DIR_REC, inode);
 
@@ -317,8 +335,7 @@ bool ApfsDir::ListDirectory(std::vector<DirRec> &dir, uint64_t inode)
 		key->hdr.obj_id_and_type = skey;
 		key->name_len_and_hash = 0;
 		key->name[0] = 0;
-
-		rc = m_fs_tree.GetIterator(it, key, sizeof(j_drec_hashed_key_t), CompareStdDirKey, this);
+		skey_len = sizeof(j_drec_hashed_key_t);
 	}
 	else
 	{
@@ -326,56 +343,50 @@ bool ApfsDir::ListDirectory(std::vector<DirRec> &dir, uint64_t inode)
 		key->hdr.obj_id_and_type = skey;
 		key->name_len = 0;
 		key->name[0] = 0;
-
-		rc = m_fs_tree.GetIterator(it, key, sizeof(j_drec_key_t), CompareStdDirKey, this);
+		skey_len = sizeof(j_drec_key_t);
 	}
 
-	if (!rc)
-		return false;
-
-	for (;;)
+	rc = m_fs_tree.Scan(skey_buf, skey_len, CompareStdDirKey, this, [this, &dir, skey](const void *ekey, size_t ekey_len, const void *eval, size_t eval_len)
 	{
 		DirRec e;
-
-		rc = it.GetEntry(bte);
-		if (!rc)
-			break;
+		const j_key_t *k;
+		const j_drec_val_t *v;
 
 		if (g_debug & Dbg_Dir)
 		{
-			DumpBuffer(reinterpret_cast<const uint8_t *>(bte.key), bte.key_len, "entry key");
-			DumpBuffer(reinterpret_cast<const uint8_t *>(bte.val), bte.val_len, "entry val");
+			DumpBuffer(reinterpret_cast<const uint8_t *>(ekey), ekey_len, "entry key");
+			DumpBuffer(reinterpret_cast<const uint8_t *>(eval), eval_len, "entry val");
 		}
 
-		k = reinterpret_cast<const j_key_t *>(bte.key);
+		k = reinterpret_cast<const j_key_t *>(ekey);
 
 		if (k->obj_id_and_type != skey)
-			break;
+			return false;
 
 		e.parent_id = k->obj_id_and_type & OBJ_ID_MASK;
 
 		if (m_txt_fmt != 0)
 		{
-			const j_drec_hashed_key_t *hk = reinterpret_cast<const j_drec_hashed_key_t *>(bte.key);
+			const j_drec_hashed_key_t *hk = reinterpret_cast<const j_drec_hashed_key_t *>(ekey);
 			e.hash = hk->name_len_and_hash;
 			e.name = reinterpret_cast<const char *>(hk->name);
 		}
 		else
 		{
-			const j_drec_key_t *rk = reinterpret_cast<const j_drec_key_t *>(bte.key);
+			const j_drec_key_t *rk = reinterpret_cast<const j_drec_key_t *>(ekey);
 			e.hash = 0;
 			e.name = reinterpret_cast<const char *>(rk->name);
 		}
 
 		// assert(res.val_len == sizeof(APFS_Name));
 
-		v = reinterpret_cast<const j_drec_val_t *>(bte.val);
+		v = reinterpret_cast<const j_drec_val_t *>(eval);
 
 		e.file_id = v->file_id;
 		e.date_added = v->date_added;
 		e.flags = v->flags;
 
-		if (bte.val_len > sizeof(j_drec_val_t))
+		if (eval_len > sizeof(j_drec_val_t))
 		{
 			const xf_blob_t *xf_hdr = reinterpret_cast<const xf_blob_t *>(v->xfields);
 			const x_field_t *xf = reinterpret_cast<const x_field_t *>(xf_hdr->xf_data);
@@ -402,10 +413,10 @@ bool ApfsDir::ListDirectory(std::vector<DirRec> &dir, uint64_t inode)
 
 		dir.push_back(e);
 
-		it.next();
-	}
+		return true;
+	});
 
-	return true;
+	return rc;
 }
 
 bool ApfsDir::LookupName(ApfsDir::DirRec& res, uint64_t parent_id, const char* name)
@@ -435,7 +446,7 @@ bool ApfsDir::LookupName(ApfsDir::DirRec& res, uint64_t parent_id, const char* n
 		}
 		res.hash = skey->name_len_and_hash;
 
-		rc = m_fs_tree.Lookup(e, skey, sizeof(j_drec_hashed_key_t) + (skey->name_len_and_hash & J_DREC_LEN_MASK), CompareStdDirKey, this, true);
+		rc = m_fs_tree.Lookup(e, skey, sizeof(j_drec_hashed_key_t) + (skey->name_len_and_hash & J_DREC_LEN_MASK), StdDirKeyCompare{ this }, true);
 	}
 	else
 	{
@@ -450,7 +461,7 @@ bool ApfsDir::LookupName(ApfsDir::DirRec& res, uint64_t parent_id, const char* n
 		}
 		res.hash = 0;
 
-		rc = m_fs_tree.Lookup(e, skey, sizeof(j_drec_key_t) + skey->name_len, CompareStdDirKey, this, true);
+		rc = m_fs_tree.Lookup(e, skey, sizeof(j_drec_key_t) + skey->name_len, StdDirKeyCompare{ this }, true);
 	}
 
 	if (!rc)
@@ -473,91 +484,96 @@ bool ApfsDir::LookupName(ApfsDir::DirRec& res, uint64_t parent_id, const char* n
 	return true;
 }
 
-bool ApfsDir::ReadFile(void* data, uint64_t inode, uint64_t offs, size_t size)
+bool ApfsDir::LookupExtent(ApfsCatalog::Extent &ext, uint64_t inode, uint64_t offs)
 {
 	BTreeEntry e;
 	bool rc;
 
-	uint8_t *bdata = reinterpret_cast<uint8_t *>(data);
+	if (m_vol.isSealed()) {
+		fext_tree_key_t key;
+		const fext_tree_key_t *fext_key = nullptr;
+		const fext_tree_val_t *fext_val = nullptr;
 
-	size_t cur_size;
-	uint64_t blk_idx;
-	uint64_t blk_offs;
+		key.private_id = inode;
+		key.logical_addr = offs;
 
-	uint64_t extent_size;
-	uint64_t extent_offs;
-	paddr_t extent_paddr;
-	uint64_t extent_crypto_id;
+		rc = m_vol.fexttree().Lookup(e, &key, sizeof(key), FextKeyCompare(), false);
+		if (!rc) return false;
 
-	while (size > 0)
-	{
-		if (m_vol.isSealed()) {
-			fext_tree_key_t key;
-			const fext_tree_key_t *fext_key = nullptr;
-			const fext_tree_val_t *fext_val = nullptr;
+		fext_key = reinterpret_cast<const fext_tree_key_t *>(e.key);
+		fext_val = reinterpret_cast<const fext_tree_val_t *>(e.val);
 
-			key.private_id = inode;
-			key.logical_addr = offs;
+		ext.logical_addr = fext_key->logical_addr;
+		ext.len = fext_val->len_and_flags & J_FILE_EXTENT_LEN_MASK;
+		ext.paddr = fext_val->phys_block_num;
+		ext.crypto_id = 0; /* TODO: Crypto on sealed volumes? Need later beta for that ... */
+	} else {
+		j_file_extent_key_t key;
+		const j_file_extent_key_t *ext_key = nullptr;
+		const j_file_extent_val_t *ext_val = nullptr;
 
-			rc = m_vol.fexttree().Lookup(e, &key, sizeof(key), CompareFextKey, this, false);
-			if (!rc) return false;
+		key.hdr.obj_id_and_type = APFS_TYPE_ID(APFS_TYPE_FILE_EXTENT, inode);
+		key.logical_addr = offs;
 
-			fext_key = reinterpret_cast<const fext_tree_key_t *>(e.key);
-			fext_val = reinterpret_cast<const fext_tree_val_t *>(e.val);
+		rc = m_fs_tree.Lookup(e, &key, sizeof(key), StdDirKeyCompare{ this }, false);
+
+		if (!rc)
+			return false;
 
-			extent_offs = offs - fext_key->logical_addr;
+		ext_key = reinterpret_cast<const j_file_extent_key_t *>(e.key);
+		ext_val = reinterpret_cast<const j_file_extent_val_t *>(e.val);
 
-			extent_size = fext_val->len_and_flags & J_FILE_EXTENT_LEN_MASK;
-			extent_paddr = fext_val->phys_block_num;
-			extent_crypto_id = 0; /* TODO: Crypto on sealed volumes? Need later beta for that ... */
-		} else {
-			j_file_extent_key_t key;
-			const j_file_extent_key_t *ext_key = nullptr;
-			const j_file_extent_val_t *ext_val = nullptr;
+		if (g_debug & Dbg_Dir)
+		{
+			std::cout << "FileExtent " << ext_key->hdr.obj_id_and_type << " " << ext_key->logical_addr << " => ";
+			std::cout << ext_val->len_and_flags << " " << ext_val->phys_block_num << " " << ext_val->crypto_id << std::endl;
+		}
 
-			key.hdr.obj_id_and_type = APFS_TYPE_ID(APFS_TYPE_FILE_EXTENT, inode);
-			key.logical_addr = offs;
+		if (ext_key->hdr.obj_id_and_type != key.hdr.obj_id_and_type)
+			return false;
 
-			if (g_debug & Dbg_Dir)
-				std::cout << "ReadFile(inode=" << inode << ",offs=" << offs << ",size=" << size << ")" << std::endl;
+		// Remove flags from length member
+		ext.logical_addr = ext_key->logical_addr;
+		ext.len = ext_val->len_and_flags & J_FILE_EXTENT_LEN_MASK;
+		ext.paddr = ext_val->phys_block_num;
+		ext.crypto_id = ext_val->crypto_id;
+	}
 
-			rc = m_fs_tree.Lookup(e, &key, sizeof(key), CompareStdDirKey, this, false);
+	return true;
+}
 
-			if (!rc)
-				return false;
+template<typename F>
+bool ApfsDir::ReadExtents(void *data, uint64_t offs, size_t size, F &&lookup)
+{
+	ApfsCatalog::Extent ext;
 
-			ext_key = reinterpret_cast<const j_file_extent_key_t *>(e.key);
-			ext_val = reinterpret_cast<const j_file_extent_val_t *>(e.val);
+	uint8_t *bdata = reinterpret_cast<uint8_t *>(data);
 
-			if (g_debug & Dbg_Dir)
-			{
-				std::cout << "FileExtent " << ext_key->hdr.obj_id_and_type << " " << ext_key->logical_addr << " => ";
-				std::cout << ext_val->len_and_flags << " " << ext_val->phys_block_num << " " << ext_val->crypto_id << std::endl;
-			}
+	size_t cur_size;
+	uint64_t blk_idx;
+	uint64_t blk_offs;
 
-			if (ext_key->hdr.obj_id_and_type != key.hdr.obj_id_and_type)
-				return false;
+	uint64_t extent_offs;
 
-			// Remove flags from length member
-			extent_offs = offs - ext_key->logical_addr;
+	while (size > 0)
+	{
+		if (!lookup(ext, offs))
+			return false;
 
-			extent_size = ext_val->len_and_flags & J_FILE_EXTENT_LEN_MASK;
-			extent_paddr = ext_val->phys_block_num;
-			extent_crypto_id = ext_val->crypto_id;
-		}
+		extent_offs = offs - ext.logical_addr;
 
 		blk_idx = extent_offs >> m_blksize_sh;
 		blk_offs = extent_offs & m_blksize_mask_lo;
 
 		cur_size = size;
 
-		if ((extent_offs + cur_size) > extent_size)
-			cur_size = extent_size - extent_offs;
+		if ((extent_offs + cur_size) > ext.len)
+			cur_size = ext.len - extent_offs;
 
 		if (cur_size == 0)
 			break;
 
-		if (extent_paddr != 0)
+		if (ext.paddr != 0)
 		{
 			if (blk_offs == 0 && cur_size > m_blksize)
 				cur_size &= m_blksize_mask_hi;
@@ -565,15 +581,15 @@ bool ApfsDir::ReadFile(void* data, uint64_t inode, uint64_t offs, size_t size)
 			if (blk_offs == 0 && (cur_size & m_blksize_mask_lo) == 0)
 			{
 				if (g_debug & Dbg_Dir)
-					std::cout << "Full read blk " << extent_paddr + blk_idx << " cnt " << (cur_size >> m_blksize_sh) << std::endl;
-				m_vol.ReadBlocks(bdata, extent_paddr + blk_idx, cur_size >> m_blksize_sh, extent_crypto_id + blk_idx);
+					std::cout << "Full read blk " << ext.paddr + blk_idx << " cnt " << (cur_size >> m_blksize_sh) << std::endl;
+				m_vol.ReadBlocks(bdata, ext.paddr + blk_idx, cur_size >> m_blksize_sh, ext.crypto_id + blk_idx);
 			}
 			else
 			{
 				if (g_debug & Dbg_Dir)
-					std::cout << "Partial read blk " << extent_paddr + blk_idx << " cnt 1" << std::endl;
+					std::cout << "Partial read blk " << ext.paddr + blk_idx << " cnt 1" << std::endl;
 
-				m_vol.ReadBlocks(m_tmp_blk.data(), extent_paddr + blk_idx, 1, extent_crypto_id + blk_idx);
+				m_vol.ReadBlocks(m_tmp_blk.data(), ext.paddr + blk_idx, 1, ext.crypto_id + blk_idx);
 
 				if (blk_offs + cur_size > m_blksize)
 					cur_size = m_blksize - blk_offs;
@@ -595,46 +611,58 @@ bool ApfsDir::ReadFile(void* data, uint64_t inode, uint64_t offs, size_t size)
 	return true;
 }
 
+bool ApfsDir::ReadFile(void* data, uint64_t inode, uint64_t offs, size_t size)
+{
+	if (g_debug & Dbg_Dir)
+		std::cout << "ReadFile(inode=" << inode << ",offs=" << offs << ",size=" << size << ")" << std::endl;
+
+	return ReadExtents(data, offs, size, [this, inode](ApfsCatalog::Extent &ext, uint64_t offs)
+	{
+		return LookupExtent(ext, inode, offs);
+	});
+}
+
+bool ApfsDir::ReadFile(void *data, const ApfsCatalog &cat, uint64_t inode, uint64_t offs, size_t size)
+{
+	return ReadExtents(data, offs, size, [&cat, inode](ApfsCatalog::Extent &ext, uint64_t offs)
+	{
+		const ApfsCatalog::Extent *e = cat.FindExtent(inode, offs);
+
+		if (!e)
+			return false;
+
+		ext = *e;
+		return true;
+	});
+}
+
 bool ApfsDir::ListAttributes(std::vector<std::string>& names, uint64_t inode)
 {
 	j_inode_key_t skey;
-	const j_xattr_key_t *ekey;
-	BTreeIterator it;
-	BTreeEntry res;
-	bool rc;
 
 	skey.hdr.obj_id_and_type = APFS_TYPE_ID(APFS_TYPE_INODE, inode);
 
-	rc = m_fs_tree.GetIterator(it, &skey, sizeof(j_inode_key_t), CompareStdDirKey, this);
-	if (!rc)
-		return false;
-
-	for (;;)
+	return m_fs_tree.Scan(&skey, sizeof(j_inode_key_t), CompareStdDirKey, this, [&names, inode](const void *key, size_t key_len, const void *val, size_t val_len)
 	{
-		rc = it.GetEntry(res);
-		if (!rc)
-			break;
+		const j_xattr_key_t *ekey = reinterpret_cast<const j_xattr_key_t *>(key);
 
-		ekey = reinterpret_cast<const j_xattr_key_t *>(res.key);
+		(void)key_len;
+		(void)val;
+		(void)val_len;
 
 		if ((ekey->hdr.obj_id_and_type & OBJ_ID_MASK) != inode)
-			break;
+			return false;
 
 		if ((ekey->hdr.obj_id_and_type >> OBJ_TYPE_SHIFT) < APFS_TYPE_XATTR)
-		{
-			it.next();
-			continue;
-		}
+			return true;
 
 		if ((ekey->hdr.obj_id_and_type >> OBJ_TYPE_SHIFT) > APFS_TYPE_XATTR)
-			break;
+			return false;
 
 		names.push_back(reinterpret_cast<const char *>(ekey->name));
 
-		it.next();
-	}
-
-	return true;
+		return true;
+	});
 }
 
 bool ApfsDir::GetAttribute(std::vector<uint8_t>& data, uint64_t inode, const char* name)
@@ -656,7 +684,7 @@ bool ApfsDir::GetAttribute(std::vector<uint8_t>& data, uint64_t inode, const cha
 	skey->name_len = static_cast<int16_t>(name_len);
 	memcpy(skey->name, name, skey->name_len);
 
-	rc = m_fs_tree.Lookup(res, skey, sizeof(j_xattr_key_t) + skey->name_len, CompareStdDirKey, this, true);
+	rc = m_fs_tree.Lookup(res, skey, sizeof(j_xattr_key_t) + skey->name_len, StdDirKeyCompare{ this }, true);
 	if (!rc)
 		return false;
 
@@ -722,7 +750,7 @@ bool ApfsDir::GetAttributeInfo(ApfsDir::XAttr& attr, uint64_t inode, const char*
 	skey->name_len = static_cast<int16_t>(name_len);
 	memcpy(skey->name, name, skey->name_len);
 
-	rc = m_fs_tree.Lookup(res, skey, sizeof(j_xattr_key_t) + skey->name_len, CompareStdDirKey, this, true);
+	rc = m_fs_tree.Lookup(res, skey, sizeof(j_xattr_key_t) + skey->name_len, StdDirKeyCompare{ this }, true);
 	if (!rc)
 		return false;
 
@@ -739,6 +767,210 @@ bool ApfsDir::GetAttributeInfo(ApfsDir::XAttr& attr, uint64_t inode, const char*
 	return true;
 }
 
+bool ApfsDir::GetAttribute(std::vector<uint8_t> &data, const ApfsCatalog &cat, uint64_t inode, ApfsCatalog::AttrType type)
+{
+	const ApfsCatalog::Inode *ino;
+	const ApfsCatalog::Attr *attr;
+
+	ino = cat.GetInode(inode);
+	if (!ino)
+		return false;
+
+	attr = cat.GetAttr(*ino, type);
+	if (!attr)
+		return false;
+
+	if (attr->flags & XATTR_DATA_STREAM)
+	{
+		data.resize(attr->alloced_size);
+		ReadFile(data.data(), cat, attr->stream_id, 0, data.size());
+		data.resize(attr->size);
+	}
+	else if (attr->flags & XATTR_DATA_EMBEDDED)
+	{
+		const uint8_t *xdata = cat.GetAttrData(*attr);
+		data.assign(xdata, xdata + attr->size);
+	}
+
+	return true;
+}
+
+bool ApfsDir::BuildCatalog(ApfsCatalog &cat)
+{
+	bool rc;
+
+	cat.Clear();
+
+	// All records of an object follow its inode record, so directory
+	// entries and attributes always belong to the last inode added.
+	rc = m_fs_tree.Scan(nullptr, 0, CompareStdDirKey, this, [this, &cat](const void *key, size_t key_len, const void *val, size_t val_len)
+	{
+		const j_key_t *k = reinterpret_cast<const j_key_t *>(key);
+		uint64_t id = k->obj_id_and_type & OBJ_ID_MASK;
+		ApfsCatalog::Inode *ino = nullptr;
+
+		(void)key_len;
+
+		if (!cat.m_inodes.empty() && cat.m_inodes.back().obj_id == id)
+			ino = &cat.m_inodes.back();
+
+		switch (k->obj_id_and_type >> OBJ_TYPE_SHIFT)
+		{
+		case APFS_TYPE_INODE:
+		{
+			Inode res;
+			ApfsCatalog::Inode e;
+
+			ParseInode(res, id, val, val_len);
+
+			e.obj_id = id;
+			e.private_id = res.private_id;
+			e.size = res.ds_size;
+			e.bsd_flags = res.bsd_flags;
+			e.mode = res.mode;
+			e.attr_cnt = 0;
+			e.attr_idx = 0;
+			e.child_idx = 0;
+			e.child_cnt = 0;
+
+			cat.m_inodes.push_back(e);
+		}
+			break;
+		case APFS_TYPE_XATTR:
+		{
+			const j_xattr_key_t *xk = reinterpret_cast<const j_xattr_key_t *>(key);
+			const j_xattr_val_t *xv = reinterpret_cast<const j_xattr_val_t *>(val);
+			const char *name = reinterpret_cast<const char *>(xk->name);
+			ApfsCatalog::Attr a;
+
+			if (!ino)
+				break;
+
+			if (!strcmp(name, "com.apple.decmpfs"))
+				a.type = ApfsCatalog::ATTR_DECMPFS;
+			else if (!strcmp(name, "com.apple.ResourceFork"))
+				a.type = ApfsCatalog::ATTR_RSRC_FORK;
+			else if (!strcmp(name, SYMLINK_EA_NAME))
+				a.type = ApfsCatalog::ATTR_SYMLINK;
+			else
+				break;
+
+			a.flags = xv->flags;
+
+			if (xv->flags & XATTR_DATA_STREAM)
+			{
+				const j_xattr_dstream_t *xs = reinterpret_cast<const j_xattr_dstream_t *>(xv->xdata);
+
+				a.data_idx = 0;
+				a.size = xs->dstream.size;
+				a.alloced_size = xs->dstream.alloced_size;
+				a.stream_id = xs->xattr_obj_id;
+			}
+			else
+			{
+				a.data_idx = cat.m_xdata.size();
+				a.size = xv->xdata_len;
+				a.alloced_size = 0;
+				a.stream_id = 0;
+				cat.m_xdata.insert(cat.m_xdata.end(), xv->xdata, xv->xdata + xv->xdata_len);
+			}
+
+			if (ino->attr_cnt == 0)
+				ino->attr_idx = cat.m_attrs.size();
+			cat.m_attrs.push_back(a);
+			ino->attr_cnt++;
+		}
+			break;
+		case APFS_TYPE_FILE_EXTENT:
+		{
+			const j_file_extent_key_t *ek = reinterpret_cast<const j_file_extent_key_t *>(key);
+			const j_file_extent_val_t *ev = reinterpret_cast<const j_file_extent_val_t *>(val);
+			ApfsCatalog::Extent ext;
+
+			if (m_vol.isSealed())
+				break;
+
+			ext.logical_addr = ek->logical_addr;
+			ext.len = ev->len_and_flags & J_FILE_EXTENT_LEN_MASK;
+			ext.paddr = ev->phys_block_num;
+			ext.crypto_id = ev->crypto_id;
+
+			cat.AddExtent(id, ext);
+		}
+			break;
+		case APFS_TYPE_DIR_REC:
+		{
+			const j_drec_val_t *v = reinterpret_cast<const j_drec_val_t *>(val);
+			const char *name;
+			size_t name_len;
+			ApfsCatalog::Child c;
+
+			if (!ino)
+				break;
+
+			if (m_txt_fmt != 0)
+			{
+				const j_drec_hashed_key_t *hk = reinterpret_cast<const j_drec_hashed_key_t *>(key);
+				name = reinterpret_cast<const char *>(hk->name);
+				name_len = hk->name_len_and_hash & J_DREC_LEN_MASK;
+			}
+			else
+			{
+				const j_drec_key_t *rk = reinterpret_cast<const j_drec_key_t *>(key);
+				name = reinterpret_cast<const char *>(rk->name);
+				name_len = rk->name_len;
+			}
+
+			name_len = strnlen(name, name_len);
+
+			c.file_id = v->file_id;
+			c.name_idx = cat.m_names.size();
+			c.flags = v->flags;
+
+			cat.m_names.insert(cat.m_names.end(), name, name + name_len);
+			cat.m_names.push_back(0);
+
+			if (ino->child_cnt == 0)
+				ino->child_idx = cat.m_children.size();
+			cat.m_children.push_back(c);
+			ino->child_cnt++;
+		}
+			break;
+		default:
+			break;
+		}
+
+		return true;
+	});
+
+	if (!rc)
+		return false;
+
+	if (m_vol.isSealed())
+	{
+		rc = m_vol.fexttree().Scan(nullptr, 0, CompareFextKey, nullptr, [&cat](const void *key, size_t key_len, const void *val, size_t val_len)
+		{
+			const fext_tree_key_t *fk = reinterpret_cast<const fext_tree_key_t *>(key);
+			const fext_tree_val_t *fv = reinterpret_cast<const fext_tree_val_t *>(val);
+			ApfsCatalog::Extent ext;
+
+			(void)key_len;
+			(void)val_len;
+
+			ext.logical_addr = fk->logical_addr;
+			ext.len = fv->len_and_flags & J_FILE_EXTENT_LEN_MASK;
+			ext.paddr = fv->phys_block_num;
+			ext.crypto_id = 0;
+
+			cat.AddExtent(fk->private_id, ext);
+
+			return true;
+		});
+	}
+
+	return rc;
+}
+
 int ApfsDir::CompareStdDirKey(const void *skey, size_t skey_len, const void *ekey, size_t ekey_len, void *context)
 {
 	// assert(skey_len == 8);
@@ -23,6 +23,7 @@
 #include <vector>
 
 #include "DiskStruct.h"
+#include "ApfsCatalog.h"
 
 class BTree;
 class ApfsVolume;
@@ -132,10 +133,25 @@ public:
 	bool GetAttribute(std::vector<uint8_t> &data, uint64_t inode, const char *name);
 	bool GetAttributeInfo(XAttr &attr, uint64_t inode, const char *name);
 
+	// Reads the whole fs tree (and the fext tree of a sealed volume) once
+	// in key order and fills cat from it.
+	bool BuildCatalog(ApfsCatalog &cat);
+	bool ReadFile(void *data, const ApfsCatalog &cat, uint64_t inode, uint64_t offs, size_t size);
+	bool GetAttribute(std::vector<uint8_t> &data, const ApfsCatalog &cat, uint64_t inode, ApfsCatalog::AttrType type);
+
 private:
+	struct StdDirKeyCompare;
+	struct FextKeyCompare;
+
 	static int CompareStdDirKey(const void *skey, size_t skey_len, const void *ekey, size_t ekey_len, void *context);
 	static int CompareFextKey(const void *skey, size_t skey_len, const void *ekey, size_t ekey_len, void *context);
 
+	static void ParseInode(Inode &res, uint64_t inode, const void *val, size_t val_len);
+	bool LookupExtent(ApfsCatalog::Extent &ext, uint64_t inode, uint64_t offs);
+	// lookup(ext, offs) gives the extent containing offs.
+	template<typename F>
+	bool ReadExtents(void *data, uint64_t offs, size_t size, F &&lookup);
+
 	ApfsVolume &m_vol;
 	BTree &m_fs_tree;
 	uint32_t m_txt_fmt;
@@ -18,12 +18,15 @@
 */
 
 #include "ApfsNodeMapper.h"
+#include "BTreeNodeCache.h"
 
-ApfsNodeMapper::ApfsNodeMapper()
+ApfsNodeMapper::ApfsNodeMapper() :
+	m_cache_domain(BTreeNodeCache::NewDomain())
 {
 }
 
 
 ApfsNodeMapper::~ApfsNodeMapper()
 {
+	BTreeNodeCache::Get().Purge(m_cache_domain);
 }
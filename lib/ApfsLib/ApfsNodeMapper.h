@@ -37,4 +37,10 @@ public:
 	virtual ~ApfsNodeMapper();
 
 	virtual bool Lookup(omap_res_t &res, oid_t oid, xid_t xid) = 0;
+
+	// Virtual trees resolved through this mapper share this node cache domain.
+	uint64_t GetCacheDomain() const { return m_cache_domain; }
+
+private:
+	const uint64_t m_cache_domain;
 };
@@ -17,6 +17,7 @@
 	along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 #include <iostream>
@@ -24,28 +25,34 @@
 #include "ApfsNodeMapperBTree.h"
 #include "ApfsContainer.h"
 
-static int CompareOMapKey(const void *skey, size_t skey_len, const void *ekey, size_t ekey_len, void *context)
+bool g_omap_preload = false;
+
+struct OMapKeyCompare
 {
-	(void)context;
-	(void)skey_len;
-	(void)ekey_len;
-
-	assert(skey_len == sizeof(omap_key_t));
-	assert(ekey_len == sizeof(omap_val_t));
-
-	const omap_key_t *skey_map = reinterpret_cast<const omap_key_t *>(skey);
-	const omap_key_t *ekey_map = reinterpret_cast<const omap_key_t *>(ekey);
-
-	if (ekey_map->ok_oid < skey_map->ok_oid)
-		return -1;
-	if (ekey_map->ok_oid > skey_map->ok_oid)
-		return 1;
-	if (ekey_map->ok_xid < skey_map->ok_xid)
-		return -1;
-	if (ekey_map->ok_xid > skey_map->ok_xid)
-		return 1;
-	return 0;
-}
+	static constexpr bool u64_pair = true;
+
+	int operator()(const void *skey, size_t skey_len, const void *ekey, size_t ekey_len) const
+	{
+		(void)skey_len;
+		(void)ekey_len;
+
+		assert(skey_len == sizeof(omap_key_t));
+		assert(ekey_len == sizeof(omap_key_t));
+
+		const omap_key_t *skey_map = reinterpret_cast<const omap_key_t *>(skey);
+		const omap_key_t *ekey_map = reinterpret_cast<const omap_key_t *>(ekey);
+
+		if (ekey_map->ok_oid < skey_map->ok_oid)
+			return -1;
+		if (ekey_map->ok_oid > skey_map->ok_oid)
+			return 1;
+		if (ekey_map->ok_xid < skey_map->ok_xid)
+			return -1;
+		if (ekey_map->ok_xid > skey_map->ok_xid)
+			return 1;
+		return 0;
+	}
+};
 
 ApfsNodeMapperBTree::ApfsNodeMapperBTree(ApfsContainer &container) :
 	m_tree(container),
@@ -69,6 +76,8 @@ bool ApfsNodeMapperBTree::Init(oid_t omap_oid, xid_t xid)
 		return false;
 	}
 
+	m_flat.clear();
+
 	memcpy(&m_omap, blk.data(), sizeof(omap_phys_t));
 
 	if ((m_omap.om_o.o_type & OBJECT_TYPE_MASK) == OBJECT_TYPE_BTREE)
@@ -89,12 +98,15 @@ bool ApfsNodeMapperBTree::Lookup(omap_res_t &omr, oid_t oid, xid_t xid)
 
 	BTreeEntry res;
 
+	if (!m_flat.empty())
+		return LookupFlat(omr, oid, xid);
+
 	key.ok_oid = oid;
 	key.ok_xid = xid;
 
 	// std::cout << std::hex << "Omap Lookup: oid = " << oid << ", xid = " << xid << " => ";
 
-	if (!m_tree.Lookup(res, &key, sizeof(key), CompareOMapKey, this, false))
+	if (!m_tree.Lookup(res, &key, sizeof(key), OMapKeyCompare(), false))
 	{
 		// std::cout << "NOT FOUND" << std::endl;
 		std::cerr << std::hex << "oid " << oid << " xid " << xid << " NOT FOUND!!!" << std::endl;
@@ -128,3 +140,65 @@ bool ApfsNodeMapperBTree::Lookup(omap_res_t &omr, oid_t oid, xid_t xid)
 
 	return true;
 }
+
+bool ApfsNodeMapperBTree::Preload()
+{
+	std::vector<FlatEntry> flat;
+	bool ok = true;
+
+	if (!m_tree.Scan(nullptr, 0, nullptr, nullptr, [&flat, &ok](const void *k, size_t key_len, const void *v, size_t val_len)
+	{
+		const omap_key_t *key = reinterpret_cast<const omap_key_t *>(k);
+		const omap_val_t *val = reinterpret_cast<const omap_val_t *>(v);
+
+		if (key_len != sizeof(omap_key_t) || val_len != sizeof(omap_val_t))
+			return ok = false;
+
+		// LookupFlat relies on the leaf order.
+		if (!flat.empty() && (key->ok_oid < flat.back().oid || (key->ok_oid == flat.back().oid && key->ok_xid <= flat.back().xid)))
+		{
+			std::cerr << "ERROR: omap entries out of order at oid " << std::hex << key->ok_oid << " xid " << key->ok_xid << std::endl;
+			return ok = false;
+		}
+
+		flat.push_back({ key->ok_oid, key->ok_xid, val->ov_flags, val->ov_size, val->ov_paddr });
+		return true;
+	}) || !ok)
+		return false;
+
+	if (g_debug & Dbg_Info)
+		std::cout << "Preloaded " << std::dec << flat.size() << " omap entries." << std::endl;
+
+	flat.shrink_to_fit();
+	m_flat.swap(flat);
+
+	return true;
+}
+
+bool ApfsNodeMapperBTree::LookupFlat(omap_res_t &omr, oid_t oid, xid_t xid) const
+{
+	// Like the tree lookup: the newest mapping of oid not newer than xid.
+	auto it = std::upper_bound(m_flat.begin(), m_flat.end(), std::make_pair(oid, xid), [](const std::pair<oid_t, xid_t> &k, const FlatEntry &e)
+	{
+		return k.first < e.oid || (k.first == e.oid && k.second < e.xid);
+	});
+
+	if (it == m_flat.begin() || (--it)->oid != oid)
+	{
+		std::cerr << std::hex << "oid " << oid << " xid " << xid << " NOT FOUND!!!" << std::endl;
+		return false;
+	}
+
+	if (g_debug & Dbg_Info) {
+		std::cout << std::hex << "Omap Lookup: oid=" << oid << " xid=" << xid << ": ";
+		std::cout << "oid=" << it->oid << " xid=" << it->xid << " => flags=" << it->flags << " size=" << it->size << " paddr=" << it->paddr << std::endl;
+	}
+
+	omr.oid = it->oid;
+	omr.xid = it->xid;
+	omr.flags = it->flags;
+	omr.size = it->size;
+	omr.paddr = it->paddr;
+
+	return true;
+}
@@ -19,6 +19,8 @@
 
 #pragma once
 
+#include <vector>
+
 #include "DiskStruct.h"
 
 #include "ApfsNodeMapper.h"
@@ -35,10 +37,27 @@ public:
 	bool Init(oid_t omap_oid, xid_t xid);
 	bool Lookup(omap_res_t & omr, oid_t oid, xid_t xid) override;
 
+	// Reads all mappings into a flat array sorted by (oid, xid). Lookups are
+	// then a binary search on it instead of a tree walk.
+	bool Preload();
+
 	void dump(BlockDumper &bd) { m_tree.dump(bd); }
+	void WaitPrefetch() { m_tree.WaitPrefetch(); }
 
 private:
+	struct FlatEntry
+	{
+		oid_t oid;
+		xid_t xid;
+		uint32_t flags;
+		uint32_t size;
+		paddr_t paddr;
+	};
+
+	bool LookupFlat(omap_res_t & omr, oid_t oid, xid_t xid) const;
+
 	omap_phys_t m_omap;
+	std::vector<FlatEntry> m_flat;
 	BTree m_tree;
 
 	ApfsContainer &m_container;
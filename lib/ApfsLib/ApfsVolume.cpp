@@ -17,6 +17,8 @@
 	along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
+#include <atomic>
 #include <cstring>
 #include <vector>
 #include <iostream>
@@ -28,6 +30,13 @@
 #include "BlockDumper.h"
 #include "Util.h"
 
+struct ApfsVolume::SnapMetaKeyCompare
+{
+	static constexpr bool u64_pair = false;
+
+	int operator()(const void *skey, size_t skey_len, const void *ekey, size_t ekey_len) const { return CompareSnapMetaKey(skey, skey_len, ekey, ekey_len, nullptr); }
+};
+
 ApfsVolume::ApfsVolume(ApfsContainer &container) :
 	m_container(container),
 	m_omap(container),
@@ -38,10 +47,17 @@ ApfsVolume::ApfsVolume(ApfsContainer &container) :
 {
 	m_apsb_paddr = 0;
 	m_is_encrypted = false;
+	m_pool = nullptr;
 }
 
 ApfsVolume::~ApfsVolume()
 {
+	// Background loads of the trees decrypt with m_aes, which is destroyed
+	// before the trees, so let them finish first.
+	m_fs_tree.WaitPrefetch();
+	m_extentref_tree.WaitPrefetch();
+	m_snap_meta_tree.WaitPrefetch();
+	m_fext_tree.WaitPrefetch();
 }
 
 bool ApfsVolume::Init(paddr_t apsb_paddr)
@@ -68,6 +84,9 @@ bool ApfsVolume::Init(paddr_t apsb_paddr)
 		return false;
 	}
 
+	if (g_omap_preload && !m_omap.Preload())
+		std::cerr << "WARNING: Preloading the volume omap failed, using the tree." << std::endl;
+
 	if ((m_sb.apfs_fs_flags & 3) != APFS_FS_UNENCRYPTED)
 	{
 		uint8_t vek[0x20];
@@ -92,6 +111,9 @@ bool ApfsVolume::Init(paddr_t apsb_paddr)
 
 		m_aes.SetKey(vek, vek + 0x10);
 		m_is_encrypted = true;
+
+		if (g_threads != 1)
+			m_pool = &ThreadPool::Get();
 	}
 
 	if (!m_fs_tree.Init(m_sb.apfs_root_tree_oid, m_sb.apfs_o.o_xid, &m_omap))
@@ -144,7 +166,7 @@ bool ApfsVolume::MountSnapshot(paddr_t apsb_paddr, xid_t snap_xid)
 	}
 
 	snap_key.hdr.obj_id_and_type = APFS_TYPE_ID(APFS_TYPE_SNAP_METADATA, snap_xid);
-	if (!snap_btree.Lookup(snap_entry, &snap_key, sizeof(snap_key), CompareSnapMetaKey, nullptr, true)) {
+	if (!snap_btree.Lookup(snap_entry, &snap_key, sizeof(snap_key), SnapMetaKeyCompare(), true)) {
 		std::cerr << "snap xid not found" << std::endl;
 		return false;
 	}
@@ -156,6 +178,9 @@ bool ApfsVolume::MountSnapshot(paddr_t apsb_paddr, xid_t snap_xid)
 		return false;
 	}
 
+	if (g_omap_preload && !m_omap.Preload())
+		std::cerr << "WARNING: Preloading the volume omap failed, using the tree." << std::endl;
+
 	if (!ReadBlocks(blk.data(), snap_val->sblock_oid, 1, 0)) {
 		std::cerr << "failed to read snapshot superblock" << std::endl;
 		return false;
@@ -194,6 +219,9 @@ bool ApfsVolume::MountSnapshot(paddr_t apsb_paddr, xid_t snap_xid)
 
 		m_aes.SetKey(vek, vek + 0x10);
 		m_is_encrypted = true;
+
+		if (g_threads != 1)
+			m_pool = &ThreadPool::Get();
 	}
 
 	if (!m_fs_tree.Init(m_sb.apfs_root_tree_oid, m_sb.apfs_o.o_xid, &m_omap))
@@ -348,18 +376,37 @@ bool ApfsVolume::ReadBlocks(uint8_t * data, paddr_t paddr, uint64_t blkcnt, uint
 	if (!m_is_encrypted || (xts_tweak == 0))
 		return true;
 
+	// Large reads are decrypted in pieces of this size on the thread pool
+	static constexpr size_t parallel_piece_size = 0x40000;
+
 	uint64_t cs_factor = m_container.GetBlocksize() / encryption_block_size;
 	uint64_t uno = xts_tweak * cs_factor;
 	size_t size = blkcnt * m_container.GetBlocksize();
-	size_t k;
 
-	for (k = 0; k < size; k += encryption_block_size)
+	bool ok;
+
+	if (m_pool && size >= 2 * parallel_piece_size)
 	{
-		m_aes.Decrypt(data + k, data + k, encryption_block_size, uno);
-		uno++;
+		std::atomic<bool> failed(false);
+
+		m_pool->ParallelFor((size + parallel_piece_size - 1) / parallel_piece_size, [this, data, size, uno, &failed](size_t idx)
+		{
+			size_t offs = idx * parallel_piece_size;
+			size_t len = std::min(parallel_piece_size, size - offs);
+
+			if (!m_aes.DecryptUnits(data + offs, data + offs, len, encryption_block_size, uno + offs / encryption_block_size))
+				failed = true;
+		});
+
+		ok = !failed;
 	}
+	else
+		ok = m_aes.DecryptUnits(data, data, size, encryption_block_size, uno);
 
-	return true;
+	if (!ok)
+		std::cerr << "ERROR: ApfsVolume::ReadBlocks: cannot decrypt " << size << " bytes at " << paddr << std::endl;
+
+	return ok;
 }
 
 int ApfsVolume::CompareSnapMetaKey(const void* skey, size_t skey_len, const void* ekey, size_t ekey_len, void* context)
@@ -20,11 +20,13 @@
 #pragma once
 
 #include <cstdint>
+#include <memory>
 
 #include "DiskStruct.h"
 #include "ApfsNodeMapperBTree.h"
 #include "BTree.h"
 #include "AesXts.h"
+#include "ThreadPool.h"
 
 class ApfsContainer;
 class BlockDumper;
@@ -52,6 +54,8 @@ public:
 	bool isSealed() const { return (m_sb.apfs_incompatible_features & APFS_INCOMPAT_SEALED_VOLUME) != 0; }
 
 private:
+	struct SnapMetaKeyCompare;
+
 	static int CompareSnapMetaKey(const void *skey, size_t skey_len, const void *ekey, size_t ekey_len, void *context);
 
 	ApfsContainer &m_container;
@@ -68,4 +72,6 @@ private:
 
 	bool m_is_encrypted;
 	AesXts m_aes;
+	// Decrypts large reads in parallel, only set for encrypted volumes
+	ThreadPool *m_pool;
 };
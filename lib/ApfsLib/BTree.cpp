@@ -17,6 +17,7 @@
 	along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 #include <cstdio>
@@ -28,9 +29,12 @@
 #include "ApfsContainer.h"
 #include "ApfsVolume.h"
 #include "BTree.h"
+#include "BTreeNodeCache.h"
 #include "Util.h"
 #include "BlockDumper.h"
 
+unsigned int g_btree_readahead = 8;
+
 int CompareStdKey(const void *skey, size_t skey_len, const void *ekey, size_t ekey_len, void *context)
 {
 	// assert(skey_len == 8);
@@ -72,14 +76,14 @@ void BTreeEntry::clear()
 	m_node.reset();
 }
 
-BTreeNode::BTreeNode(BTree &tree, const uint8_t *block, size_t blocksize, paddr_t paddr, const std::shared_ptr<BTreeNode> &parent, uint32_t parent_index) :
-	m_tree(tree),
-	m_parent_index(parent_index),
-	m_parent(parent),
+BTreeNode::BTreeNode(BTree &/*tree*/, const uint8_t *block, size_t blocksize, bool owned, paddr_t paddr) :
+	m_block(block),
+	m_blocksize(blocksize),
+	m_owned(owned),
+	m_pair_keys(nullptr),
 	m_paddr(paddr)
 {
-	m_block.assign(block, block + blocksize);
-	m_btn = reinterpret_cast<const btree_node_phys_t *>(m_block.data());
+	m_btn = reinterpret_cast<const btree_node_phys_t *>(m_block);
 
 	assert(m_btn->btn_table_space.off == 0);
 
@@ -90,24 +94,100 @@ BTreeNode::BTreeNode(BTree &tree, const uint8_t *block, size_t blocksize, paddr_
 		m_vals_start = blocksize;
 }
 
-std::shared_ptr<BTreeNode> BTreeNode::CreateNode(BTree & tree, const uint8_t * block, size_t blocksize, paddr_t paddr, const std::shared_ptr<BTreeNode> &parent, uint32_t parent_index)
+std::shared_ptr<BTreeNode> BTreeNode::CreateNode(BTree & tree, const uint8_t * block, size_t blocksize, bool owned, paddr_t paddr)
 {
 	const btree_node_phys_t *btn = reinterpret_cast<const btree_node_phys_t *>(block);
 
 	if (btn->btn_flags & BTNODE_FIXED_KV_SIZE)
-		return std::make_shared<BTreeNodeFix>(tree, block, blocksize, paddr, parent, parent_index);
+		return std::make_shared<BTreeNodeFix>(tree, block, blocksize, owned, paddr);
 	else
-		return std::make_shared<BTreeNodeVar>(tree, block, blocksize, paddr, parent, parent_index);
+		return std::make_shared<BTreeNodeVar>(tree, block, blocksize, owned, paddr);
 }
 
 BTreeNode::~BTreeNode()
 {
+	if (m_owned)
+		BTreeNodeCache::Get().FreeBuffer(const_cast<uint8_t *>(m_block), m_blocksize);
+}
+
+size_t BTreeNode::memsize() const
+{
+	size_t size = std::max(sizeof(BTreeNodeFix), sizeof(BTreeNodeVar));
+
+	if (m_owned)
+		size += m_blocksize;
+
+	return size + m_pair_keys_copy.capacity() * sizeof(uint64_t);
 }
 
-BTreeNodeFix::BTreeNodeFix(BTree &tree, const uint8_t *block, size_t blocksize, paddr_t paddr, const std::shared_ptr<BTreeNode> &parent, uint32_t parent_index) :
-	BTreeNode(tree, block, blocksize, paddr, parent, parent_index)
+int BTreeNode::FindU64PairLE(uint64_t k0, uint64_t k1) const
 {
-	m_entries = reinterpret_cast<const kvoff_t *>(m_block.data() + sizeof(btree_node_phys_t));
+	const uint64_t *base = m_pair_keys;
+	size_t n = entries_cnt();
+	size_t half;
+	bool le;
+
+	if (n == 0)
+		return -1;
+
+	// Branchless: the loop only depends on n, the compiler uses cmov for base.
+	while (n > 1)
+	{
+		half = n / 2;
+		le = (base[2 * half] < k0) | ((base[2 * half] == k0) & (base[2 * half + 1] <= k1));
+		base = le ? base + 2 * half : base;
+		n -= half;
+	}
+
+	le = (base[0] < k0) | ((base[0] == k0) & (base[1] <= k1));
+
+	return le ? static_cast<int>((base - m_pair_keys) / 2) : -1;
+}
+
+BTreeNodeFix::BTreeNodeFix(BTree &tree, const uint8_t *block, size_t blocksize, bool owned, paddr_t paddr) :
+	BTreeNode(tree, block, blocksize, owned, paddr)
+{
+	m_entries = reinterpret_cast<const kvoff_t *>(m_block + sizeof(btree_node_phys_t));
+
+	// The tree info is not known yet while the root node is loaded.
+	if (m_btn->btn_flags & BTNODE_ROOT)
+	{
+		const btree_info_t *info = reinterpret_cast<const btree_info_t *>(m_block + blocksize - sizeof(btree_info_t));
+		m_key_len = info->bt_fixed.bt_key_size;
+		m_val_len = info->bt_fixed.bt_val_size;
+	}
+	else
+	{
+		m_key_len = tree.GetKeyLen();
+		m_val_len = tree.GetValLen();
+	}
+
+	if (m_key_len == 2 * sizeof(uint64_t))
+	{
+		const uint32_t cnt = m_btn->btn_nkeys;
+		bool in_order = true;
+		uint32_t k;
+
+		for (k = 0; k < cnt; k++)
+		{
+			if (m_keys_start + m_entries[k].k + m_key_len > m_vals_start)
+				return;
+			if (m_entries[k].k != k * m_key_len)
+				in_order = false;
+		}
+
+		if (in_order)
+		{
+			m_pair_keys = reinterpret_cast<const uint64_t *>(m_block + m_keys_start);
+		}
+		else
+		{
+			m_pair_keys_copy.resize(2 * cnt);
+			for (k = 0; k < cnt; k++)
+				memcpy(m_pair_keys_copy.data() + 2 * k, m_block + m_keys_start + m_entries[k].k, m_key_len);
+			m_pair_keys = m_pair_keys_copy.data();
+		}
+	}
 }
 
 bool BTreeNodeFix::GetEntry(BTreeEntry & result, uint32_t index) const
@@ -117,13 +197,13 @@ bool BTreeNodeFix::GetEntry(BTreeEntry & result, uint32_t index) const
 	if (index >= m_btn->btn_nkeys)
 		return false;
 
-	result.key = m_block.data() + m_keys_start + m_entries[index].k;
-	result.key_len = m_tree.GetKeyLen();
+	result.key = m_block + m_keys_start + m_entries[index].k;
+	result.key_len = m_key_len;
 
 	if (m_entries[index].v != BTOFF_INVALID)
 	{
-		result.val = m_block.data() + m_vals_start - m_entries[index].v;
-		result.val_len = (m_btn->btn_flags & BTNODE_LEAF) ? m_tree.GetValLen() : sizeof(oid_t);
+		result.val = m_block + m_vals_start - m_entries[index].v;
+		result.val_len = (m_btn->btn_flags & BTNODE_LEAF) ? m_val_len : sizeof(oid_t);
 	}
 	else
 	{
@@ -134,10 +214,10 @@ bool BTreeNodeFix::GetEntry(BTreeEntry & result, uint32_t index) const
 	return true;
 }
 
-BTreeNodeVar::BTreeNodeVar(BTree &tree, const uint8_t *block, size_t blocksize, paddr_t paddr, const std::shared_ptr<BTreeNode> &parent, uint32_t parent_index) :
-	BTreeNode(tree, block, blocksize, paddr, parent, parent_index)
+BTreeNodeVar::BTreeNodeVar(BTree &tree, const uint8_t *block, size_t blocksize, bool owned, paddr_t paddr) :
+	BTreeNode(tree, block, blocksize, owned, paddr)
 {
-	m_entries = reinterpret_cast<const kvloc_t *>(m_block.data() + sizeof(btree_node_phys_t));
+	m_entries = reinterpret_cast<const kvloc_t *>(m_block + sizeof(btree_node_phys_t));
 }
 
 bool BTreeNodeVar::GetEntry(BTreeEntry & result, uint32_t index) const
@@ -147,12 +227,12 @@ bool BTreeNodeVar::GetEntry(BTreeEntry & result, uint32_t index) const
 	if (index >= m_btn->btn_nkeys)
 		return false;
 
-	result.key = m_block.data() + m_keys_start + m_entries[index].k.off;
+	result.key = m_block + m_keys_start + m_entries[index].k.off;
 	result.key_len = m_entries[index].k.len;
 
 	if (m_entries[index].v.off != BTOFF_INVALID)
 	{
-		result.val = m_block.data() + m_vals_start - m_entries[index].v.off;
+		result.val = m_block + m_vals_start - m_entries[index].v.off;
 		result.val_len = m_entries[index].v.len;
 	}
 	else
@@ -172,31 +252,36 @@ BTree::BTree(ApfsContainer &container, ApfsVolume *volume) :
 	m_root_node = nullptr;
 	m_omap = nullptr;
 	m_xid = 0;
+	m_cache_domain = 0;
 	m_debug = false;
+	m_prefetch_pending = 0;
 }
 
 BTree::~BTree()
 {
-#ifdef BTREE_USE_MAP
-	m_nodes.clear();
-#endif
+	WaitPrefetch();
 }
 
-bool BTree::Init(oid_t oid_root, xid_t xid, ApfsNodeMapper *omap)
+void BTree::WaitPrefetch()
 {
-	std::shared_ptr<BTreeNode> dummy;
+	std::unique_lock<std::mutex> lock(m_prefetch_mutex);
+	m_prefetch_cond.wait(lock, [this]() { return m_prefetch_pending == 0; });
+}
 
+bool BTree::Init(oid_t oid_root, xid_t xid, ApfsNodeMapper *omap)
+{
 	m_omap = omap;
 	m_oid = oid_root;
 	m_xid = xid;
+	m_cache_domain = omap ? omap->GetCacheDomain() : m_container.GetCacheDomain();
 
 	if (oid_root == 0) return false;
 
-	m_root_node = GetNode(oid_root, dummy, 0);
+	m_root_node = GetNode(oid_root);
 
 	if (m_root_node)
 	{
-		memcpy(&m_treeinfo, m_root_node->block().data() + m_root_node->block().size() - sizeof(btree_info_t), sizeof(btree_info_t));
+		memcpy(&m_treeinfo, m_root_node->block() + m_root_node->blocksize() - sizeof(btree_info_t), sizeof(btree_info_t));
 		return true;
 	}
 	else
@@ -208,123 +293,12 @@ bool BTree::Init(oid_t oid_root, xid_t xid, ApfsNodeMapper *omap)
 
 bool BTree::Lookup(BTreeEntry &result, const void *key, size_t key_size, BTCompareFunc func, void *context, bool exact)
 {
-	if (!m_root_node)
-		return false;
-
-	oid_t oid;
-	oid_t oid_parent;
-	int index;
-
-	std::shared_ptr<BTreeNode> node(m_root_node);
-	BTreeEntry e;
-
-	if (m_debug)
-	{
-		// std::cout << std::hex << "BTree::Lookup: key=" << *reinterpret_cast<const uint64_t *>(key) << " root=" << node->nodeid() << std::endl;
-		std::cout << "BTree::Lookup: ";
-		DumpHex(std::cout, reinterpret_cast<const uint8_t *>(key), key_size, key_size);
-	}
-
-	while (node->level() > 0)
-	{
-		index = FindBin(node, key, key_size, func, context, FindMode::LE);
-
-		if (index < 0)
-			return false;
-
-		node->GetEntry(e, index);
-		// DumpHex(std::cout, reinterpret_cast<const uint8_t*>(e.val), e.val_len, 32);
-
-		oid_parent = node->nodeid();
-
-		if (node->flags() & BTNODE_HASHED) {
-			const btn_index_node_val_t *binv = reinterpret_cast<const btn_index_node_val_t*>(e.val);
-			oid = binv->binv_child_oid + m_oid;
-		} else {
-			assert(e.val_len == sizeof(oid_t));
-			oid = *reinterpret_cast<const oid_t *>(e.val);
-		}
-
-		node = GetNode(oid, node, index);
-
-		if (!node)
-		{
-			std::cerr << "BTree::Lookup: Node " << oid << " with parent " << oid_parent << " not found." << std::endl;
-			return false;
-		}
-	}
-
-	index = FindBin(node, key, key_size, func, context, exact ? FindMode::EQ : FindMode::LE);
-
-	if (m_debug)
-		std::cout << "Result = " << node->nodeid() << ":" << index << std::endl;
-
-	if (index < 0)
-		return false;
-
-	node->GetEntry(result, index);
-	result.m_node = node;
-
-	return true;
+	return Lookup(result, key, key_size, BTFuncCompare{ func, context }, exact);
 }
 
 bool BTree::GetIterator(BTreeIterator& it, const void* key, size_t key_size, BTCompareFunc func, void *context)
 {
-	oid_t oid;
-	int index;
-
-	std::shared_ptr<BTreeNode> node(m_root_node);
-	BTreeEntry e;
-
-	if (m_debug)
-		std::cout << std::hex << "BTree::GetIterator: key=" << *reinterpret_cast<const uint64_t *>(key) << " root=" << node->nodeid() << std::endl;
-
-	while (node->level() > 0)
-	{
-		index = FindBin(node, key, key_size, func, context, FindMode::LE);
-
-		if (index < 0)
-			index = 0;
-
-		node->GetEntry(e, index);
-
-		if (node->flags() & BTNODE_HASHED) {
-			const btn_index_node_val_t *binv = reinterpret_cast<const btn_index_node_val_t*>(e.val);
-			oid = binv->binv_child_oid + m_oid;
-		} else {
-			assert(e.val_len == sizeof(oid_t));
-			oid = *reinterpret_cast<const oid_t *>(e.val);
-		}
-
-		node = GetNode(oid, node, index);
-	}
-
-	index = FindBin(node, key, key_size, func, context, FindMode::GE);
-
-	if (m_debug)
-		std::cout << "Result = " << node->nodeid() << ":" << index << std::endl;
-
-	if (index < 0)
-	{
-		index = node->entries_cnt() - 1;
-		it.Setup(this, node, index);
-		it.next();
-		if (m_debug)
-			std::cout << "Iterator next entry" << std::endl;
-	}
-	else
-	{
-		it.Setup(this, node, index);
-	}
-
-#if 0
-	it.GetEntry(e);
-
-	if (func(key, key_size, e.key, e.key_len) < 0)
-		it.next();
-#endif
-
-	return true;
+	return GetIterator(it, key, key_size, BTFuncCompare{ func, context });
 }
 
 bool BTree::GetIteratorBegin(BTreeIterator& it)
@@ -334,23 +308,27 @@ bool BTree::GetIteratorBegin(BTreeIterator& it)
 	std::shared_ptr<BTreeNode> node(m_root_node);
 	BTreeEntry e;
 
+	it.Setup(this);
+
+	if (!node)
+		return false;
+
 	while (node->level() > 0)
 	{
 		if (!node->GetEntry(e, 0))
 			return false;
 
-		if (node->flags() & BTNODE_HASHED) {
-			const btn_index_node_val_t *binv = reinterpret_cast<const btn_index_node_val_t*>(e.val);
-			oid = binv->binv_child_oid + m_oid;
-		} else {
-			oid = *reinterpret_cast<const oid_t *>(e.val);
-		}
-		node = GetNode(oid, node, 0);
-	}
+		if (!it.Push(node, 0))
+			return false;
 
-	it.Setup(this, node, 0);
+		oid = GetChildOid(*node, e);
+		node = GetNode(oid);
 
-	return true;
+		if (!node)
+			return false;
+	}
+
+	return it.Push(node, 0);
 }
 
 void BTree::dump(BlockDumper& out)
@@ -371,7 +349,7 @@ void BTree::DumpTreeInternal(BlockDumper& out, const std::shared_ptr<BTreeNode>
 	if (!node)
 		return;
 
-	out.DumpNode(node->block().data(), node->paddr());
+	out.DumpNode(node->block(), node->paddr());
 
 	if (node->level() > 0)
 	{
@@ -406,7 +384,7 @@ void BTree::DumpTreeInternal(BlockDumper& out, const std::shared_ptr<BTreeNode>
 				}
 			}
 
-			child = GetNode(oid_child, node, k);
+			child = GetNode(oid_child);
 
 			if (child)
 				DumpTreeInternal(out, child);
@@ -416,23 +394,17 @@ void BTree::DumpTreeInternal(BlockDumper& out, const std::shared_ptr<BTreeNode>
 	}
 }
 
-std::shared_ptr<BTreeNode> BTree::GetNode(oid_t oid, const std::shared_ptr<BTreeNode> &parent, uint32_t parent_index)
+std::shared_ptr<BTreeNode> BTree::GetNode(oid_t oid)
 {
+	BTreeNodeCache &cache = BTreeNodeCache::Get();
+	const BTreeNodeCache::Key key = { m_cache_domain, oid, m_xid };
 	std::shared_ptr<BTreeNode> node;
 
 	// printf("GetNode oid=%" PRIx64 "\n", oid);
 
-#ifdef BTREE_USE_MAP
-	m_mutex.lock();
-	auto it = m_nodes.find(oid);
-
-	if (it != m_nodes.end())
-		node = it->second;
-
-	m_mutex.unlock();
+	node = cache.Find(key);
 
 	if (!node)
-#endif
 	{
 		omap_res_t omr;
 
@@ -442,8 +414,6 @@ std::shared_ptr<BTreeNode> BTree::GetNode(oid_t oid, const std::shared_ptr<BTree
 		omr.size = m_treeinfo.bt_fixed.bt_node_size;
 		omr.paddr = oid;
 
-		std::vector<uint8_t> blk;
-
 		if (m_omap)
 		{
 			if (g_debug & Dbg_Info) {
@@ -457,77 +427,100 @@ std::shared_ptr<BTreeNode> BTree::GetNode(oid_t oid, const std::shared_ptr<BTree
 			}
 		}
 
-		blk.resize(m_container.GetBlocksize());
+		const size_t blocksize = m_container.GetBlocksize();
+		const uint8_t *data = nullptr;
+		uint8_t *buf = nullptr;
+
+		// Unencrypted nodes on a mapped image are used in place.
+		if (!m_volume || !(omr.flags & OMAP_VAL_ENCRYPTED))
+			data = m_container.MapBlocks(omr.paddr);
 
-		if (m_volume)
+		if (!data)
 		{
-			// TODO: is the crypto_id always equal to the block ID here?
-			// I think so, the xts id and the block id only differ when the
-			// volume has been converted from a HFS/FileVault volume, which
-			// used CoreStorage. After conversions, the block numbers do not
-			// match anymore, since the CoreStorage data has been removed
-			// and assigned to the apfs volume. But the metadata is always
-			// fresh and therefore the ids should match.
-			if (!m_volume->ReadBlocks(blk.data(), omr.paddr, 1, (omr.flags & OMAP_VAL_ENCRYPTED) ? omr.paddr : 0))
+			bool ok;
+
+			buf = cache.AllocBuffer(key, blocksize);
+
+			if (m_volume)
 			{
-				std::cerr << "ERROR: GetNode: ReadBlocks failed!" << std::endl;
-				return node;
+				// TODO: is the crypto_id always equal to the block ID here?
+				// I think so, the xts id and the block id only differ when the
+				// volume has been converted from a HFS/FileVault volume, which
+				// used CoreStorage. After conversions, the block numbers do not
+				// match anymore, since the CoreStorage data has been removed
+				// and assigned to the apfs volume. But the metadata is always
+				// fresh and therefore the ids should match.
+				ok = m_volume->ReadBlocks(buf, omr.paddr, 1, (omr.flags & OMAP_VAL_ENCRYPTED) ? omr.paddr : 0);
 			}
-
-			if (!(omr.flags & OMAP_VAL_NOHEADER)) {
-				if (!VerifyBlock(blk.data(), blk.size()))
-				{
-					std::cerr << "ERROR: GetNode: VerifyBlock failed!" << std::endl;
-					if (g_debug & Dbg_Errors)
-						DumpHex(std::cerr, blk.data(), blk.size());
-					return node;
-				}
-			} else {
-				/*
-				std::cout << "BTNode @ " << omr.paddr << ":" << std::endl;
-				DumpHex(std::cout, blk.data(), blk.size());
-				std::cout << std::endl;
-				*/
+			else
+			{
+				ok = m_container.ReadBlocks(buf, omr.paddr);
 			}
-		}
-		else
-		{
-			if (!m_container.ReadAndVerifyHeaderBlock(blk.data(), omr.paddr))
+
+			if (!ok)
 			{
-				std::cerr << "ERROR: GetNode: ReadAndVerifyHeaderBlock failed!" << std::endl;
+				std::cerr << "ERROR: GetNode: ReadBlocks failed!" << std::endl;
+				cache.FreeBuffer(buf, blocksize);
 				return node;
 			}
-		}
 
-		node = BTreeNode::CreateNode(*this, blk.data(), blk.size(), omr.paddr, parent, parent_index);
-#ifdef BTREE_USE_MAP
-		m_mutex.lock();
+			data = buf;
+		}
 
-		if (m_nodes.size() > BTREE_MAP_MAX_NODES)
+		if (!(m_volume && (omr.flags & OMAP_VAL_NOHEADER)) && !VerifyBlock(data, blocksize))
 		{
-#if 0
-			m_nodes.clear(); // TODO: Make this somewhat more intelligent ...
-#else
-			// This might be somewhat more intelligent ...
-			for (it = m_nodes.begin(); it != m_nodes.end();)
-			{
-				if (it->second.use_count() == 1)
-					it = m_nodes.erase(it);
-				else
-					++it;
-			}
-#endif
+			std::cerr << "ERROR: GetNode: VerifyBlock failed!" << std::endl;
+			if (g_debug & Dbg_Errors)
+				DumpHex(std::cerr, data, blocksize);
+			if (buf)
+				cache.FreeBuffer(buf, blocksize);
+			return node;
 		}
 
-		m_nodes[oid] = node;
-
-		m_mutex.unlock();
-#endif
+		node = BTreeNode::CreateNode(*this, data, blocksize, buf != nullptr, omr.paddr);
+		node = cache.Insert(key, node, node->memsize());
 	}
 
 	return node;
 }
 
+void BTree::PrefetchChildren(const std::shared_ptr<BTreeNode> &node, uint32_t first, uint32_t cnt)
+{
+	ThreadPool *pool = m_container.GetPrefetchPool();
+
+	if (!pool || first >= node->entries_cnt())
+		return;
+
+	if (cnt > node->entries_cnt() - first)
+		cnt = node->entries_cnt() - first;
+
+	{
+		std::lock_guard<std::mutex> lock(m_prefetch_mutex);
+		m_prefetch_pending++;
+	}
+
+	// Released when the job has run, or when the pool discards it.
+	std::shared_ptr<void> done(nullptr, [this](void *)
+	{
+		std::lock_guard<std::mutex> lock(m_prefetch_mutex);
+		m_prefetch_pending--;
+		m_prefetch_cond.notify_all();
+	});
+
+	pool->Submit([this, node, first, cnt, done]()
+	{
+		BTreeEntry e;
+
+		for (uint32_t k = first; k < first + cnt; k++)
+		{
+			if (!node->GetEntry(e, k))
+				break;
+
+			GetNode(GetChildOid(*node, e));
+		}
+	});
+}
+
 uint32_t BTree::Find(const std::shared_ptr<BTreeNode> &node, const void *key, size_t key_size, BTCompareFunc func, void *context)
 {
 	uint32_t k;
@@ -557,60 +550,10 @@ uint32_t BTree::Find(const std::shared_ptr<BTreeNode> &node, const void *key, si
 	return k;
 }
 
-int BTree::FindBin(const std::shared_ptr<BTreeNode>& node, const void* key, size_t key_size, BTCompareFunc func, void *context, FindMode mode)
+int BTree::FindResult(int mid, int rc, int cnt, FindMode mode)
 {
-	static const char resstr[3] = { '<', '=', '>' };
-
-	int beg;
-	int end;
-	int mid = -1;
-	int cnt = node->entries_cnt();
 	int res;
 
-	BTreeEntry e;
-	int rc;
-
-	if (cnt <= 0)
-		return -1;
-
-	beg = 0;
-	end = cnt - 1;
-
-	if (m_debug)
-	{
-		std::cout << "FindBin    : ";
-		DumpHex(std::cout, reinterpret_cast<const uint8_t *>(key), key_size, key_size);
-	}
-
-	while (beg <= end)
-	{
-		mid = (beg + end) / 2;
-
-		node->GetEntry(e, mid);
-		rc = func(key, key_size, e.key, e.key_len, context);
-
-		if (m_debug)
-		{
-			std::cout << std::dec << std::setfill(' ');
-			std::cout << std::setw(2) << beg << " [" << std::setw(2) << mid << "] " << std::setw(2) << end << " : " << resstr[rc + 1] << " : ";
-			DumpHex(std::cout, reinterpret_cast<const uint8_t *>(e.key), e.key_len, e.key_len);
-		}
-
-		if (rc == 0)
-			break;
-
-		if (rc == -1)
-			beg = mid + 1;
-		else if (rc == 1)
-			end = mid - 1;
-	}
-
-	if (m_debug)
-	{
-		std::cout << std::dec << std::setfill(' ');
-		std::cout << " => " << resstr[rc + 1] << ", " << mid;
-	}
-
 	switch (mode)
 	{
 	case FindMode::EQ:
@@ -637,120 +580,160 @@ int BTree::FindBin(const std::shared_ptr<BTreeNode>& node, const void* key, size
 	if (res == cnt)
 		res = -1;
 
-	if (m_debug)
-		std::cout << " => " << res << std::endl;
-
 	return res;
 }
 
-BTreeIterator::BTreeIterator()
+oid_t BTree::GetChildOid(const BTreeNode &node, const BTreeEntry &e) const
 {
-	m_tree = nullptr;
-	m_index = 0;
+	if (node.flags() & BTNODE_HASHED)
+		return reinterpret_cast<const btn_index_node_val_t *>(e.val)->binv_child_oid + m_oid;
+
+	assert(e.val_len == sizeof(oid_t));
+	return *reinterpret_cast<const oid_t *>(e.val);
 }
 
-BTreeIterator::BTreeIterator(BTree *tree, const std::shared_ptr<BTreeNode> &node, uint32_t index)
+void BTree::DebugKey(const char *what, const void *key, size_t key_size) const
 {
-	m_tree = tree;
-	m_node = node;
-	m_index = index;
+	std::cout << what;
+	DumpHex(std::cout, reinterpret_cast<const uint8_t *>(key), key_size, key_size);
+}
+
+void BTree::DebugProbe(int beg, int mid, int end, int rc, const BTreeEntry &e) const
+{
+	static const char resstr[3] = { '<', '=', '>' };
+
+	std::cout << std::dec << std::setfill(' ');
+	std::cout << std::setw(2) << beg << " [" << std::setw(2) << mid << "] " << std::setw(2) << end << " : " << resstr[rc + 1] << " : ";
+	DumpHex(std::cout, reinterpret_cast<const uint8_t *>(e.key), e.key_len, e.key_len);
+}
+
+void BTree::DebugResult(const BTreeNode &node, int rc, int mid, int res) const
+{
+	static const char resstr[3] = { '<', '=', '>' };
+
+	std::cout << std::dec << std::setfill(' ');
+	std::cout << " => " << resstr[rc + 1] << ", " << mid << " => " << res << std::endl;
+	std::cout << "Result = " << node.nodeid() << ":" << res << std::endl;
+}
+
+BTreeIterator::BTreeIterator()
+{
+	m_tree = nullptr;
+	m_depth = 0;
 }
 
 BTreeIterator::~BTreeIterator()
 {
 }
 
-void BTreeIterator::Setup(BTree* tree, const std::shared_ptr<BTreeNode>& node, uint32_t index)
+void BTreeIterator::Setup(BTree *tree)
 {
+	reset();
 	m_tree = tree;
-	m_node = node;
-	m_index = index;
 }
 
+bool BTreeIterator::Push(const std::shared_ptr<BTreeNode> &node, uint32_t index)
+{
+	if (m_depth >= max_depth)
+	{
+		std::cerr << "ERROR: BTreeIterator: tree deeper than " << max_depth << " levels." << std::endl;
+		reset();
+		return false;
+	}
+
+	m_node[m_depth] = node;
+	m_index[m_depth] = index;
+	m_depth++;
+
+	return true;
+}
 
 bool BTreeIterator::next()
 {
-	if (!m_node)
+	if (m_depth == 0)
 		return false;
 
-	m_index++;
+	m_index[m_depth - 1]++;
 
-	if (m_index < m_node->entries_cnt())
+	if (m_index[m_depth - 1] < m_node[m_depth - 1]->entries_cnt())
 		return true;
-	else {
-		std::shared_ptr<BTreeNode> node = next_node();
-		if (node) {
-			m_index = 0;
-			m_node = node;
-			return true;
-		}
-	}
-	return false;
+
+	return next_leaf();
 }
 
 void BTreeIterator::reset()
 {
+	while (m_depth > 0)
+		m_node[--m_depth].reset();
+	m_prefetch_node.reset();
 	m_tree = nullptr;
-	m_node.reset();
-	m_index = 0;
 }
 
 bool BTreeIterator::GetEntry(BTreeEntry& res) const
 {
-	if (!m_node)
+	if (m_depth == 0)
 		return false;
 
-	return m_node->GetEntry(res, m_index);
+	return m_node[m_depth - 1]->GetEntry(res, m_index[m_depth - 1]);
 }
 
-#undef BTITDBG
-
-std::shared_ptr<BTreeNode> BTreeIterator::next_node()
+bool BTreeIterator::next_leaf()
 {
 	std::shared_ptr<BTreeNode> node;
-	uint32_t pidx;
 	BTreeEntry e;
-	oid_t oid;
+	int level;
 
-	node = m_node;
+	// Find the lowest index node that has another child. If there is none,
+	// stay at the end of the last leaf.
+	for (level = m_depth - 2; level >= 0; level--)
+	{
+		if (m_index[level] + 1 < m_node[level]->entries_cnt())
+			break;
+	}
 
-#ifdef BTITDBG
-	std::cout << "======== ******** BTreeIterator::next_node() ******** ========" << std::endl;
-	std::cout << "  Current node: " << node->nodeid() << std::endl;
-#endif
+	if (level < 0)
+		return false;
 
-	do {
-		pidx = node->parent_index();
-		node = node->parent();
-#ifdef BTITDBG
-		std::cout << "  Navigating up to node " << node->nodeid() << " index " << pidx << std::endl;
-#endif
-		pidx++;
-	} while (node && pidx >= node->entries_cnt());
+	m_index[level]++;
 
-	if (!node)
-		return std::shared_ptr<BTreeNode>();
+	while (m_depth > level + 1)
+		m_node[--m_depth].reset();
+
+	node = m_node[level];
 
-	while (node->level() > 0) {
-		node->GetEntry(e, pidx);
+	while (node->level() > 0)
+	{
+		// Moving to the next leaf means this is a scan, so keep the
+		// following g_btree_readahead leaves loading in the background.
+		// The whole window is queued when the scan enters a parent node;
+		// after that each step only adds the leaf that became visible.
+		if (node->level() == 1 && g_btree_readahead > 0)
+		{
+			uint32_t idx = m_index[m_depth - 1];
 
-		if (node->flags() & BTNODE_HASHED) {
-			const btn_index_node_val_t *binv = reinterpret_cast<const btn_index_node_val_t *>(e.val);
-			oid = binv->binv_child_oid + m_tree->m_oid;
-		} else {
-			oid = *reinterpret_cast<const uint64_t *>(e.val);
+			if (node != m_prefetch_node)
+			{
+				m_tree->PrefetchChildren(node, idx + 1, g_btree_readahead);
+				m_prefetch_node = node;
+			}
+			else
+			{
+				m_tree->PrefetchChildren(node, idx + g_btree_readahead, 1);
+			}
 		}
 
-#ifdef BTITDBG
-		std::cout << "  Navigating down to node " << oid << std::endl;
-#endif
-		node = m_tree->GetNode(oid, node, pidx);
+		node->GetEntry(e, m_index[m_depth - 1]);
+		node = m_tree->GetNode(m_tree->GetChildOid(*node, e));
 
 		if (!node)
-			std::cerr << "Failed to load btree node oid " << oid << std::endl;
+		{
+			reset();
+			return false;
+		}
 
-		pidx = 0;
+		if (!Push(node, 0))
+			return false;
 	}
 
-	return node;
+	return true;
 }
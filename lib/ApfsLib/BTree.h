@@ -19,10 +19,12 @@
 
 #pragma once
 
+#include <iostream>
 #include <vector>
 #include <map>
 #include <memory>
 #include <mutex>
+#include <condition_variable>
 
 #include "Global.h"
 #include "DiskStruct.h"
@@ -37,17 +39,27 @@ class BlockDumper;
 class ApfsContainer;
 class ApfsVolume;
 
-// This enables a rudimentary disk cache ...
-#define BTREE_USE_MAP
-// TODO: Think about a better solution.
-// 8192 will take max. 32 MB of RAM. Higher may be faster, but use more RAM.
-#define BTREE_MAP_MAX_NODES 8192
-
 // ekey < skey: -1, ekey > skey: 1, ekey == skey: 0
 typedef int(*BTCompareFunc)(const void *skey, size_t skey_len, const void *ekey, size_t ekey_len, void *context);
 
 int CompareStdKey(const void *skey, size_t skey_len, const void *ekey, size_t ekey_len, void *context);
 
+// The templated search functions of BTree take a comparator object with
+//   int operator()(const void *skey, size_t skey_len, const void *ekey, size_t ekey_len) const
+// returning the same as BTCompareFunc, so the comparison can be inlined.
+// u64_pair declares that the keys are ordered like two uint64_t, the first
+// one major; nodes with such 16 byte fixed size keys are then searched
+// directly on the keys without calling the comparator.
+struct BTFuncCompare
+{
+	static constexpr bool u64_pair = false;
+
+	int operator()(const void *skey, size_t skey_len, const void *ekey, size_t ekey_len) const { return func(skey, skey_len, ekey, ekey_len, context); }
+
+	BTCompareFunc func;
+	void *context;
+};
+
 class BTreeEntry
 {
 	friend class BTree;
@@ -72,10 +84,13 @@ private:
 class BTreeNode
 {
 protected:
-	BTreeNode(BTree &tree, const uint8_t *block, size_t blocksize, paddr_t paddr, const std::shared_ptr<BTreeNode> &parent, uint32_t parent_index);
+	BTreeNode(BTree &tree, const uint8_t *block, size_t blocksize, bool owned, paddr_t paddr);
 
 public:
-	static std::shared_ptr<BTreeNode> CreateNode(BTree &tree, const uint8_t *block, size_t blocksize, paddr_t paddr, const std::shared_ptr<BTreeNode> &parent, uint32_t parent_index);
+	// If owned, block is a buffer from BTreeNodeCache::AllocBuffer and is
+	// handed back when the node goes away. Otherwise it points into a
+	// mapped image and must stay valid for the lifetime of the node.
+	static std::shared_ptr<BTreeNode> CreateNode(BTree &tree, const uint8_t *block, size_t blocksize, bool owned, paddr_t paddr);
 
 	virtual ~BTreeNode();
 
@@ -85,24 +100,33 @@ public:
 	uint16_t flags() const { return m_btn->btn_flags; }
 	paddr_t paddr() const { return m_paddr; }
 
-	const std::shared_ptr<BTreeNode> &parent() const { return m_parent; }
-	uint16_t parent_index() const { return m_parent_index; }
-
 	virtual bool GetEntry(BTreeEntry &result, uint32_t index) const = 0;
 	// virtual uint32_t Find(const void *key, size_t key_size, BTCompareFunc func) const = 0;
 
-	const std::vector<uint8_t> &block() const { return m_block; }
+	const uint8_t *block() const { return m_block; }
+	size_t blocksize() const { return m_blocksize; }
+	// Memory held by the node, as charged against the cache budget.
+	size_t memsize() const;
+
+	// Fixed size nodes with 16 byte keys: index of the last key <= (k0, k1),
+	// compared as two uint64_t, or -1.
+	bool has_u64_pair_keys() const { return m_pair_keys != nullptr; }
+	int FindU64PairLE(uint64_t k0, uint64_t k1) const;
+	bool U64PairKeyEquals(int index, uint64_t k0, uint64_t k1) const { return m_pair_keys[2 * index] == k0 && m_pair_keys[2 * index + 1] == k1; }
 
 protected:
-	std::vector<uint8_t> m_block;
-	BTree &m_tree;
+	const uint8_t *m_block;
+	const size_t m_blocksize;
+	const bool m_owned;
+
+	// Keys of entry i at [2 * i] and [2 * i + 1]. Points into the block if
+	// the keys are stored in order there, else into m_pair_keys_copy.
+	const uint64_t *m_pair_keys;
+	std::vector<uint64_t> m_pair_keys_copy;
 
 	uint16_t m_keys_start; // Up
 	uint16_t m_vals_start; // Dn
 
-	const uint32_t m_parent_index;
-	const std::shared_ptr<BTreeNode> m_parent;
-
 	const paddr_t m_paddr;
 
 	const btree_node_phys_t *m_btn;
@@ -111,19 +135,22 @@ protected:
 class BTreeNodeFix : public BTreeNode
 {
 public:
-	BTreeNodeFix(BTree &tree, const uint8_t *block, size_t blocksize, paddr_t paddr, const std::shared_ptr<BTreeNode> &parent, uint32_t parent_index);
+	BTreeNodeFix(BTree &tree, const uint8_t *block, size_t blocksize, bool owned, paddr_t paddr);
 
 	bool GetEntry(BTreeEntry &result, uint32_t index) const override;
 	// uint32_t Find(const void *key, size_t key_size, BTCompareFunc func) const override;
 
 private:
 	const kvoff_t *m_entries;
+	// Taken from the tree info, nodes are shared between BTree instances.
+	uint16_t m_key_len;
+	uint16_t m_val_len;
 };
 
 class BTreeNodeVar : public BTreeNode
 {
 public:
-	BTreeNodeVar(BTree &tree, const uint8_t *block, size_t blocksize, paddr_t paddr, const std::shared_ptr<BTreeNode> &parent, uint32_t parent_index);
+	BTreeNodeVar(BTree &tree, const uint8_t *block, size_t blocksize, bool owned, paddr_t paddr);
 
 	bool GetEntry(BTreeEntry &result, uint32_t index) const override;
 	// uint32_t Find(const void *key, size_t key_size, BTCompareFunc func) const override;
@@ -154,6 +181,18 @@ public:
 	bool GetIterator(BTreeIterator &it, const void *key, size_t key_size, BTCompareFunc func, void *context);
 	bool GetIteratorBegin(BTreeIterator &it);
 
+	template<typename Cmp>
+	bool Lookup(BTreeEntry &result, const void *key, size_t key_size, const Cmp &cmp, bool exact);
+	template<typename Cmp>
+	bool GetIterator(BTreeIterator &it, const void *key, size_t key_size, const Cmp &cmp);
+
+	// Calls func(key, key_len, val, val_len) for the entries in key order,
+	// starting at the first key >= key, or at the first entry if key is
+	// nullptr. func returns false to end the scan. The spans are only valid
+	// during the call; each leaf is pinned once for all of its entries.
+	template<typename F>
+	bool Scan(const void *key, size_t key_size, BTCompareFunc cmp, void *context, F &&func);
+
 	uint16_t GetKeyLen() const { return m_treeinfo.bt_fixed.bt_key_size; }
 	uint16_t GetValLen() const { return m_treeinfo.bt_fixed.bt_val_size; }
 
@@ -161,12 +200,26 @@ public:
 
 	void EnableDebugOutput() { m_debug = true; }
 
+	// Waits until the background loads started by iterators have finished.
+	// Owners call this before destroying anything the loads depend on.
+	void WaitPrefetch();
+
 private:
 	void DumpTreeInternal(BlockDumper &out, const std::shared_ptr<BTreeNode> &node);
 	uint32_t Find(const std::shared_ptr<BTreeNode> &node, const void *key, size_t key_size, BTCompareFunc func, void *context);
-	int FindBin(const std::shared_ptr<BTreeNode> &node, const void *key, size_t key_size, BTCompareFunc func, void *context, FindMode mode);
+	template<typename Cmp>
+	int FindBin(const BTreeNode &node, const void *key, size_t key_size, const Cmp &cmp, FindMode mode) const;
+	static int FindResult(int mid, int rc, int cnt, FindMode mode);
+	oid_t GetChildOid(const BTreeNode &node, const BTreeEntry &e) const;
+
+	void DebugKey(const char *what, const void *key, size_t key_size) const;
+	void DebugProbe(int beg, int mid, int end, int rc, const BTreeEntry &e) const;
+	void DebugResult(const BTreeNode &node, int rc, int mid, int res) const;
 
-	std::shared_ptr<BTreeNode> GetNode(oid_t oid, const std::shared_ptr<BTreeNode> &parent, uint32_t parent_index);
+	std::shared_ptr<BTreeNode> GetNode(oid_t oid);
+	// Loads children first ... first + cnt - 1 of an index node into the
+	// node cache in the background.
+	void PrefetchChildren(const std::shared_ptr<BTreeNode> &node, uint32_t first, uint32_t cnt);
 
 	ApfsContainer &m_container;
 	ApfsVolume *m_volume;
@@ -178,19 +231,24 @@ private:
 
 	oid_t m_oid;
 	xid_t m_xid;
+	// Node cache domain, see BTreeNodeCache
+	uint64_t m_cache_domain;
 	bool m_debug;
 
-#ifdef BTREE_USE_MAP
-	std::map<uint64_t, std::shared_ptr<BTreeNode>> m_nodes;
-	std::mutex m_mutex;
-#endif
+	// Prefetch jobs not finished or discarded yet, the destructor waits
+	// for them.
+	std::mutex m_prefetch_mutex;
+	std::condition_variable m_prefetch_cond;
+	unsigned int m_prefetch_pending;
 };
 
+// Keeps the path from the root to the current leaf, so nodes do not need
+// to know their parents and can be shared by all lookups and iterators.
 class BTreeIterator
 {
+	friend class BTree;
 public:
 	BTreeIterator();
-	BTreeIterator(BTree *tree, const std::shared_ptr<BTreeNode> &node, uint32_t index);
 	~BTreeIterator();
 
 	bool next();
@@ -198,12 +256,229 @@ public:
 
 	bool GetEntry(BTreeEntry &res) const;
 
-	void Setup(BTree *tree, const std::shared_ptr<BTreeNode> &node, uint32_t index);
-
 private:
-	BTree *m_tree;
-	std::shared_ptr<BTreeNode> m_node;
-	uint32_t m_index;
+	// Deeper trees are rejected; APFS trees have only a few levels.
+	static constexpr int max_depth = 16;
+
+	void Setup(BTree *tree);
+	bool Push(const std::shared_ptr<BTreeNode> &node, uint32_t index);
+	// Moves to the first entry of the next leaf. Returns false at the end of
+	// the tree, and also when a node can't be loaded; the iterator is reset
+	// then, so m_tree is nullptr.
+	bool next_leaf();
 
-	std::shared_ptr<BTreeNode> next_node();
+	BTree *m_tree;
+	// m_node[0] is the root, m_node[m_depth - 1] the current leaf.
+	std::shared_ptr<BTreeNode> m_node[max_depth];
+	uint32_t m_index[max_depth];
+	int m_depth;
+	// Index node whose readahead window is already queued.
+	std::shared_ptr<BTreeNode> m_prefetch_node;
 };
+
+template<typename F>
+bool BTree::Scan(const void *key, size_t key_size, BTCompareFunc cmp, void *context, F &&func)
+{
+	BTreeIterator it;
+	BTreeEntry e;
+	uint32_t cnt;
+
+	if (!m_root_node)
+		return false;
+
+	if (key ? !GetIterator(it, key, key_size, cmp, context) : !GetIteratorBegin(it))
+		return false;
+
+	while (it.m_depth > 0)
+	{
+		const BTreeNode &node = *it.m_node[it.m_depth - 1];
+		uint32_t &index = it.m_index[it.m_depth - 1];
+
+		cnt = node.entries_cnt();
+
+		for (; index < cnt; index++)
+		{
+			node.GetEntry(e, index);
+
+			if (!func(e.key, e.key_len, e.val, e.val_len))
+				return true;
+		}
+
+		// next_leaf resets the iterator if a node can't be loaded, but
+		// keeps it at the end of the last leaf when the tree is done.
+		if (!it.next_leaf())
+			return it.m_tree != nullptr;
+	}
+
+	return true;
+}
+
+template<typename Cmp>
+int BTree::FindBin(const BTreeNode &node, const void *key, size_t key_size, const Cmp &cmp, FindMode mode) const
+{
+	int beg;
+	int end;
+	int mid = -1;
+	int cnt = node.entries_cnt();
+	int rc = 0;
+	int res;
+
+	BTreeEntry e;
+
+	if (cnt <= 0)
+		return -1;
+
+	if constexpr (Cmp::u64_pair)
+	{
+		if (node.has_u64_pair_keys() && key_size == 2 * sizeof(uint64_t) && !m_debug)
+		{
+			const uint64_t *k = reinterpret_cast<const uint64_t *>(key);
+
+			mid = node.FindU64PairLE(k[0], k[1]);
+
+			if (mid < 0)
+			{
+				mid = 0;
+				rc = 1;
+			}
+			else
+				rc = node.U64PairKeyEquals(mid, k[0], k[1]) ? 0 : -1;
+
+			return FindResult(mid, rc, cnt, mode);
+		}
+	}
+
+	if (m_debug)
+		DebugKey("FindBin    : ", key, key_size);
+
+	beg = 0;
+	end = cnt - 1;
+
+	while (beg <= end)
+	{
+		mid = (beg + end) / 2;
+
+		node.GetEntry(e, mid);
+		rc = cmp(key, key_size, e.key, e.key_len);
+
+		if (m_debug)
+			DebugProbe(beg, mid, end, rc, e);
+
+		if (rc == 0)
+			break;
+
+		if (rc == -1)
+			beg = mid + 1;
+		else if (rc == 1)
+			end = mid - 1;
+	}
+
+	res = FindResult(mid, rc, cnt, mode);
+
+	if (m_debug)
+		DebugResult(node, rc, mid, res);
+
+	return res;
+}
+
+template<typename Cmp>
+bool BTree::Lookup(BTreeEntry &result, const void *key, size_t key_size, const Cmp &cmp, bool exact)
+{
+	if (!m_root_node)
+		return false;
+
+	oid_t oid;
+	int index;
+
+	std::shared_ptr<BTreeNode> node(m_root_node);
+	BTreeEntry e;
+
+	if (m_debug)
+		DebugKey("BTree::Lookup: ", key, key_size);
+
+	while (node->level() > 0)
+	{
+		index = FindBin(*node, key, key_size, cmp, FindMode::LE);
+
+		if (index < 0)
+			return false;
+
+		node->GetEntry(e, index);
+		oid = GetChildOid(*node, e);
+
+		std::shared_ptr<BTreeNode> child = GetNode(oid);
+
+		if (!child)
+		{
+			std::cerr << "BTree::Lookup: Node " << oid << " with parent " << node->nodeid() << " not found." << std::endl;
+			return false;
+		}
+
+		node = std::move(child);
+	}
+
+	index = FindBin(*node, key, key_size, cmp, exact ? FindMode::EQ : FindMode::LE);
+
+	if (index < 0)
+		return false;
+
+	node->GetEntry(result, index);
+	result.m_node = std::move(node);
+
+	return true;
+}
+
+template<typename Cmp>
+bool BTree::GetIterator(BTreeIterator &it, const void *key, size_t key_size, const Cmp &cmp)
+{
+	oid_t oid;
+	int index;
+
+	std::shared_ptr<BTreeNode> node(m_root_node);
+	BTreeEntry e;
+
+	it.Setup(this);
+
+	if (!node)
+		return false;
+
+	if (m_debug)
+		DebugKey("BTree::GetIterator: ", key, key_size);
+
+	while (node->level() > 0)
+	{
+		index = FindBin(*node, key, key_size, cmp, FindMode::LE);
+
+		if (index < 0)
+			index = 0;
+
+		if (!it.Push(node, index))
+			return false;
+
+		node->GetEntry(e, index);
+		oid = GetChildOid(*node, e);
+
+		node = GetNode(oid);
+
+		if (!node)
+			return false;
+	}
+
+	index = FindBin(*node, key, key_size, cmp, FindMode::GE);
+
+	if (index < 0)
+	{
+		// All keys in this leaf are smaller, start at the next one.
+		if (!it.Push(node, node->entries_cnt()))
+			return false;
+		if (!it.next_leaf() && !it.m_tree)
+			return false;
+	}
+	else
+	{
+		if (!it.Push(node, index))
+			return false;
+	}
+
+	return true;
+}
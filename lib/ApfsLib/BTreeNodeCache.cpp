@@ -0,0 +1,158 @@
+#include <atomic>
+#include <vector>
+
+#include "Global.h"
+#include "BTree.h"
+#include "BTreeNodeCache.h"
+
+uint64_t g_btree_cache_size = 64 * 1024 * 1024;
+
+size_t BTreeNodeCache::KeyHash::operator()(const Key &k) const
+{
+	uint64_t h = k.oid * 0x9E3779B97F4A7C15ULL;
+	h ^= (k.xid + (h << 6) + (h >> 2)) * 0xC2B2AE3D27D4EB4FULL;
+	h ^= (k.domain + (h << 6) + (h >> 2)) * 0x165667B19E3779F9ULL;
+	return static_cast<size_t>(h ^ (h >> 29));
+}
+
+BTreeNodeCache::BTreeNodeCache()
+{
+}
+
+BTreeNodeCache::~BTreeNodeCache()
+{
+	// Drop all nodes first, they hand their buffers back to the shards.
+	for (Shard &s : m_shards)
+	{
+		s.map.clear();
+		s.lru.clear();
+	}
+
+	for (Shard &s : m_shards)
+	{
+		for (const FreeBuf &fb : s.free)
+			delete[] fb.buf;
+	}
+}
+
+BTreeNodeCache &BTreeNodeCache::Get()
+{
+	static BTreeNodeCache cache;
+	return cache;
+}
+
+uint64_t BTreeNodeCache::NewDomain()
+{
+	static std::atomic<uint64_t> next(1);
+	return next++;
+}
+
+std::shared_ptr<BTreeNode> BTreeNodeCache::Find(const Key &key)
+{
+	Shard &s = GetShard(key);
+	std::lock_guard<std::mutex> lock(s.mutex);
+
+	auto it = s.map.find(key);
+	if (it == s.map.end())
+		return std::shared_ptr<BTreeNode>();
+
+	s.lru.splice(s.lru.begin(), s.lru, it->second.lru);
+	return it->second.node;
+}
+
+std::shared_ptr<BTreeNode> BTreeNodeCache::Insert(const Key &key, const std::shared_ptr<BTreeNode> &node, size_t size)
+{
+	Shard &s = GetShard(key);
+	const uint64_t limit = g_btree_cache_size / shard_cnt;
+	// Evicted nodes are released after the lock is dropped.
+	std::vector<std::shared_ptr<BTreeNode>> evicted;
+	std::lock_guard<std::mutex> lock(s.mutex);
+
+	auto it = s.map.find(key);
+	if (it != s.map.end())
+	{
+		s.lru.splice(s.lru.begin(), s.lru, it->second.lru);
+		return it->second.node;
+	}
+
+	if (size > limit)
+		return node;
+
+	while (s.used + size > limit && !s.lru.empty())
+	{
+		auto victim = s.map.find(s.lru.back());
+		s.used -= victim->second.size;
+		evicted.push_back(std::move(victim->second.node));
+		s.map.erase(victim);
+		s.lru.pop_back();
+	}
+
+	s.lru.push_front(key);
+	s.map.emplace(key, Entry{ node, size, s.lru.begin() });
+	s.used += size;
+
+	return node;
+}
+
+void BTreeNodeCache::Purge(uint64_t domain)
+{
+	std::vector<std::shared_ptr<BTreeNode>> evicted;
+
+	for (Shard &s : m_shards)
+	{
+		std::lock_guard<std::mutex> lock(s.mutex);
+
+		for (auto it = s.lru.begin(); it != s.lru.end();)
+		{
+			if (it->domain != domain)
+			{
+				++it;
+				continue;
+			}
+
+			auto e = s.map.find(*it);
+			s.used -= e->second.size;
+			evicted.push_back(std::move(e->second.node));
+			s.map.erase(e);
+			it = s.lru.erase(it);
+		}
+	}
+}
+
+uint8_t *BTreeNodeCache::AllocBuffer(const Key &key, size_t size)
+{
+	Shard &s = GetShard(key);
+
+	{
+		std::lock_guard<std::mutex> lock(s.mutex);
+
+		for (size_t k = s.free.size(); k > 0; k--)
+		{
+			if (s.free[k - 1].size == size)
+			{
+				uint8_t *buf = s.free[k - 1].buf;
+				s.free.erase(s.free.begin() + (k - 1));
+				return buf;
+			}
+		}
+	}
+
+	return new uint8_t[size];
+}
+
+void BTreeNodeCache::FreeBuffer(uint8_t *buf, size_t size)
+{
+	Shard &s = m_shards[(reinterpret_cast<uintptr_t>(buf) >> 12) % shard_cnt];
+
+	{
+		std::lock_guard<std::mutex> lock(s.mutex);
+
+		if (s.free.size() < free_max)
+		{
+			s.free.push_back(FreeBuf{ buf, size });
+			return;
+		}
+	}
+
+	delete[] buf;
+}
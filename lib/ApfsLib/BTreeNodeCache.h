@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "ApfsTypes.h"
+
+class BTreeNode;
+
+// Process wide cache of B-tree nodes, shared by all trees of all open
+// containers. Nodes are keyed by (domain, oid, xid): the domain is the
+// container for physical trees and the node mapper for virtual ones, so
+// the same oid in different address spaces never collides. The cache is
+// split into shards, each with its own lock and LRU list, and the byte
+// budget g_btree_cache_size is divided evenly between them.
+// It also hands out the block buffers of the nodes. Each shard keeps a
+// short free list of released buffers for the next loads, anything beyond
+// that is given back to the heap.
+class BTreeNodeCache
+{
+public:
+	struct Key
+	{
+		uint64_t domain;
+		oid_t oid;
+		xid_t xid;
+
+		bool operator==(const Key &o) const { return domain == o.domain && oid == o.oid && xid == o.xid; }
+	};
+
+	static BTreeNodeCache &Get();
+
+	// Returns a new domain id. Ids are never reused, so stale entries of a
+	// closed container can not be hit by a later one.
+	static uint64_t NewDomain();
+
+	~BTreeNodeCache();
+
+	BTreeNodeCache(const BTreeNodeCache &o) = delete;
+	BTreeNodeCache &operator=(const BTreeNodeCache &o) = delete;
+
+	std::shared_ptr<BTreeNode> Find(const Key &key);
+	// If another thread inserted the same key first, that node is returned
+	// and node is dropped, so all users share one copy.
+	std::shared_ptr<BTreeNode> Insert(const Key &key, const std::shared_ptr<BTreeNode> &node, size_t size);
+	// Drops all nodes of a domain.
+	void Purge(uint64_t domain);
+
+	// The buffer is taken from the free list of the shard of key. It is
+	// released into the free list of the shard its address maps to.
+	uint8_t *AllocBuffer(const Key &key, size_t size);
+	void FreeBuffer(uint8_t *buf, size_t size);
+
+private:
+	BTreeNodeCache();
+
+	static constexpr size_t shard_cnt = 16;
+	// Released buffers kept per shard.
+	static constexpr size_t free_max = 16;
+
+	struct KeyHash
+	{
+		size_t operator()(const Key &k) const;
+	};
+
+	struct Entry
+	{
+		std::shared_ptr<BTreeNode> node;
+		size_t size;
+		std::list<Key>::iterator lru;
+	};
+
+	struct FreeBuf
+	{
+		uint8_t *buf;
+		size_t size;
+	};
+
+	// Most recently used entries are at the front of lru.
+	struct Shard
+	{
+		std::mutex mutex;
+		std::unordered_map<Key, Entry, KeyHash> map;
+		std::list<Key> lru;
+		uint64_t used = 0;
+		std::vector<FreeBuf> free;
+	};
+
+	Shard &GetShard(const Key &key) { return m_shards[KeyHash()(key) % shard_cnt]; }
+
+	Shard m_shards[shard_cnt];
+};
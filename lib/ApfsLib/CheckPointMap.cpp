@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cassert>
 
 #include "ApfsContainer.h"
@@ -18,10 +19,13 @@ CheckPointMap::~CheckPointMap()
 bool CheckPointMap::Init(oid_t root_oid, uint32_t blk_count)
 {
 	uint32_t n;
+	uint32_t k;
+	uint32_t cnt;
 	const checkpoint_map_phys_t *cpm;
 
 	m_blksize = m_container.GetBlocksize();
 	m_cpm_data.resize(m_blksize * blk_count);
+	m_index.clear();
 
 	for (n = 0; n < blk_count; n++)
 	{
@@ -38,8 +42,15 @@ bool CheckPointMap::Init(oid_t root_oid, uint32_t blk_count)
 		if ((cpm->cpm_o.o_type & OBJECT_TYPE_MASK) != OBJECT_TYPE_CHECKPOINT_MAP)
 		{
 			m_cpm_data.clear();
+			m_index.clear();
 			return false;
 		}
+
+		cnt = std::min<uint32_t>(cpm->cpm_count, (m_blksize - sizeof(checkpoint_map_phys_t)) / sizeof(checkpoint_mapping_t));
+
+		// emplace keeps the first mapping of an oid, like the linear scan did.
+		for (k = 0; k < cnt; k++)
+			m_index.emplace(cpm->cpm_map[k].cpm_oid, IndexEntry{ &cpm->cpm_map[k], cpm->cpm_o.o_xid });
 	}
 
 	m_cpm_oid = root_oid;
@@ -49,35 +60,20 @@ bool CheckPointMap::Init(oid_t root_oid, uint32_t blk_count)
 
 bool CheckPointMap::Lookup(omap_res_t & res, oid_t oid, xid_t xid)
 {
-	uint32_t blk_offs;
-	uint32_t k;
-	uint32_t cnt;
-	const checkpoint_map_phys_t * cpm;
-
 	(void)xid;
 
-	for (blk_offs = 0; blk_offs < m_cpm_data.size(); blk_offs += m_blksize)
-	{
-		cpm = reinterpret_cast<const checkpoint_map_phys_t *>(m_cpm_data.data() + blk_offs);
+	auto it = m_index.find(oid);
 
-		cnt = cpm->cpm_count;
+	if (it == m_index.end())
+		return false;
 
-		for (k = 0; k < cnt; k++)
-		{
-			if (oid == cpm->cpm_map[k].cpm_oid)
-			{
-				res.oid = cpm->cpm_map[k].cpm_oid;
-				res.xid = cpm->cpm_o.o_xid;
-				res.flags = 0;
-				res.size = cpm->cpm_map[k].cpm_size;
-				res.paddr = cpm->cpm_map[k].cpm_paddr;
-
-				return true;
-			}
-		}
-	}
+	res.oid = it->second.map->cpm_oid;
+	res.xid = it->second.xid;
+	res.flags = 0;
+	res.size = it->second.map->cpm_size;
+	res.paddr = it->second.map->cpm_paddr;
 
-	return false;
+	return true;
 }
 
 void CheckPointMap::dump(BlockDumper& bd)
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <unordered_map>
 #include <vector>
 
 #include "DiskStruct.h"
@@ -20,8 +21,16 @@ public:
 	void dump(BlockDumper &bd);
 
 private:
+	struct IndexEntry
+	{
+		const checkpoint_mapping_t *map;
+		xid_t xid;
+	};
+
 	ApfsContainer &m_container;
 	std::vector<uint8_t> m_cpm_data;
+	// oid -> first mapping of it in m_cpm_data, built by Init
+	std::unordered_map<oid_t, IndexEntry> m_index;
 	oid_t m_cpm_oid;
 	uint32_t m_blksize;
 };
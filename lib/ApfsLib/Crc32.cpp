@@ -17,16 +17,196 @@
 	along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <cstring>
+
 #include "Crc32.h"
 
-Crc32::Crc32(bool reflect, uint32_t poly)
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CRC32_PCLMUL
+#define CRC32_SSE42
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__) && defined(__aarch64__)
+#define CRC32_ARMV8
+#include <arm_acle.h>
+#ifdef __linux__
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+#ifdef CRC32_PCLMUL
+// Folds 64 bytes at a time with carry-less multiplication (Intel, "Fast CRC
+// Computation for Generic Polynomials Using PCLMULQDQ"). The constants are
+// for the reflected 0x04C11DB7 polynomial. Returns the register for data
+// plus the folded remainder, which still has to run through the table.
+__attribute__((target("pclmul,sse4.1")))
+static size_t FoldPclmul(uint32_t crc, const uint8_t *data, size_t size, uint8_t rem[16])
+{
+	const __m128i k1k2 = _mm_set_epi64x(0x01C6E41596, 0x0154442BD4);
+	const __m128i k3k4 = _mm_set_epi64x(0x00CCAA009E, 0x01751997D0);
+	const uint8_t *start = data;
+	__m128i x1, x2, x3, x4, x5, x6, x7, x8;
+
+	x1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 0x00));
+	x2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 0x10));
+	x3 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 0x20));
+	x4 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(static_cast<int>(crc)));
+
+	data += 64;
+	size -= 64;
+
+	while (size >= 64)
+	{
+		x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+
+		x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 0x30)));
+
+		data += 64;
+		size -= 64;
+	}
+
+	// Fold the four lanes into one
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	while (size >= 16)
+	{
+		x2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data));
+		x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+		data += 16;
+		size -= 16;
+	}
+
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(rem), x1);
+
+	return data - start;
+}
+#endif
+
+#ifdef CRC32_SSE42
+// CRC32C with the SSE4.2 crc32 instruction, eight bytes at a time.
+__attribute__((target("sse4.2")))
+static uint32_t UpdateCrc32c(uint32_t crc, const uint8_t *data, size_t size)
+{
+#ifdef __x86_64__
+	uint64_t crc64 = crc;
+	uint64_t v;
+
+	while (size >= 8) {
+		memcpy(&v, data, 8);
+		crc64 = _mm_crc32_u64(crc64, v);
+		data += 8;
+		size -= 8;
+	}
+
+	crc = static_cast<uint32_t>(crc64);
+#endif
+
+	while (size >= 4) {
+		uint32_t v32;
+
+		memcpy(&v32, data, 4);
+		crc = _mm_crc32_u32(crc, v32);
+		data += 4;
+		size -= 4;
+	}
+
+	while (size > 0) {
+		crc = _mm_crc32_u8(crc, *data);
+		data++;
+		size--;
+	}
+
+	return crc;
+}
+
+static bool HaveCrc32c()
+{
+	return __builtin_cpu_supports("sse4.2");
+}
+#endif
+
+#ifdef CRC32_ARMV8
+// CRC32C with the ARMv8 crc32c instructions, eight bytes at a time.
+__attribute__((target("+crc")))
+static uint32_t UpdateCrc32c(uint32_t crc, const uint8_t *data, size_t size)
+{
+	uint64_t v;
+
+	while (size >= 8) {
+		memcpy(&v, data, 8);
+		crc = __crc32cd(crc, v);
+		data += 8;
+		size -= 8;
+	}
+
+	while (size > 0) {
+		crc = __crc32cb(crc, *data);
+		data++;
+		size--;
+	}
+
+	return crc;
+}
+
+static bool HaveCrc32c()
+{
+#if defined(__ARM_FEATURE_CRC32) || defined(__APPLE__)
+	return true;
+#elif defined(__linux__)
+	return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#else
+	return false;
+#endif
+}
+#endif
+
+Crc32::Crc32(bool reflect, uint32_t poly, bool accel)
 {
 	unsigned int i;
+	unsigned int k;
 	uint32_t r;
 	unsigned int b;
 
 	m_reflect = reflect;
 	m_crc = 0;
+	m_pclmul = false;
+	m_crc32c = false;
+
+#ifdef CRC32_PCLMUL
+	if (accel && reflect && poly == 0x04C11DB7)
+		m_pclmul = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+#endif
+#if defined(CRC32_SSE42) || defined(CRC32_ARMV8)
+	if (accel && reflect && poly == 0x1EDC6F41)
+		m_crc32c = HaveCrc32c();
+#endif
 
 	if (reflect) {
 		poly = ((poly << 16) & 0xFFFF0000) | ((poly >> 16) & 0x0000FFFF);
@@ -43,7 +223,12 @@ Crc32::Crc32(bool reflect, uint32_t poly)
 				else
 					r = (r >> 1);
 			}
-			m_table[i] = r;
+			m_table[0][i] = r;
+		}
+
+		for (k = 1; k < 8; k++) {
+			for (i = 0; i < 256; i++)
+				m_table[k][i] = (m_table[k - 1][i] >> 8) ^ m_table[0][m_table[k - 1][i] & 0xFF];
 		}
 	}
 	else {
@@ -55,9 +240,19 @@ Crc32::Crc32(bool reflect, uint32_t poly)
 				else
 					r = (r << 1);
 			}
-			m_table[i] = r;
+			m_table[0][i] = r;
 		}
 	}
+
+	m_poly = poly;
+
+	if (reflect) {
+		// x^1, in reflected bit order
+		r = 1U << 30;
+		m_x2n[0] = r;
+		for (k = 1; k < 64; k++)
+			m_x2n[k] = r = MulModP(r, r);
+	}
 }
 
 Crc32::~Crc32()
@@ -66,32 +261,99 @@ Crc32::~Crc32()
 }
 
 void Crc32::Calc(const uint8_t *data, size_t size)
+{
+	m_crc = Update(m_crc, data, size);
+}
+
+uint32_t Crc32::GetDataCRC(const uint8_t *data, size_t size, uint32_t initialXor, uint32_t finalXor)
+{
+	m_crc = initialXor;
+	Calc(data, size);
+	return m_crc ^ finalXor;
+}
+
+uint32_t Crc32::Update(uint32_t crc, const uint8_t *data, size_t size) const
 {
 	size_t i;
 
-	for (i = 0; i < size; i++) {
-		if (m_reflect) {
-			CalcLE(data[i]);
-		}
-		else {
-			CalcBE(data[i]);
-		}
+	if (!m_reflect) {
+		for (i = 0; i < size; i++)
+			crc = m_table[0][data[i] ^ ((crc >> 24) & 0xFF)] ^ (crc << 8);
+		return crc;
 	}
+
+#if defined(CRC32_SSE42) || defined(CRC32_ARMV8)
+	if (m_crc32c)
+		return UpdateCrc32c(crc, data, size);
+#endif
+
+#ifdef CRC32_PCLMUL
+	if (m_pclmul && size >= 64) {
+		uint8_t rem[16];
+		size_t done;
+
+		done = FoldPclmul(crc, data, size, rem);
+		crc = UpdateLE(0, rem, sizeof(rem));
+
+		data += done;
+		size -= done;
+	}
+#endif
+
+	return UpdateLE(crc, data, size);
 }
 
-void Crc32::CalcLE(uint8_t b)
+uint32_t Crc32::UpdateLE(uint32_t crc, const uint8_t *data, size_t size) const
 {
-	m_crc = m_table[b ^ (m_crc & 0xFF)] ^ (m_crc >> 8);
+	// Slicing-by-8: eight table lookups per eight bytes, independent of each other.
+	while (size >= 8) {
+		crc ^= data[0] | (data[1] << 8) | (data[2] << 16) | (static_cast<uint32_t>(data[3]) << 24);
+		crc = m_table[7][crc & 0xFF] ^ m_table[6][(crc >> 8) & 0xFF] ^ m_table[5][(crc >> 16) & 0xFF] ^ m_table[4][crc >> 24] ^
+			m_table[3][data[4]] ^ m_table[2][data[5]] ^ m_table[1][data[6]] ^ m_table[0][data[7]];
+
+		data += 8;
+		size -= 8;
+	}
+
+	while (size > 0) {
+		crc = m_table[0][*data ^ (crc & 0xFF)] ^ (crc >> 8);
+		data++;
+		size--;
+	}
+
+	return crc;
 }
 
-void Crc32::CalcBE(uint8_t b)
+uint32_t Crc32::MulModP(uint32_t a, uint32_t b) const
 {
-	m_crc = m_table[b ^ ((m_crc >> 24) & 0xFF)] ^ (m_crc << 8);
+	uint32_t m = 1U << 31;
+	uint32_t p = 0;
+
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = (b & 1) ? (b >> 1) ^ m_poly : (b >> 1);
+	}
+
+	return p;
 }
 
-uint32_t Crc32::GetDataCRC(const uint8_t *data, size_t size, uint32_t initialXor, uint32_t finalXor)
+uint32_t Crc32::Shift(uint32_t crc, uint64_t len) const
 {
-	m_crc = initialXor;
-	Calc(data, size);
-	return m_crc ^ finalXor;
+	// Multiply by x^(8 * len)
+	uint32_t p = 1U << 31;
+	unsigned int k = 3;
+
+	while (len) {
+		if (len & 1)
+			p = MulModP(m_x2n[k], p);
+		len >>= 1;
+		k++;
+	}
+
+	return MulModP(p, crc);
 }
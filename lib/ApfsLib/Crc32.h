@@ -26,7 +26,8 @@
 class Crc32
 {
 public:
-	Crc32(bool reflect, uint32_t poly = 0x04C11DB7);
+	// With accel false, only the tables are used (for comparing the paths).
+	Crc32(bool reflect, uint32_t poly = 0x04C11DB7, bool accel = true);
 	~Crc32();
 
 	void SetCRC(uint32_t crc) { m_crc = crc; }
@@ -35,13 +36,31 @@ public:
 
 	uint32_t GetDataCRC(const uint8_t *data, size_t size, uint32_t initialXor, uint32_t finalXor);
 
+	// Stateless versions, safe to use from several threads at once.
+	// Update runs the CRC register crc over data.
+	uint32_t Update(uint32_t crc, const uint8_t *data, size_t size) const;
+	// Advances the register crc over len zero bytes (reflected CRCs only).
+	uint32_t Shift(uint32_t crc, uint64_t len) const;
+	// CRC of A+B from the CRCs of A and B (reflected CRCs only).
+	uint32_t Combine(uint32_t crc_a, uint32_t crc_b, uint64_t len_b) const { return Shift(crc_a, len_b) ^ crc_b; }
+
+	// True if Update uses PCLMUL or the CRC32C instructions.
+	bool IsAccelerated() const { return m_pclmul || m_crc32c; }
+
 private:
-	void CalcLE(uint8_t b);
-	void CalcBE(uint8_t b);
+	uint32_t UpdateLE(uint32_t crc, const uint8_t *data, size_t size) const;
+	uint32_t MulModP(uint32_t a, uint32_t b) const;
 
-	uint32_t m_table[256];
+	// Slicing-by-8 tables, m_table[0] is the plain byte table
+	uint32_t m_table[8][256];
+	// x^(2^k) mod P, for Shift
+	uint32_t m_x2n[64];
+	uint32_t m_poly;
 	uint32_t m_crc;
 
 	bool m_reflect;
+	bool m_pclmul;
+	// CRC32C instructions (SSE4.2 / ARMv8), only for the reflected 0x1EDC6F41
+	bool m_crc32c;
 };
 
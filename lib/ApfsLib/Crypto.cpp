@@ -2,12 +2,16 @@
 #include "Sha256.h"
 #include "Crypto.h"
 #include "Util.h"
+#include "Global.h"
+#include "ThreadPool.h"
 
 #include <cstring>
 #include <cassert>
 
+#include <algorithm>
 #include <iostream>
 #include <iomanip>
+#include <vector>
 
 #include "Endian.h"
 
@@ -142,6 +146,57 @@ void HMAC_SHA1(const uint8_t *key, size_t key_len, const uint8_t *data, size_t d
 	memset(digest, 0, sizeof(digest));
 }
 
+void HmacSha1::SetKey(const uint8_t *key, size_t key_len)
+{
+	uint8_t kdata[0x40];
+	constexpr uint8_t ipad = 0x36;
+	constexpr uint8_t opad = 0x5C;
+
+	if (key_len > sizeof(kdata))
+	{
+		m_inner.Init();
+		m_inner.Update(key, key_len);
+		m_inner.Final(kdata);
+		key_len = 0x14;
+	}
+	else
+	{
+		memcpy(kdata, key, key_len);
+	}
+	if (key_len < sizeof(kdata))
+		memset(kdata + key_len, 0, sizeof(kdata) - key_len);
+
+	for (size_t k = 0; k < sizeof(kdata); k++)
+		kdata[k] ^= ipad;
+
+	m_inner.Init();
+	m_inner.Update(kdata, sizeof(kdata));
+
+	for (size_t k = 0; k < sizeof(kdata); k++)
+		kdata[k] ^= (ipad ^ opad);
+
+	m_outer.Init();
+	m_outer.Update(kdata, sizeof(kdata));
+
+	memset(kdata, 0, sizeof(kdata));
+}
+
+void HmacSha1::Compute(const uint8_t *data, size_t data_len, uint8_t *mac) const
+{
+	uint8_t digest[0x14];
+	Sha1 sha1;
+
+	sha1 = m_inner;
+	sha1.Update(data, data_len);
+	sha1.Final(digest);
+
+	sha1 = m_outer;
+	sha1.Update(digest, sizeof(digest));
+	sha1.Final(mac);
+
+	memset(digest, 0, sizeof(digest));
+}
+
 void HMAC_SHA256(const uint8_t *key, size_t key_len, const uint8_t *data, size_t data_len, uint8_t *mac)
 {
 	uint8_t kdata[0x40];
@@ -185,103 +240,150 @@ void HMAC_SHA256(const uint8_t *key, size_t key_len, const uint8_t *data, size_t
 	memset(digest, 0, sizeof(digest));
 }
 
-void PBKDF2_HMAC_SHA1(const uint8_t* pw, size_t pw_len, const uint8_t* salt, size_t salt_len, int iterations, uint8_t* derived_key, size_t dk_len)
+// PBKDF2 (RFC 8018) on top of the raw SHA compression functions. The
+// HMAC key pads are hashed once into istate / ostate, after which every
+// iteration is two block function calls on a block that is padded once.
+template<class H>
+static void PBKDF2_F(const uint32_t *istate, const uint32_t *ostate, const uint8_t *salt, size_t salt_len, int iterations, uint32_t i, uint8_t *t)
 {
-	assert(salt_len <= 0x20);
-	assert(dk_len <= 0x20);
-
-	constexpr size_t h_len = 0x14;
-	size_t r;
-	size_t l;
-	uint8_t t[h_len];
-	uint8_t u[h_len];
-	uint8_t s[0x24];
-	size_t k;
-	int j;
-	uint32_t i;
+	constexpr size_t h_len = 4 * H::state_words;
+	uint8_t block[0x40];
+	uint32_t st[H::state_words];
+	size_t len;
 	size_t n;
+	int j;
 
-	r = dk_len % h_len;
-	l = dk_len / h_len;
-	if (r > 0) l++;
-
-	for (i = 1, k = 0; k < dk_len; i++, k += h_len)
+	auto pad = [&block](size_t len)
 	{
-		// F(P,S,c,i)
-
-		memcpy(s, salt, salt_len);
-		s[salt_len + 0] = (i >> 24) & 0xFF;
-		s[salt_len + 1] = (i >> 16) & 0xFF;
-		s[salt_len + 2] = (i >> 8) & 0xFF;
-		s[salt_len + 3] = i & 0xFF;
+		uint64_t bits = (0x40 + len) * 8;
 
-		HMAC_SHA1(pw, pw_len, s, salt_len + 4, u);
-		memcpy(t, u, sizeof(t));
+		block[len] = 0x80;
+		memset(block + len + 1, 0, 0x38 - len - 1);
+		for (size_t k = 0; k < 8; k++)
+			block[0x38 + k] = (bits >> (56 - 8 * k)) & 0xFF;
+	};
 
-		for (j = 1; j < iterations; j++)
+	auto store = [&block, &st]()
+	{
+		for (size_t k = 0; k < H::state_words; k++)
 		{
-			HMAC_SHA1(pw, pw_len, u, sizeof(u), u);
-			for (n = 0; n < h_len; n++)
-				t[n] ^= u[n];
+			block[4 * k + 0] = (st[k] >> 24) & 0xFF;
+			block[4 * k + 1] = (st[k] >> 16) & 0xFF;
+			block[4 * k + 2] = (st[k] >> 8) & 0xFF;
+			block[4 * k + 3] = st[k] & 0xFF;
 		}
+	};
 
-		for (n = 0; n < h_len && (n + k) < dk_len; n++)
-			derived_key[n + k] = t[n];
+	// U_1 = PRF(P, S || INT(i))
+	len = salt_len + 4;
+	memcpy(block, salt, salt_len);
+	block[salt_len + 0] = (i >> 24) & 0xFF;
+	block[salt_len + 1] = (i >> 16) & 0xFF;
+	block[salt_len + 2] = (i >> 8) & 0xFF;
+	block[salt_len + 3] = i & 0xFF;
+	pad(len);
+
+	memcpy(st, istate, sizeof(st));
+	H::Transform(st, block, 1);
+	store();
+	pad(h_len);
+	memcpy(st, ostate, sizeof(st));
+	H::Transform(st, block, 1);
+	store();
+
+	memcpy(t, block, h_len);
+
+	// U_j = PRF(P, U_{j-1}), the padding stays in place
+	for (j = 1; j < iterations; j++)
+	{
+		memcpy(st, istate, sizeof(st));
+		H::Transform(st, block, 1);
+		store();
+		memcpy(st, ostate, sizeof(st));
+		H::Transform(st, block, 1);
+		store();
+
+		for (n = 0; n < h_len; n++)
+			t[n] ^= block[n];
 	}
+
+	memset(block, 0, sizeof(block));
+	memset(st, 0, sizeof(st));
 }
 
-void PBKDF2_HMAC_SHA256(const uint8_t* pw, size_t pw_len, const uint8_t* salt, size_t salt_len, int iterations, uint8_t* derived_key, size_t dk_len)
+template<class H>
+static void PBKDF2(const uint8_t* pw, size_t pw_len, const uint8_t* salt, size_t salt_len, int iterations, uint8_t* derived_key, size_t dk_len)
 {
-	// HMAC_SHA256(pw, key_len, salt, salt_len, mac)
-
-	// l = ceil(dkLen / hLen); // No of blocks
-	// r = dkLen - (l - 1) * hLen; // Octets in last block
-	// T[k] = F(P, S, c, k + 1); // k = 1 .. iterations
-
-	// F(P, S, c, k) = U_1 ^ U_2 ^ ... U_c
-	// U_1 = PRF(P, S || INT(i))
-	// U_2 = PRF(P, U_1)
-	// U_c = PRF(P, U_{c-1})
-
-	assert(salt_len <= 0x10);
-	assert(dk_len <= 0x20);
-
-	constexpr size_t h_len = 0x20;
-	size_t r;
-	size_t l;
-	uint8_t t[h_len];
-	uint8_t u[h_len];
-	uint8_t s[0x14];
-	size_t k;
-	int j;
+	constexpr size_t h_len = 4 * H::state_words;
+	constexpr uint8_t ipad = 0x36;
+	constexpr uint8_t opad = 0x5C;
+	uint8_t kdata[0x40];
+	uint32_t istate[H::state_words];
+	uint32_t ostate[H::state_words];
+	uint32_t l;
 	uint32_t i;
-	size_t n;
+	size_t k;
+
+	assert(salt_len + 4 < 0x38);
 
-	r = dk_len % h_len;
-	l = dk_len / h_len;
-	if (r > 0) l++;
+	if (pw_len > sizeof(kdata))
+	{
+		H h;
 
-	for (i = 1, k = 0; k < dk_len; i++, k += h_len)
+		h.Update(pw, pw_len);
+		h.Final(kdata);
+		pw_len = h_len;
+	}
+	else
 	{
-		// F(P,S,c,i)
+		memcpy(kdata, pw, pw_len);
+	}
+	if (pw_len < sizeof(kdata))
+		memset(kdata + pw_len, 0, sizeof(kdata) - pw_len);
 
-		memcpy(s, salt, salt_len);
-		s[salt_len + 0] = (i >> 24) & 0xFF;
-		s[salt_len + 1] = (i >> 16) & 0xFF;
-		s[salt_len + 2] = (i >> 8) & 0xFF;
-		s[salt_len + 3] = i & 0xFF;
+	for (k = 0; k < sizeof(kdata); k++)
+		kdata[k] ^= ipad;
+	H::InitState(istate);
+	H::Transform(istate, kdata, 1);
 
-		HMAC_SHA256(pw, pw_len, s, salt_len + 4, u);
-		memcpy(t, u, sizeof(t));
+	for (k = 0; k < sizeof(kdata); k++)
+		kdata[k] ^= (ipad ^ opad);
+	H::InitState(ostate);
+	H::Transform(ostate, kdata, 1);
 
-		for (j = 1; j < iterations; j++)
-		{
-			HMAC_SHA256(pw, pw_len, u, sizeof(u), u);
-			for (n = 0; n < h_len; n++)
-				t[n] ^= u[n];
-		}
+	memset(kdata, 0, sizeof(kdata));
 
-		for (n = 0; n < h_len && (n + k) < dk_len; n++)
-			derived_key[n + k] = t[n];
+	// T_i = F(P, S, c, i). The blocks are independent, so they are
+	// computed in parallel.
+	auto block = [&](uint32_t i)
+	{
+		uint8_t t[h_len];
+		size_t offs = (i - 1) * h_len;
+
+		PBKDF2_F<H>(istate, ostate, salt, salt_len, iterations, i, t);
+		memcpy(derived_key + offs, t, std::min(h_len, dk_len - offs));
+		memset(t, 0, sizeof(t));
+	};
+
+	l = static_cast<uint32_t>((dk_len + h_len - 1) / h_len);
+
+	if (g_threads != 1 && l > 1)
+	{
+		ThreadPool::Get().ParallelFor(l, [&block](size_t idx) { block(static_cast<uint32_t>(idx + 1)); });
 	}
+	else
+	{
+		for (i = 1; i <= l; i++)
+			block(i);
+	}
+}
+
+void PBKDF2_HMAC_SHA1(const uint8_t* pw, size_t pw_len, const uint8_t* salt, size_t salt_len, int iterations, uint8_t* derived_key, size_t dk_len)
+{
+	PBKDF2<Sha1>(pw, pw_len, salt, salt_len, iterations, derived_key, dk_len);
+}
+
+void PBKDF2_HMAC_SHA256(const uint8_t* pw, size_t pw_len, const uint8_t* salt, size_t salt_len, int iterations, uint8_t* derived_key, size_t dk_len)
+{
+	PBKDF2<SHA256>(pw, pw_len, salt, salt_len, iterations, derived_key, dk_len);
 }
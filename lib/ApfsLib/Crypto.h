@@ -3,6 +3,7 @@
 #include <cstdint>
 
 #include "Aes.h"
+#include "Sha1.h"
 
 void Rfc3394_KeyWrap(uint8_t *crypto, const uint8_t *plain, size_t size, const uint8_t *key, AES::Mode aes_mode, uint64_t iv);
 bool Rfc3394_KeyUnwrap(uint8_t *plain, const uint8_t *crypto, size_t size, const uint8_t *key, AES::Mode aes_mode, uint64_t *iv);
@@ -10,3 +11,17 @@ void HMAC_SHA1(const uint8_t *key, size_t key_len, const uint8_t *data, size_t d
 void HMAC_SHA256(const uint8_t *key, size_t key_len, const uint8_t *data, size_t data_len, uint8_t *mac);
 void PBKDF2_HMAC_SHA1(const uint8_t* pw, size_t pw_len, const uint8_t* salt, size_t salt_len, int iterations, uint8_t* derived_key, size_t dk_len);
 void PBKDF2_HMAC_SHA256(const uint8_t* pw, size_t pw_len, const uint8_t* salt, size_t salt_len, int iterations, uint8_t* derived_key, size_t dk_len);
+
+// HMAC-SHA1 with the padded key hashed once up front, for computing many
+// MACs under the same key. Compute is const and may be called from several
+// threads at once.
+class HmacSha1
+{
+public:
+	void SetKey(const uint8_t *key, size_t key_len);
+	void Compute(const uint8_t *data, size_t data_len, uint8_t *mac) const;
+
+private:
+	Sha1 m_inner;
+	Sha1 m_outer;
+};
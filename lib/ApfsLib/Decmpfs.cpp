@@ -76,7 +76,9 @@ bool IsDecompAlgoInRsrc(uint16_t algo)
 	}
 }
 
-bool DecompressFile(ApfsDir &dir, uint64_t ino, std::vector<uint8_t> &decompressed, const std::vector<uint8_t> &compressed)
+// get_rsrc(rsrc) loads the resource fork of the file.
+template<typename F>
+static bool DecompressFileImpl(F &&get_rsrc, uint64_t ino, std::vector<uint8_t> &decompressed, const std::vector<uint8_t> &compressed)
 {
 	if (compressed.size() < sizeof(CompressionHeader))
 		return false;
@@ -117,7 +119,7 @@ bool DecompressFile(ApfsDir &dir, uint64_t ino, std::vector<uint8_t> &decompress
 		std::vector<uint8_t> rsrc;
 		size_t k;
 
-		bool rc = dir.GetAttribute(rsrc, ino, "com.apple.ResourceFork");
+		bool rc = get_rsrc(rsrc);
 
 		if (!rc)
 		{
@@ -275,7 +277,7 @@ bool DecompressFile(ApfsDir &dir, uint64_t ino, std::vector<uint8_t> &decompress
 #else
 	if (IsDecompAlgoInRsrc(hdr->algo))
 	{
-		dir.GetAttribute(decompressed, ino, "com.apple.ResourceFork");
+		get_rsrc(decompressed);
 	}
 	else
 	{
@@ -285,3 +287,13 @@ bool DecompressFile(ApfsDir &dir, uint64_t ino, std::vector<uint8_t> &decompress
 
 	return true;
 }
+
+bool DecompressFile(ApfsDir &dir, uint64_t ino, std::vector<uint8_t> &decompressed, const std::vector<uint8_t> &compressed)
+{
+	return DecompressFileImpl([&dir, ino](std::vector<uint8_t> &rsrc) { return dir.GetAttribute(rsrc, ino, "com.apple.ResourceFork"); }, ino, decompressed, compressed);
+}
+
+bool DecompressFile(ApfsDir &dir, const ApfsCatalog &cat, uint64_t ino, std::vector<uint8_t> &decompressed, const std::vector<uint8_t> &compressed)
+{
+	return DecompressFileImpl([&dir, &cat, ino](std::vector<uint8_t> &rsrc) { return dir.GetAttribute(rsrc, cat, ino, ApfsCatalog::ATTR_RSRC_FORK); }, ino, decompressed, compressed);
+}
@@ -34,3 +34,5 @@ bool IsDecompAlgoSupported(uint16_t algo);
 bool IsDecompAlgoInRsrc(uint16_t algo);
 
 bool DecompressFile(ApfsDir &dir, uint64_t ino, std::vector<uint8_t> &decompressed, const std::vector<uint8_t> &compressed);
+// Same, but takes the resource fork from the catalog.
+bool DecompressFile(ApfsDir &dir, const ApfsCatalog &cat, uint64_t ino, std::vector<uint8_t> &decompressed, const std::vector<uint8_t> &compressed);
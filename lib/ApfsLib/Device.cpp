@@ -38,6 +38,50 @@ Device::~Device()
 {
 }
 
+void Device::GetAllocation(uint64_t offs, uint64_t &len, bool &is_hole)
+{
+	uint64_t size = GetSize();
+
+	len = (offs < size) ? size - offs : 0;
+	is_hole = false;
+}
+
+uint64_t Device::SeekData(uint64_t offs)
+{
+	uint64_t len;
+	bool is_hole;
+
+	for (;;)
+	{
+		GetAllocation(offs, len, is_hole);
+
+		if (len == 0)
+			return GetSize();
+		if (!is_hole)
+			return offs;
+
+		offs += len;
+	}
+}
+
+uint64_t Device::SeekHole(uint64_t offs)
+{
+	uint64_t len;
+	bool is_hole;
+
+	for (;;)
+	{
+		GetAllocation(offs, len, is_hole);
+
+		if (len == 0)
+			return GetSize();
+		if (is_hole)
+			return offs;
+
+		offs += len;
+	}
+}
+
 Device * Device::OpenDevice(const char * name)
 {
 	Device *dev = nullptr;
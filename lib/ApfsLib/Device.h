@@ -35,6 +35,25 @@ public:
 	virtual bool Read(void *data, uint64_t offs, uint64_t len) = 0;
 	virtual uint64_t GetSize() const = 0;
 
+	// Hint that a range is going to be read soon. Devices may start
+	// loading it in the background.
+	virtual void Prefetch(uint64_t offs, uint64_t len) { (void)offs; (void)len; }
+
+	// Direct pointer to the data at offs if the device is backed by a memory
+	// mapping and the range is contiguous in it, nullptr otherwise. Stays
+	// valid until Close.
+	virtual const uint8_t *GetMapping(uint64_t offs, uint64_t len) { (void)offs; (void)len; return nullptr; }
+
+	// Allocation map. Returns in len the length of the run starting at offs
+	// which either reads as all zeros (is_hole) or may contain data, or 0 at
+	// the end of the device. By default, everything is data.
+	virtual void GetAllocation(uint64_t offs, uint64_t &len, bool &is_hole);
+
+	// Like lseek with SEEK_DATA / SEEK_HOLE. Return GetSize() if there is
+	// no data / hole at or after offs.
+	uint64_t SeekData(uint64_t offs);
+	uint64_t SeekHole(uint64_t offs);
+
 	unsigned int GetSectorSize() const { return m_sector_size; }
 	void SetSectorSize(unsigned int size) { m_sector_size = size; }
 
@@ -17,11 +17,17 @@ You should have received a copy of the GNU General Public License
 along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
 #include <cstring>
+#include <functional>
+#include <string_view>
 #include <vector>
 #include <iostream>
 #include <iomanip>
 
+#include "Global.h"
 #include "Endian.h"
 #include "Util.h"
 #include "PList.h"
@@ -100,8 +106,113 @@ struct MishEntry
 
 static_assert(sizeof(MishEntry) == 0x28, "Wrong Mish Entry Size");
 
+// Sidecar index (<image>.idx), followed by entry_count sections. Host byte
+// order, it is only meant to be used on the machine that wrote it.
+struct DmgIndexHeader
+{
+	char         signature[8];
+	uint32_t     byte_order;
+	uint32_t     entry_size;
+	uint64_t     image_size;
+	int64_t      image_mtime;
+	uint32_t     koly_crc;
+	uint32_t     entries_crc;
+	uint64_t     entry_count;
+};
+
+static_assert(sizeof(DmgIndexHeader) == 0x30, "Wrong DMG Index Header Size");
+
+static const char dmg_index_signature[8] = { 'D', 'M', 'G', 'I', 'D', 'X', '0', '1' };
+static const uint32_t dmg_index_byte_order = 0x01020304;
+
 #pragma pack(pop)
 
+// Picks the mish blocks (resource-fork / blkx / n / Data) out of the plist
+// as they stream by.
+class DmgBlkxHandler : public PListXmlHandler
+{
+public:
+	DmgBlkxHandler(std::function<void(const uint8_t *, size_t)> mish_fn) : m_mish_fn(mish_fn)
+	{
+		m_blkx_cnt = 0;
+	}
+
+	bool StartDict() override { return Push(); }
+	bool EndDict() override { return Pop(); }
+	bool StartArray() override { return Push(); }
+	bool EndArray() override { return Pop(); }
+
+	bool Key(std::string_view key) override
+	{
+		m_key = key;
+		return true;
+	}
+
+	bool Data(std::string_view base64) override
+	{
+		size_t size;
+
+		if (m_path.size() != 4 || m_path[1] != "resource-fork" || m_path[2] != "blkx" || m_key != "Data")
+			return true;
+
+		m_mish.resize(PListBase64DecodedSize(base64.size()));
+		size = PListBase64Decode(m_mish.data(), base64.data(), base64.size());
+
+		m_mish_fn(m_mish.data(), size);
+		m_blkx_cnt++;
+
+		return true;
+	}
+
+	size_t GetBlkxCount() const { return m_blkx_cnt; }
+
+private:
+	// The path records the key each container was opened under.
+	bool Push()
+	{
+		m_path.push_back(m_key);
+		m_key = std::string_view();
+		return true;
+	}
+
+	bool Pop()
+	{
+		m_path.pop_back();
+		m_key = std::string_view();
+		return true;
+	}
+
+	std::function<void(const uint8_t *, size_t)> m_mish_fn;
+	std::vector<std::string_view> m_path;
+	std::string_view m_key;
+	std::vector<uint8_t> m_mish;
+	size_t m_blkx_cnt;
+};
+
+uint64_t g_dmg_cache_size = 64 * 1024 * 1024;
+bool g_dmg_index = false;
+bool g_dmg_verify = false;
+
+// UDIF checksum type for CRC32; other types are not verified
+static const uint32_t dmg_checksum_crc32 = 2;
+// Piece size for checking the data fork in parallel
+static const uint64_t dmg_data_fork_piece = 4 * 1024 * 1024;
+unsigned int g_dmg_readahead = 4;
+
+static bool IsCompressedMethod(uint32_t method)
+{
+	switch (method)
+	{
+	case 0x80000004: // adc
+	case 0x80000005: // zlib
+	case 0x80000006: // bzip2
+	case 0x80000007: // lzfse
+		return true;
+	default:
+		return false;
+	}
+}
+
 DeviceDMG::DmgSection::DmgSection()
 {
 	method = 0;
@@ -110,12 +221,6 @@ DeviceDMG::DmgSection::DmgSection()
 	disk_length = 0;
 	dmg_offset = 0;
 	dmg_length = 0;
-	cache = nullptr;
-}
-
-DeviceDMG::DmgSection::~DmgSection()
-{
-	delete[] cache;
 }
 
 DeviceDMG::DeviceDMG() : m_crc(true)
@@ -125,20 +230,23 @@ DeviceDMG::DeviceDMG() : m_crc(true)
 
 	m_is_raw = false;
 
-#ifdef DMG_CACHE
-	m_cache_base = 0;
-	m_cache_size = 0;
-	m_cache_data = 0;
-#endif
+	m_cache_used = 0;
+	m_cache_limit = g_dmg_cache_size;
+
+	m_last_chunk = static_cast<size_t>(-1);
+	m_readahead = 0;
+	m_pool = nullptr;
+	m_readahead_pending = 0;
+
+	m_verify = false;
+	m_data_fork_checksum_type = 0;
+	m_data_fork_checksum = 0;
+	m_data_fork_length = 0;
 }
 
 DeviceDMG::~DeviceDMG()
 {
 	Close();
-
-#ifdef DMG_CACHE
-	delete[] m_cache_data;
-#endif
 }
 
 bool DeviceDMG::Open(const char * name)
@@ -192,7 +300,31 @@ bool DeviceDMG::Open(const char * name)
 	m_size = koly.sector_count * 0x200;
 	m_offset = koly.data_fork_offset;
 
-	if (koly.xml_offset != 0)
+	m_verify = g_dmg_verify;
+	m_data_fork_checksum_type = koly.data_fork_checksum_type;
+	m_data_fork_checksum = koly.data_fork_checksum_data;
+	m_data_fork_length = koly.data_fork_length;
+
+	std::string index_path;
+	uint32_t koly_crc = 0;
+	bool from_index = false;
+
+	// The section table of an encrypted image is not written out in the clear.
+	if (g_dmg_index && !m_img.IsEncrypted())
+	{
+		index_path = std::string(name) + ".idx";
+		koly_crc = m_crc.GetDataCRC(reinterpret_cast<const uint8_t *>(&koly), sizeof(koly), 0xFFFFFFFF, 0xFFFFFFFF);
+	}
+
+	// The index has no checksums, so verify mode always parses the plist.
+	if (!index_path.empty() && !m_verify && LoadIndex(index_path, koly_crc))
+	{
+		if (g_debug & Dbg_Info)
+			printf("Loading DMG using index %s.\n", index_path.c_str());
+
+		from_index = true;
+	}
+	else if (koly.xml_offset != 0)
 	{
 		if (g_debug & Dbg_Info)
 			printf("Loading DMG using XML plist.\n");
@@ -232,54 +364,53 @@ bool DeviceDMG::Open(const char * name)
 	m_dbg.close();
 #endif
 
+	if (!index_path.empty() && !from_index)
+		SaveIndex(index_path, koly_crc);
+
+	if (m_verify)
+	{
+		m_section_crc.assign(m_sections.size(), 0);
+		m_section_crc_valid.assign(m_sections.size(), 0);
+	}
+
+	m_cache_limit = g_dmg_cache_size;
+	m_readahead = g_dmg_readahead;
+
+	if (m_readahead > 0)
+		m_pool = &ThreadPool::Get();
+
 	return true;
 }
 
 void DeviceDMG::Close()
 {
+	// Wait for the read ahead jobs before anything they use goes away.
+	StopReadAhead();
+	m_pool = nullptr;
+
 	m_img.Close();
 	m_size = 0;
 	m_sections.clear();
+	m_partitions.clear();
+	m_section_crc.clear();
+	m_section_crc_valid.clear();
+	m_verify = false;
 	m_is_raw = false;
+
+	ClearCache();
 }
 
 bool DeviceDMG::Read(void * data, uint64_t offs, uint64_t len)
 {
 	if (m_is_raw)
-	{
-		m_img.Read(offs + m_offset, data, len);
-		return true;
-		// TODO: Error handling ...
-	}
-
-	// Binary search start sector in m_sections
-	// Get data if necessary
-	// Decompress: cache data
+		return m_img.Read(offs + m_offset, data, len);
 
-	size_t entry_idx = m_sections.size();
+	size_t entry_idx;
 	size_t rd_offs;
 	size_t rd_size;
 	char *bdata = reinterpret_cast<char *>(data);
-	bool compressed = false;
 
-	ptrdiff_t beg = 0;
-	ptrdiff_t end = m_sections.size() - 1;
-	ptrdiff_t mid;
-
-	while (beg <= end)
-	{
-		mid = (beg + end) / 2;
-
-		if (offs >= m_sections[mid].disk_offset && offs < (m_sections[mid].disk_offset + m_sections[mid].disk_length))
-		{
-			entry_idx = mid;
-			break;
-		}
-		else if (offs < m_sections[mid].disk_offset)
-			end = mid - 1;
-		else
-			beg = mid + 1;
-	}
+	entry_idx = FindSection(offs);
 
 	if (entry_idx == m_sections.size())
 		return false;
@@ -296,12 +427,11 @@ bool DeviceDMG::Read(void * data, uint64_t offs, uint64_t len)
 		if (rd_offs + rd_size > sect.disk_length)
 			rd_size = sect.disk_length - rd_offs;
 
-		compressed = false;
-
 		switch (sect.method)
 		{
 		case 1: // raw
-			m_img.Read(rd_offs + sect.dmg_offset + m_offset, bdata, rd_size);
+			if (!m_img.Read(rd_offs + sect.dmg_offset + m_offset, bdata, rd_size))
+				return false;
 			break;
 		case 0: // unsure ...
 		case 2: // ignore
@@ -311,100 +441,331 @@ bool DeviceDMG::Read(void * data, uint64_t offs, uint64_t len)
 		case 0x80000005: // zlib
 		case 0x80000006: // bzip2
 		case 0x80000007: // lzfse
-			compressed = true;
+		{
+			// A whole chunk is decoded straight into the caller's buffer,
+			// only partial reads go through the cache.
+			if (rd_offs == 0 && rd_size == sect.disk_length)
+			{
+				if (!ReadChunkDirect(entry_idx, reinterpret_cast<uint8_t *>(bdata)))
+					return false;
+				break;
+			}
+
+			std::shared_ptr<std::vector<uint8_t>> chunk = GetChunk(entry_idx);
+
+			if (!chunk)
+				return false;
+
+			memcpy(bdata, chunk->data() + rd_offs, rd_size);
 			break;
+		}
 		default:
 			std::cerr << "DMG: unknown compression method " << sect.method << std::endl;
 			return false;
 		}
 
-		if (compressed)
+		bdata += rd_size;
+		offs += rd_size;
+		len -= rd_size;
+		entry_idx++;
+	}
+
+	return true;
+}
+
+void DeviceDMG::Prefetch(uint64_t offs, uint64_t len)
+{
+	size_t entry_idx;
+
+	if (m_is_raw || !m_pool)
+		return;
+
+	for (entry_idx = FindSection(offs); entry_idx < m_sections.size(); entry_idx++)
+	{
+		if (m_sections[entry_idx].disk_offset >= offs + len)
+			break;
+
+		QueueReadAhead(entry_idx);
+	}
+}
+
+void DeviceDMG::GetAllocation(uint64_t offs, uint64_t &len, bool &is_hole)
+{
+	size_t entry_idx;
+	uint64_t end;
+
+	len = 0;
+	is_hole = false;
+
+	if (offs >= m_size)
+		return;
+
+	if (m_is_raw)
+	{
+		len = m_size - offs;
+		return;
+	}
+
+	entry_idx = FindSection(offs);
+
+	if (entry_idx == m_sections.size())
+	{
+		// Not covered by any section, report as data up to the next one.
+		auto next = std::upper_bound(m_sections.begin(), m_sections.end(), offs,
+			[](uint64_t o, const DmgSection &s) { return o < s.disk_offset; });
+
+		end = (next != m_sections.end() && next->disk_offset < m_size) ? next->disk_offset : m_size;
+		len = end - offs;
+		return;
+	}
+
+	is_hole = IsZeroSection(entry_idx);
+	end = m_sections[entry_idx].disk_offset + m_sections[entry_idx].disk_length;
+
+	// Merge adjacent sections of the same kind
+	for (entry_idx++; entry_idx < m_sections.size(); entry_idx++)
+	{
+		if (m_sections[entry_idx].disk_offset != end || IsZeroSection(entry_idx) != is_hole)
+			break;
+
+		end += m_sections[entry_idx].disk_length;
+	}
+
+	if (end > m_size)
+		end = m_size;
+
+	len = end - offs;
+}
+
+void DeviceDMG::GetSectionExtent(size_t idx, uint64_t &offs, uint64_t &len) const
+{
+	offs = m_sections[idx].disk_offset;
+	len = m_sections[idx].disk_length;
+}
+
+bool DeviceDMG::IsZeroSection(size_t idx) const
+{
+	return m_sections[idx].method == 0 || m_sections[idx].method == 2;
+}
+
+bool DeviceDMG::ReadSection(size_t idx, uint8_t *dst)
+{
+	const DmgSection &sect = m_sections[idx];
+	bool ok;
+
+	switch (sect.method)
+	{
+	case 1:
+		ok = m_img.Read(sect.dmg_offset + m_offset, dst, sect.disk_length);
+		break;
+	case 0:
+	case 2:
+		memset(dst, 0, sect.disk_length);
+		ok = true;
+		break;
+	default:
+		ok = DecompressChunk(dst, sect);
+		break;
+	}
+
+	if (ok && !IsZeroSection(idx))
+		RecordSectionCrc(idx, dst);
+
+	return ok;
+}
+
+void DeviceDMG::RecordSectionCrc(size_t idx, const uint8_t *data)
+{
+	if (!m_verify)
+		return;
+
+	// Each section has its own slot, and a section is only decoded by one
+	// thread at a time, so no locking is needed here.
+	m_section_crc[idx] = m_crc.Update(0xFFFFFFFF, data, m_sections[idx].disk_length) ^ 0xFFFFFFFF;
+	m_section_crc_valid[idx] = 1;
+}
+
+bool DeviceDMG::GetPartitionCrc(const DmgPartition &part, uint32_t &crc) const
+{
+	size_t n;
+
+	crc = 0;
+	for (n = part.first_section; n < part.first_section + part.section_count; n++)
+	{
+		const DmgSection &sect = m_sections[n];
+
+		if (IsZeroSection(n))
+			crc = m_crc.Combine(crc, m_crc.Shift(0xFFFFFFFF, sect.disk_length) ^ 0xFFFFFFFF, sect.disk_length);
+		else if (m_section_crc_valid[n])
+			crc = m_crc.Combine(crc, m_section_crc[n], sect.disk_length);
+		else
+			return false;
+	}
+
+	return true;
+}
+
+bool DeviceDMG::CheckChecksums(ThreadPool &pool)
+{
+	std::atomic<bool> failed(false);
+	bool ok = true;
+	uint32_t crc;
+	size_t k;
+
+	if (!m_verify || m_is_raw)
+		return true;
+
+	// ReadSection doesn't coordinate with the read ahead, which may still
+	// be recording section checksums.
+	StopReadAhead();
+
+	// Decode whatever has not been seen yet
+	pool.ParallelFor(m_sections.size(), [this, &failed](size_t idx)
+	{
+		thread_local std::vector<uint8_t> buffer;
+
+		if (IsZeroSection(idx) || m_section_crc_valid[idx] || failed)
+			return;
+
+		buffer.resize(m_sections[idx].disk_length);
+		if (!ReadSection(idx, buffer.data()))
+			failed = true;
+	});
+
+	if (failed)
+	{
+		std::cerr << "DMG: error decoding image, cannot verify checksums." << std::endl;
+		return false;
+	}
+
+	for (k = 0; k < m_partitions.size(); k++)
+	{
+		const DmgPartition &part = m_partitions[k];
+
+		if (part.checksum_type != dmg_checksum_crc32)
+			continue;
+
+		GetPartitionCrc(part, crc);
+
+		if (crc != part.checksum)
 		{
-#ifdef DMG_CACHE
-			if (m_cache_data == 0 || m_cache_base != sect.disk_offset || m_cache_size != sect.disk_length)
-			{
-				delete[] m_cache_data;
-				m_cache_data = 0;
-
-				uint8_t *compr_buf = new uint8_t[sect.dmg_length];
-
-				m_cache_data = new uint8_t[sect.disk_length];
-				m_cache_base = sect.disk_offset;
-				m_cache_size = sect.disk_length;
-
-				m_img.Read(sect.dmg_offset + m_offset, compr_buf, sect.dmg_length);
-
-				switch (sect.method)
-				{
-				case 0x80000004:
-					DecompressADC(m_cache_data, sect.disk_length, compr_buf, sect.dmg_length);
-					break;
-				case 0x80000005:
-					DecompressZLib(m_cache_data, sect.disk_length, compr_buf, sect.dmg_length);
-					break;
-				case 0x80000006:
-					DecompressBZ2(m_cache_data, sect.disk_length, compr_buf, sect.dmg_length);
-					break;
-				case 0x80000007:
-					DecompressLZFSE(m_cache_data, sect.disk_length, compr_buf, sect.dmg_length);
-					break;
-				default:
-					std::cerr << "DMG: invalid compression method " << sect.method << std::endl;
-					return false;
-					break;
-				}
+			std::cerr << "DMG: checksum mismatch in partition " << k << std::hex << " (expected " << part.checksum << ", got " << crc << ")" << std::dec << std::endl;
+			ok = false;
+		}
+	}
 
-				delete[] compr_buf;
-			}
+	if (!CheckDataFork(pool))
+		ok = false;
 
-			memcpy(bdata, m_cache_data + rd_offs, rd_size);
-#else
+	return ok;
+}
 
-			if (sect.cache == nullptr)
-			{
-				uint8_t *compr_buf = new uint8_t[sect.dmg_length];
-
-				sect.cache = new uint8_t[sect.disk_length];
-
-				m_img.Read(sect.dmg_offset + m_offset, compr_buf, sect.dmg_length);
-
-				switch (sect.method)
-				{
-				case 0x80000004:
-					DecompressADC(sect.cache, sect.disk_length, compr_buf, sect.dmg_length);
-					break;
-				case 0x80000005:
-					DecompressZLib(sect.cache, sect.disk_length, compr_buf, sect.dmg_length);
-					break;
-				case 0x80000006:
-					DecompressBZ2(sect.cache, sect.disk_length, compr_buf, sect.dmg_length);
-					break;
-				case 0x80000007:
-					DecompressLZFSE(sect.cache, sect.disk_length, compr_buf, sect.dmg_length);
-					break;
-				default:
-					std::cerr << "DMG: invalid compression method " << sect.method << std::endl;
-					return false;
-					break;
-				}
+bool DeviceDMG::CheckReadChecksums(size_t &unchecked)
+{
+	std::vector<uint8_t> buffer;
+	bool ok = true;
+	bool complete;
+	uint32_t crc;
+	size_t k;
+	size_t n;
+
+	unchecked = 0;
 
-				delete[] compr_buf;
+	if (!m_verify || m_is_raw)
+		return true;
 
-				memcpy(bdata, sect.cache + rd_offs, rd_size);
+	// Read ahead jobs may still be recording section checksums
+	StopReadAhead();
 
-#if 1 // TODO: figure out some intelligent cache mechanism ...
-				delete[] sect.cache;
-				sect.cache = nullptr;
-#endif
+	for (k = 0; k < m_partitions.size(); k++)
+	{
+		const DmgPartition &part = m_partitions[k];
+
+		if (part.checksum_type != dmg_checksum_crc32)
+			continue;
+
+		// Sections stored uncompressed are cheap to read again, only
+		// compressed ones that have not been decoded are missing.
+		complete = true;
+		for (n = part.first_section; n < part.first_section + part.section_count; n++)
+		{
+			if (!IsZeroSection(n) && !m_section_crc_valid[n] && m_sections[n].method != 1)
+			{
+				complete = false;
+				break;
 			}
-#endif
 		}
 
+		if (!complete)
+		{
+			unchecked++;
+			continue;
+		}
 
-		bdata += rd_size;
-		offs += rd_size;
-		len -= rd_size;
-		entry_idx++;
+		for (n = part.first_section; n < part.first_section + part.section_count; n++)
+		{
+			if (IsZeroSection(n) || m_section_crc_valid[n])
+				continue;
+
+			buffer.resize(m_sections[n].disk_length);
+			if (!ReadSection(n, buffer.data()))
+				return false;
+		}
+
+		GetPartitionCrc(part, crc);
+
+		if (crc != part.checksum)
+		{
+			std::cerr << "DMG: checksum mismatch in partition " << k << std::hex << " (expected " << part.checksum << ", got " << crc << ")" << std::dec << std::endl;
+			ok = false;
+		}
+	}
+
+	return ok;
+}
+
+bool DeviceDMG::CheckDataFork(ThreadPool &pool)
+{
+	std::vector<uint32_t> piece_crc;
+	std::atomic<bool> failed(false);
+	uint32_t crc;
+	size_t k;
+
+	if (m_data_fork_checksum_type != dmg_checksum_crc32)
+		return true;
+
+	piece_crc.resize((m_data_fork_length + dmg_data_fork_piece - 1) / dmg_data_fork_piece);
+
+	pool.ParallelFor(piece_crc.size(), [this, &piece_crc, &failed](size_t idx)
+	{
+		thread_local std::vector<uint8_t> buffer;
+		uint64_t offs = idx * dmg_data_fork_piece;
+		uint64_t len = std::min(dmg_data_fork_piece, m_data_fork_length - offs);
+
+		buffer.resize(len);
+		if (!m_img.Read(m_offset + offs, buffer.data(), len))
+		{
+			failed = true;
+			return;
+		}
+
+		piece_crc[idx] = m_crc.Update(0xFFFFFFFF, buffer.data(), len) ^ 0xFFFFFFFF;
+	});
+
+	if (failed)
+	{
+		std::cerr << "DMG: error reading data fork, cannot verify checksum." << std::endl;
+		return false;
+	}
+
+	crc = 0;
+	for (k = 0; k < piece_crc.size(); k++)
+		crc = m_crc.Combine(crc, piece_crc[k], std::min(dmg_data_fork_piece, m_data_fork_length - k * dmg_data_fork_piece));
+
+	if (crc != m_data_fork_checksum)
+	{
+		std::cerr << "DMG: data fork checksum mismatch" << std::hex << " (expected " << m_data_fork_checksum << ", got " << crc << ")" << std::dec << std::endl;
+		return false;
 	}
 
 	return true;
@@ -415,61 +776,458 @@ uint64_t DeviceDMG::GetSize() const
 	return m_size;
 }
 
-bool DeviceDMG::ProcessHeaderXML(uint64_t off, uint64_t size)
+size_t DeviceDMG::FindSection(uint64_t offs) const
 {
-	std::vector<char> xmldata;
+	ptrdiff_t beg = 0;
+	ptrdiff_t end = m_sections.size() - 1;
+	ptrdiff_t mid;
 
-	xmldata.resize(size, 0);
+	while (beg <= end)
+	{
+		mid = (beg + end) / 2;
 
-	m_img.Read(off, xmldata.data(), size);
+		if (offs >= m_sections[mid].disk_offset && offs < (m_sections[mid].disk_offset + m_sections[mid].disk_length))
+			return mid;
+		else if (offs < m_sections[mid].disk_offset)
+			end = mid - 1;
+		else
+			beg = mid + 1;
+	}
 
-	PListXmlParser parser(xmldata.data(), xmldata.size());
-	const PLDict *plist = parser.Parse()->toDict();
+	return m_sections.size();
+}
 
-	if (!plist)
-		return false;
+std::shared_ptr<std::vector<uint8_t>> DeviceDMG::GetChunk(size_t sect_idx)
+{
+	std::shared_ptr<std::vector<uint8_t>> data;
+	bool new_chunk;
+	size_t k;
 
-	const PLDict *rsrc_fork = plist->get("resource-fork")->toDict();
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
 
-	if (!rsrc_fork)
-		return false;
+		new_chunk = (sect_idx != m_last_chunk);
+		m_last_chunk = sect_idx;
 
-	const PLArray *blkx = rsrc_fork->get("blkx")->toArray();
+		for (;;)
+		{
+			auto it = m_cache.find(sect_idx);
 
-	if (!blkx)
-		return false;
+			if (it != m_cache.end())
+			{
+				m_cache_lru.splice(m_cache_lru.begin(), m_cache_lru, it->second.lru);
+				data = it->second.data;
+				break;
+			}
+
+			auto fl = m_inflight.find(sect_idx);
 
-	const PLDict *entry;
-	const PLData *mish;
+			// Nobody is working on it yet (at most it is queued), so
+			// claim it and decompress it on this thread.
+			if (fl == m_inflight.end() || !fl->second.claimed)
+			{
+				m_inflight[sect_idx] = InFlight{ true, false };
+				break;
+			}
+
+			fl->second.wanted = true;
+			m_cond.wait(lock);
+		}
+	}
+
+	if (!data)
+		data = LoadChunk(sect_idx);
+
+	if (new_chunk && m_pool)
+	{
+		for (k = 1; k <= m_readahead && sect_idx + k < m_sections.size(); k++)
+			QueueReadAhead(sect_idx + k);
+	}
+
+	return data;
+}
+
+bool DeviceDMG::ReadChunkDirect(size_t sect_idx, uint8_t *dst)
+{
+	const DmgSection &sect = m_sections[sect_idx];
+	bool shared;
+	bool new_chunk = false;
+	bool ok;
 	size_t k;
 
-	for (k = 0; k < blkx->size(); k++)
 	{
-		entry = blkx->get(k)->toDict();
+		std::lock_guard<std::mutex> lock(m_mutex);
 
-		if (!entry)
-			return false;
+		auto fl = m_inflight.find(sect_idx);
 
-		mish = entry->get("Data")->toData();
+		// Cached or being decompressed by someone else: copy it from there.
+		shared = m_cache.count(sect_idx) || (fl != m_inflight.end() && fl->second.claimed);
 
-		if (!mish)
+		if (!shared)
+		{
+			// Claim it, this also cancels a queued read ahead.
+			m_inflight[sect_idx] = InFlight{ true, false };
+
+			new_chunk = (sect_idx != m_last_chunk);
+			m_last_chunk = sect_idx;
+		}
+	}
+
+	if (shared)
+	{
+		std::shared_ptr<std::vector<uint8_t>> chunk = GetChunk(sect_idx);
+
+		if (!chunk)
 			return false;
 
-		ProcessMish(mish->data(), mish->size());
+		memcpy(dst, chunk->data(), chunk->size());
+		return true;
+	}
+
+	if (new_chunk && m_pool)
+	{
+		for (k = 1; k <= m_readahead && sect_idx + k < m_sections.size(); k++)
+			QueueReadAhead(sect_idx + k);
+	}
+
+	ok = DecompressChunk(dst, sect);
+
+	if (ok)
+		RecordSectionCrc(sect_idx, dst);
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		auto fl = m_inflight.find(sect_idx);
+
+		// Readers that waited for this chunk would decompress it again if
+		// it wasn't in the cache, so put a copy there for them.
+		if (ok && fl != m_inflight.end() && fl->second.wanted)
+		{
+			std::shared_ptr<std::vector<uint8_t>> data = EvictChunks(sect.disk_length);
+
+			if (!data)
+				data = std::make_shared<std::vector<uint8_t>>();
+
+			data->assign(dst, dst + sect.disk_length);
+			m_cache_used += sect.disk_length;
+			m_cache_lru.push_front(sect_idx);
+
+			CacheEntry &entry = m_cache[sect_idx];
+			entry.data = data;
+			entry.lru = m_cache_lru.begin();
+		}
+
+		if (fl != m_inflight.end())
+			m_inflight.erase(fl);
+	}
+
+	m_cond.notify_all();
+
+	return ok;
+}
+
+std::shared_ptr<std::vector<uint8_t>> DeviceDMG::EvictChunks(uint64_t size)
+{
+	std::shared_ptr<std::vector<uint8_t>> data;
+
+	// Make room first, so that the buffer of an evicted chunk can be
+	// reused for the new one. A chunk larger than the whole budget is
+	// still cached on its own.
+	while (!m_cache_lru.empty() && m_cache_used + size > m_cache_limit)
+	{
+		auto victim = m_cache.find(m_cache_lru.back());
+
+		m_cache_used -= victim->second.data->size();
+		if (!data && victim->second.data.use_count() == 1)
+			data = std::move(victim->second.data);
+		m_cache.erase(victim);
+		m_cache_lru.pop_back();
+	}
+
+	return data;
+}
+
+std::shared_ptr<std::vector<uint8_t>> DeviceDMG::LoadChunk(size_t sect_idx)
+{
+	const DmgSection &sect = m_sections[sect_idx];
+	std::shared_ptr<std::vector<uint8_t>> data;
+	bool ok;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		data = EvictChunks(sect.disk_length);
+		m_cache_used += sect.disk_length;
+	}
+
+	if (!data)
+		data = std::make_shared<std::vector<uint8_t>>();
+
+	data->resize(sect.disk_length);
+
+	ok = DecompressChunk(data->data(), sect);
+
+	if (ok)
+		RecordSectionCrc(sect_idx, data->data());
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		m_inflight.erase(sect_idx);
+
+		if (ok)
+		{
+			m_cache_lru.push_front(sect_idx);
+
+			CacheEntry &entry = m_cache[sect_idx];
+			entry.data = data;
+			entry.lru = m_cache_lru.begin();
+		}
+		else
+		{
+			m_cache_used -= sect.disk_length;
+			data.reset();
+		}
+	}
+
+	m_cond.notify_all();
+
+	return data;
+}
+
+void DeviceDMG::ReadAheadChunk(size_t sect_idx)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		auto fl = m_inflight.find(sect_idx);
+
+		// Already claimed by a reader
+		if (fl == m_inflight.end() || fl->second.claimed)
+			return;
+
+		fl->second.claimed = true;
+	}
+
+	LoadChunk(sect_idx);
+}
+
+void DeviceDMG::StopReadAhead()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	// Jobs that have not started find their chunk gone from m_inflight
+	// and return right away.
+	m_inflight.clear();
+	m_cond.wait(lock, [this]() { return m_readahead_pending == 0; });
+}
+
+void DeviceDMG::QueueReadAhead(size_t sect_idx)
+{
+	if (!IsCompressedMethod(m_sections[sect_idx].method))
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		if (m_cache.count(sect_idx) || m_inflight.count(sect_idx))
+			return;
+
+		m_inflight[sect_idx] = InFlight{ false, false };
+		m_readahead_pending++;
+	}
+
+	m_pool->Submit([this, sect_idx]()
+	{
+		ReadAheadChunk(sect_idx);
+
+		// Notify under the lock, Close may destroy m_cond as soon as it
+		// sees the count drop to zero.
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_readahead_pending--;
+		m_cond.notify_all();
+	});
+}
+
+bool DeviceDMG::DecompressChunk(uint8_t *dst, const DmgSection &sect)
+{
+	// Staging buffer for compressed chunk data, one per thread
+	thread_local std::vector<uint8_t> compr_buf;
+	size_t len;
+
+	if (compr_buf.size() < sect.dmg_length)
+		compr_buf.resize(sect.dmg_length);
+
+	if (!m_img.Read(sect.dmg_offset + m_offset, compr_buf.data(), sect.dmg_length))
+		return false;
+
+	switch (sect.method)
+	{
+	case 0x80000004:
+		len = DecompressADC(dst, sect.disk_length, compr_buf.data(), sect.dmg_length);
+		break;
+	case 0x80000005:
+		len = DecompressZLib(dst, sect.disk_length, compr_buf.data(), sect.dmg_length);
+		break;
+	case 0x80000006:
+		len = DecompressBZ2(dst, sect.disk_length, compr_buf.data(), sect.dmg_length);
+		break;
+	case 0x80000007:
+		len = DecompressLZFSE(dst, sect.disk_length, compr_buf.data(), sect.dmg_length);
+		break;
+	default:
+		std::cerr << "DMG: invalid compression method " << sect.method << std::endl;
+		return false;
+	}
+
+	// A short decode would leave stale bytes in dst, which may be a reused
+	// cache buffer or the caller's buffer.
+	if (len != sect.disk_length)
+	{
+		std::cerr << "DMG: chunk at " << sect.dmg_offset << " decompressed to " << len << " instead of " << sect.disk_length << " bytes" << std::endl;
+		return false;
 	}
 
 	return true;
 }
 
+void DeviceDMG::ClearCache()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	m_cache.clear();
+	m_cache_lru.clear();
+	m_cache_used = 0;
+	m_inflight.clear();
+	m_last_chunk = static_cast<size_t>(-1);
+}
+
+bool DeviceDMG::ProcessHeaderXML(uint64_t off, uint64_t size)
+{
+	std::vector<char> xmldata;
+	const char *xml;
+
+	xml = reinterpret_cast<const char *>(m_img.GetMapping(off, size));
+
+	if (!xml)
+	{
+		xmldata.resize(size, 0);
+
+		if (!m_img.Read(off, xmldata.data(), size))
+			return false;
+
+		xml = xmldata.data();
+	}
+
+	DmgBlkxHandler handler([this](const uint8_t *data, size_t size) { ProcessMish(data, size); });
+	PListXmlReader reader(xml, size);
+
+	if (!reader.Parse(handler))
+		return false;
+
+	return handler.GetBlkxCount() != 0;
+}
+
 bool DeviceDMG::ProcessHeaderRsrc(uint64_t off, uint64_t size)
 {
 	return false;
 }
 
-void DeviceDMG::ProcessMish(const uint8_t * data, size_t size)
+bool DeviceDMG::LoadIndex(const std::string &path, uint32_t koly_crc)
+{
+	static_assert(sizeof(DmgSection) == 0x28, "Wrong DMG Section Size");
+
+	std::ifstream idx(path, std::ios::binary);
+	DmgIndexHeader hdr;
+	size_t k;
+
+	if (!idx.is_open())
+		return false;
+
+	idx.read(reinterpret_cast<char *>(&hdr), sizeof(hdr));
+
+	if (!idx || memcmp(hdr.signature, dmg_index_signature, sizeof(hdr.signature)))
+		return false;
+
+	if (hdr.byte_order != dmg_index_byte_order || hdr.entry_size != sizeof(DmgSection))
+		return false;
+
+	// Stale index: the image has been replaced or modified
+	if (hdr.image_size != m_img.GetFileSize() || hdr.image_mtime != m_img.GetModTime() || hdr.koly_crc != koly_crc)
+		return false;
+
+	// Every section comes from a 0x28 byte mish entry in the image
+	if (hdr.entry_count > m_img.GetFileSize() / sizeof(MishEntry))
+		return false;
+
+	m_sections.resize(hdr.entry_count);
+	idx.read(reinterpret_cast<char *>(m_sections.data()), m_sections.size() * sizeof(DmgSection));
+
+	if (!idx || m_crc.GetDataCRC(reinterpret_cast<const uint8_t *>(m_sections.data()), m_sections.size() * sizeof(DmgSection), 0xFFFFFFFF, 0xFFFFFFFF) != hdr.entries_crc)
+	{
+		m_sections.clear();
+		return false;
+	}
+
+	for (k = 0; k < m_sections.size(); k++)
+	{
+		if (m_sections[k].disk_offset + m_sections[k].disk_length > m_size)
+		{
+			m_sections.clear();
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void DeviceDMG::SaveIndex(const std::string &path, uint32_t koly_crc)
 {
-	(void)size;
+	std::string tmp_path = path + ".tmp";
+	std::ofstream idx(tmp_path, std::ios::binary | std::ios::trunc);
+	DmgIndexHeader hdr;
+
+	if (!idx.is_open())
+	{
+		if (g_debug & Dbg_Info)
+			std::cerr << "DMG: unable to create index " << tmp_path << std::endl;
+		return;
+	}
+
+	memcpy(hdr.signature, dmg_index_signature, sizeof(hdr.signature));
+	hdr.byte_order = dmg_index_byte_order;
+	hdr.entry_size = sizeof(DmgSection);
+	hdr.image_size = m_img.GetFileSize();
+	hdr.image_mtime = m_img.GetModTime();
+	hdr.koly_crc = koly_crc;
+	hdr.entries_crc = m_crc.GetDataCRC(reinterpret_cast<const uint8_t *>(m_sections.data()), m_sections.size() * sizeof(DmgSection), 0xFFFFFFFF, 0xFFFFFFFF);
+	hdr.entry_count = m_sections.size();
+
+	idx.write(reinterpret_cast<const char *>(&hdr), sizeof(hdr));
+	idx.write(reinterpret_cast<const char *>(m_sections.data()), m_sections.size() * sizeof(DmgSection));
+	idx.close();
+
+	if (!idx)
+	{
+		std::remove(tmp_path.c_str());
+		return;
+	}
+
+	// Written to a temporary file first, so that a reader never sees a partial index.
+#ifdef _WIN32
+	std::remove(path.c_str());
+#endif
+	if (std::rename(tmp_path.c_str(), path.c_str()) != 0)
+	{
+		std::remove(tmp_path.c_str());
+		if (g_debug & Dbg_Info)
+			std::cerr << "DMG: unable to write index " << path << std::endl;
+	}
+}
 
+void DeviceDMG::ProcessMish(const uint8_t * data, size_t size)
+{
 	const MishHeader *mish = reinterpret_cast<const MishHeader *>(data);
 	const MishEntry *entry = reinterpret_cast<const MishEntry *>(data + 0xCC);
 	DmgSection section;
@@ -478,7 +1236,7 @@ void DeviceDMG::ProcessMish(const uint8_t * data, size_t size)
 	uint32_t cnt;
 	uint32_t k;
 
-	if (memcmp(mish->signature, "mish", 4))
+	if (size < sizeof(MishHeader) || memcmp(mish->signature, "mish", 4))
 		return;
 
 #ifdef DMG_DEBUG
@@ -496,8 +1254,17 @@ void DeviceDMG::ProcessMish(const uint8_t * data, size_t size)
 
 	partition_start = mish->sector_start;
 
+	DmgPartition part;
+
+	part.first_section = m_sections.size();
+	part.checksum_type = mish->checksum_type;
+	part.checksum = mish->checksum_data;
+
 	cnt = mish->entry_count;
 
+	if (cnt > (size - sizeof(MishHeader)) / sizeof(MishEntry))
+		cnt = static_cast<uint32_t>((size - sizeof(MishHeader)) / sizeof(MishEntry));
+
 	for (k = 0; k < cnt; k++)
 	{
 #ifdef DMG_DEBUG
@@ -515,12 +1282,14 @@ void DeviceDMG::ProcessMish(const uint8_t * data, size_t size)
 		section.disk_length = entry[k].sector_count * 0x200;
 		section.dmg_offset = entry[k].dmg_offset + mish->dmg_offset;
 		section.dmg_length = entry[k].dmg_length;
-		section.cache = nullptr;
 
 		if (section.method != 0xFFFFFFFF && section.method != 0x7FFFFFFE)
 			m_sections.push_back(section);
 	}
 
+	part.section_count = m_sections.size() - part.first_section;
+	m_partitions.push_back(part);
+
 #ifdef DMG_DEBUG
 	m_dbg << std::endl;
 #endif
@@ -19,25 +19,29 @@ along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
 
 #pragma once
 
+#include <condition_variable>
 #include <cstdint>
 #include <fstream>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "Device.h"
 #include "DiskImageFile.h"
 
 #include "Crc32.h"
+#include "ThreadPool.h"
 
 #undef DMG_DEBUG
-#define DMG_CACHE
 
 class DeviceDMG : public Device
 {
 	struct DmgSection
 	{
 		DmgSection();
-		~DmgSection();
 
 		uint32_t method;
 		uint32_t comment;
@@ -45,7 +49,30 @@ class DeviceDMG : public Device
 		uint64_t disk_length;
 		uint64_t dmg_offset;
 		uint64_t dmg_length;
-		uint8_t *cache;
+	};
+
+	// One mish block, with the checksum over its decoded data
+	struct DmgPartition
+	{
+		size_t first_section;
+		size_t section_count;
+		uint32_t checksum_type;
+		uint32_t checksum;
+	};
+
+	struct CacheEntry
+	{
+		std::shared_ptr<std::vector<uint8_t>> data;
+		std::list<size_t>::iterator lru;
+	};
+
+	struct InFlight
+	{
+		// A thread has started decompressing the chunk
+		bool claimed;
+		// Another reader waits for it. Set for chunks that are decoded
+		// straight into a caller's buffer, so that they get cached too.
+		bool wanted;
 	};
 
 public:
@@ -58,12 +85,55 @@ public:
 	bool Read(void *data, uint64_t offs, uint64_t len) override;
 	uint64_t GetSize() const override;
 
+	void Prefetch(uint64_t offs, uint64_t len) override;
+	void GetAllocation(uint64_t offs, uint64_t &len, bool &is_hole) override;
+
+	// Section level access, for converting the whole image. Sections are
+	// sorted by offset; an image that is not UDIF has none.
+	size_t GetSectionCount() const { return m_sections.size(); }
+	void GetSectionExtent(size_t idx, uint64_t &offs, uint64_t &len) const;
+	bool IsZeroSection(size_t idx) const;
+	// Decodes a whole section into dst, bypassing the chunk cache. May be
+	// called from several threads at once. In verify mode (g_dmg_verify),
+	// this also records the checksum of the section.
+	bool ReadSection(size_t idx, uint8_t *dst);
+
+	// Verify mode: checks the data fork and mish checksums. CheckChecksums
+	// decodes whatever ReadSection has not seen yet, so on its own it
+	// verifies the whole image.
+	bool IsVerifying() const { return m_verify; }
+	bool CheckChecksums(ThreadPool &pool);
+	// Checks only the partitions whose compressed sections have all been
+	// decoded by earlier reads, so nothing is decompressed again. The
+	// others are counted in unchecked.
+	bool CheckReadChecksums(size_t &unchecked);
+
 private:
 	bool ProcessHeaderXML(uint64_t off, uint64_t size);
 	bool ProcessHeaderRsrc(uint64_t off, uint64_t size);
 
 	void ProcessMish(const uint8_t *data, size_t size);
 
+	bool CheckDataFork(ThreadPool &pool);
+	void RecordSectionCrc(size_t idx, const uint8_t *data);
+	bool GetPartitionCrc(const DmgPartition &part, uint32_t &crc) const;
+
+	bool LoadIndex(const std::string &path, uint32_t koly_crc);
+	void SaveIndex(const std::string &path, uint32_t koly_crc);
+
+	size_t FindSection(uint64_t offs) const;
+
+	std::shared_ptr<std::vector<uint8_t>> GetChunk(size_t sect_idx);
+	std::shared_ptr<std::vector<uint8_t>> LoadChunk(size_t sect_idx);
+	std::shared_ptr<std::vector<uint8_t>> EvictChunks(uint64_t size);
+	bool ReadChunkDirect(size_t sect_idx, uint8_t *dst);
+	void ReadAheadChunk(size_t sect_idx);
+	void QueueReadAhead(size_t sect_idx);
+	// Cancels the queued read ahead jobs and waits for the running ones.
+	void StopReadAhead();
+	bool DecompressChunk(uint8_t *dst, const DmgSection &sect);
+	void ClearCache();
+
 	DiskImageFile m_img;
 	uint64_t m_size;
 	uint64_t m_offset;
@@ -73,13 +143,40 @@ private:
 	Crc32 m_crc;
 
 	std::vector<DmgSection> m_sections;
+	std::vector<DmgPartition> m_partitions;
+
+	bool m_verify;
+	uint32_t m_data_fork_checksum_type;
+	uint32_t m_data_fork_checksum;
+	uint64_t m_data_fork_length;
+	// CRC32 of each decoded section, valid if m_section_crc_valid is set
+	std::vector<uint32_t> m_section_crc;
+	std::vector<uint8_t> m_section_crc_valid;
 
 #ifdef DMG_DEBUG
 	std::ofstream m_dbg;
 #endif
-#ifdef DMG_CACHE
-	uint64_t m_cache_base;
-	uint64_t m_cache_size;
-	uint8_t *m_cache_data;
-#endif
+
+	// Decompressed chunks, keyed by index into m_sections. Most recently
+	// used entries are at the front of m_cache_lru. m_cache_used also
+	// counts the chunks that are currently being decompressed.
+	std::unordered_map<size_t, CacheEntry> m_cache;
+	std::list<size_t> m_cache_lru;
+	uint64_t m_cache_used;
+	uint64_t m_cache_limit;
+
+	// Chunks queued for or in decompression. Queued chunks that are not
+	// claimed yet may still be taken over by a reader that needs them
+	// right away.
+	std::unordered_map<size_t, InFlight> m_inflight;
+	size_t m_last_chunk;
+	unsigned int m_readahead;
+
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+
+	// Runs the read ahead, m_readahead_pending counts the jobs that have
+	// been submitted and not finished yet.
+	ThreadPool *m_pool;
+	size_t m_readahead_pending;
 };
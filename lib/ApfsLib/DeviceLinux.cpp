@@ -21,6 +21,7 @@ along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/fcntl.h>
 #include <linux/fs.h>
@@ -36,6 +37,7 @@ DeviceLinux::DeviceLinux()
 {
 	m_device = -1;
 	m_size = 0;
+	m_map = nullptr;
 }
 
 DeviceLinux::~DeviceLinux()
@@ -67,6 +69,16 @@ bool DeviceLinux::Open(const char* name)
 		ioctl(m_device, BLKGETSIZE64, &m_size);
 	}
 
+	if (g_image_mmap && S_ISREG(st.st_mode) && m_size > 0 && m_size <= SIZE_MAX)
+	{
+		void *map = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, m_device, 0);
+
+		if (map != MAP_FAILED)
+			m_map = reinterpret_cast<const uint8_t *>(map);
+		else if (g_debug & Dbg_Info)
+			std::cout << "Mapping " << name << " failed, using regular reads." << std::endl;
+	}
+
 	if (g_debug & Dbg_Info)
 		std::cout << "Device " << name << " opened. Size is " << m_size << std::endl;
 
@@ -75,6 +87,9 @@ bool DeviceLinux::Open(const char* name)
 
 void DeviceLinux::Close()
 {
+	if (m_map)
+		munmap(const_cast<uint8_t *>(m_map), m_size);
+	m_map = nullptr;
 	if (m_device != -1)
 		close(m_device);
 	m_device = -1;
@@ -85,10 +100,27 @@ bool DeviceLinux::Read(void* data, uint64_t offs, uint64_t len)
 {
 	size_t nread;
 
+	if (m_map)
+	{
+		if (offs > m_size || len > m_size - offs)
+			return false;
+
+		memcpy(data, m_map + offs, len);
+		return true;
+	}
+
 	nread = pread64(m_device, data, len, offs);
 
 	// TODO: Better error handling ...
 	return nread == len;
 }
 
+const uint8_t *DeviceLinux::GetMapping(uint64_t offs, uint64_t len)
+{
+	if (!m_map || offs > m_size || len > m_size - offs)
+		return nullptr;
+
+	return m_map + offs;
+}
+
 #endif
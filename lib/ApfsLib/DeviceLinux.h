@@ -34,12 +34,15 @@ public:
 	void Close() override;
 
 	bool Read(void *data, uint64_t offs, uint64_t len) override;
+	const uint8_t *GetMapping(uint64_t offs, uint64_t len) override;
 
 	uint64_t GetSize() const override { return m_size; }
 
 private:
 	int m_device;
 	uint64_t m_size;
+	// Image files are mapped if g_image_mmap is set
+	const uint8_t *m_map;
 };
 
 #endif
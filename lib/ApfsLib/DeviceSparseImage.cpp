@@ -182,6 +182,49 @@ bool DeviceSparseImage::Read(void * data, uint64_t offs, uint64_t len)
 	return true;
 }
 
+const uint8_t *DeviceSparseImage::GetMapping(uint64_t offs, uint64_t len)
+{
+	uint64_t band_offs;
+
+	if (offs >= m_size || m_band_size == 0)
+		return nullptr;
+
+	// Only ranges inside one stored band are contiguous in the image file.
+	band_offs = offs % m_band_size;
+	if (len > m_band_size - band_offs || m_band_offset[offs / m_band_size] == 0)
+		return nullptr;
+
+	return m_img.GetMapping(m_band_offset[offs / m_band_size] + band_offs, len);
+}
+
+void DeviceSparseImage::GetAllocation(uint64_t offs, uint64_t &len, bool &is_hole)
+{
+	size_t band;
+	uint64_t end;
+
+	len = 0;
+	is_hole = false;
+
+	if (offs >= m_size || m_band_size == 0)
+		return;
+
+	// Bands that were never written are not stored in the image.
+	band = offs / m_band_size;
+	is_hole = (m_band_offset[band] == 0);
+
+	for (band++; band < m_band_offset.size(); band++)
+	{
+		if ((m_band_offset[band] == 0) != is_hole)
+			break;
+	}
+
+	end = band * m_band_size;
+	if (end > m_size)
+		end = m_size;
+
+	len = end - offs;
+}
+
 uint64_t DeviceSparseImage::GetSize() const
 {
 	return m_size;
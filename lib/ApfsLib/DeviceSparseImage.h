@@ -15,8 +15,11 @@ public:
 	void Close() override;
 
 	bool Read(void *data, uint64_t offs, uint64_t len) override;
+	const uint8_t *GetMapping(uint64_t offs, uint64_t len) override;
 	uint64_t GetSize() const override;
 
+	void GetAllocation(uint64_t offs, uint64_t &len, bool &is_hole) override;
+
 private:
 	std::vector<uint64_t> m_band_offset;
 	uint64_t m_size;
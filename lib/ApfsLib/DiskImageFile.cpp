@@ -1,8 +1,19 @@
+#include <algorithm>
+#include <cerrno>
 #include <cstring>
 
 #include <vector>
 #include <iostream>
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #include "Global.h"
 #include "Endian.h"
 #include "Crypto.h"
@@ -96,29 +107,129 @@ struct DmgKeyData
 
 #pragma pack(pop)
 
+bool g_image_mmap = false;
+
 DiskImageFile::DiskImageFile()
 {
+#ifdef _WIN32
+	m_file = INVALID_HANDLE_VALUE;
+	m_mapping = nullptr;
+#else
+	m_fd = -1;
+#endif
+	m_file_size = 0;
+	m_mtime = 0;
+	m_map = nullptr;
+
 	m_is_encrypted = false;
 
 	m_crypt_offset = 0;
 	m_crypt_size = 0;
 	m_crypt_blocksize = 0;
+	m_pool = nullptr;
 }
 
 DiskImageFile::~DiskImageFile()
 {
+	Close();
 }
 
 bool DiskImageFile::Open(const char * name)
 {
-	m_image.open(name, std::ios::binary);
+#ifdef _WIN32
+	LARGE_INTEGER size;
+	FILETIME mtime;
+
+	m_file = CreateFileA(name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (m_file == INVALID_HANDLE_VALUE)
+		return false;
+
+	if (!GetFileSizeEx(m_file, &size) || !GetFileTime(m_file, NULL, NULL, &mtime))
+	{
+		Close();
+		return false;
+	}
+
+	m_file_size = size.QuadPart;
+	m_mtime = (static_cast<int64_t>(mtime.dwHighDateTime) << 32) | mtime.dwLowDateTime;
+#else
+	struct stat st;
+
+	m_fd = open(name, O_RDONLY);
+
+	if (m_fd == -1)
+		return false;
+
+	if (fstat(m_fd, &st) != 0)
+	{
+		Close();
+		return false;
+	}
+
+	m_file_size = st.st_size;
+	m_mtime = st.st_mtime;
+#endif
+
+	if (g_image_mmap && !MapImage())
+	{
+		if (g_debug & Dbg_Info)
+			std::cerr << "Mapping image " << name << " failed, using regular reads." << std::endl;
+	}
+
+	return true;
+}
+
+bool DiskImageFile::MapImage()
+{
+	if (m_file_size == 0 || m_file_size > SIZE_MAX)
+		return false;
+
+#ifdef _WIN32
+	m_mapping = CreateFileMappingA(m_file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (m_mapping == nullptr)
+		return false;
 
-	return m_image.is_open();
+	m_map = reinterpret_cast<const uint8_t *>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+	if (m_map == nullptr)
+	{
+		CloseHandle(m_mapping);
+		m_mapping = nullptr;
+		return false;
+	}
+#else
+	void *map = mmap(nullptr, m_file_size, PROT_READ, MAP_SHARED, m_fd, 0);
+
+	if (map == MAP_FAILED)
+		return false;
+
+	m_map = reinterpret_cast<const uint8_t *>(map);
+#endif
+
+	return true;
 }
 
 void DiskImageFile::Close()
 {
-	m_image.close();
+#ifdef _WIN32
+	if (m_map)
+		UnmapViewOfFile(m_map);
+	if (m_mapping)
+		CloseHandle(m_mapping);
+	if (m_file != INVALID_HANDLE_VALUE)
+		CloseHandle(m_file);
+	m_mapping = nullptr;
+	m_file = INVALID_HANDLE_VALUE;
+#else
+	if (m_map)
+		munmap(const_cast<uint8_t *>(m_map), m_file_size);
+	if (m_fd != -1)
+		close(m_fd);
+	m_fd = -1;
+#endif
+	m_map = nullptr;
+	m_file_size = 0;
+	m_mtime = 0;
 
 	m_crypt_blocksize = 0;
 	m_crypt_size = 0;
@@ -131,22 +242,23 @@ void DiskImageFile::Reset()
 	m_crypt_offset = 0;
 	m_crypt_size = 0;
 	m_crypt_blocksize = 0;
-	memset(m_hmac_key, 0, sizeof(m_hmac_key));
+	m_hmac = HmacSha1();
 	m_aes.CleanUp();
+	m_pool = nullptr;
 }
 
 bool DiskImageFile::CheckSetupEncryption()
 {
 	char signature[8];
 
-	m_image.seekg(0, std::ios::end);
-
 	m_is_encrypted = false;
 	m_crypt_offset = 0;
-	m_crypt_size = m_image.tellg();
+	m_crypt_size = m_file_size;
+
+	if (m_file_size < 8)
+		return true;
 
-	m_image.seekg(-8, std::ios::end);
-	m_image.read(signature, 8);
+	ReadRaw(m_file_size - 8, signature, 8);
 
 	if (!memcmp(signature, "cdsaencr", 8))
 	{
@@ -154,14 +266,13 @@ bool DiskImageFile::CheckSetupEncryption()
 
 		if (!SetupEncryptionV1())
 		{
-			m_image.close();
+			Close();
 			fprintf(stderr, "Error setting up decryption V1.\n");
 			return false;
 		}
 	}
 
-	m_image.seekg(0);
-	m_image.read(signature, 8);
+	ReadRaw(0, signature, 8);
 
 	if (!memcmp(signature, "encrcdsa", 8))
 	{
@@ -169,79 +280,152 @@ bool DiskImageFile::CheckSetupEncryption()
 
 		if (!SetupEncryptionV2())
 		{
-			m_image.close();
+			Close();
 			fprintf(stderr, "Error setting up decryption V2.\n");
 			return false;
 		}
 	}
 
+	if (m_is_encrypted && g_threads != 1)
+		m_pool = &ThreadPool::Get();
+
 	return true;
 }
 
-void DiskImageFile::Read(uint64_t off, void * data, size_t size)
+bool DiskImageFile::Read(uint64_t off, void * data, size_t size)
 {
 	if (!m_is_encrypted)
+		return ReadRaw(off, data, size);
+
+	// Scratch space for reads that don't cover whole crypto blocks
+	static thread_local std::vector<uint8_t> scratch;
+
+	uint64_t mask = m_crypt_blocksize - 1;
+	uint64_t blk_start;
+	uint64_t blk_end;
+	size_t cnt;
+	uint8_t *buffer;
+
+	if (m_crypt_blocksize < 0x10 || (m_crypt_blocksize & mask) != 0)
+		return false;
+
+	if (size == 0)
+		return true;
+
+	blk_start = off & ~mask;
+	blk_end = (off + size + mask) & ~mask;
+	cnt = static_cast<size_t>((blk_end - blk_start) / m_crypt_blocksize);
+
+	// Aligned reads are decrypted in place, everything else goes through
+	// the scratch buffer. Either way, the whole range is a single read.
+	if (blk_start == off && blk_end == off + size)
+		buffer = reinterpret_cast<uint8_t *>(data);
+	else
 	{
-		m_image.seekg(off);
-		m_image.read(reinterpret_cast<char *>(data), size);
+		scratch.resize(cnt * m_crypt_blocksize);
+		buffer = scratch.data();
 	}
-	else
+
+	if (!ReadRaw(m_crypt_offset + blk_start, buffer, cnt * m_crypt_blocksize))
+		return false;
+
+	DecryptBlocks(buffer, blk_start / m_crypt_blocksize, cnt);
+
+	if (buffer != data)
+		memcpy(data, buffer + (off & mask), size);
+
+	return true;
+}
+
+void DiskImageFile::DecryptBlocks(uint8_t *data, uint64_t blkid, size_t cnt) const
+{
+	// Large reads are decrypted in pieces of this many bytes on the thread pool
+	static constexpr size_t parallel_piece_size = 0x40000;
+
+	size_t piece_blocks = parallel_piece_size / m_crypt_blocksize;
+
+	auto decrypt = [this, data, blkid](size_t first, size_t end)
 	{
-		uint8_t buffer[0x1000];
-		uint64_t mask = m_crypt_blocksize - 1;
-		uint32_t blkid;
 		uint8_t iv[0x14];
-		size_t rd_len;
-		uint8_t *bdata = reinterpret_cast<uint8_t *>(data);
+		uint32_t id;
+		size_t k;
 
-		if (off & mask)
+		for (k = first; k < end; k++)
 		{
-			blkid = static_cast<uint32_t>(off / m_crypt_blocksize);
-			blkid = bswap_be(blkid);
+			id = bswap_be(static_cast<uint32_t>(blkid + k));
+			m_hmac.Compute(reinterpret_cast<const uint8_t *>(&id), sizeof(uint32_t), iv);
+
+			// Explicit IV, so concurrent readers don't step on each other
+			m_aes.DecryptCBC(data + k * m_crypt_blocksize, data + k * m_crypt_blocksize, m_crypt_blocksize, iv);
+		}
+	};
 
-			m_image.seekg(m_crypt_offset + (off & ~mask));
-			m_image.read(reinterpret_cast<char *>(buffer), m_crypt_blocksize);
+	if (piece_blocks == 0)
+		piece_blocks = 1;
 
-			HMAC_SHA1(m_hmac_key, 0x14, reinterpret_cast<const uint8_t *>(&blkid), sizeof(uint32_t), iv);
+	if (m_pool && cnt >= 2 * piece_blocks)
+	{
+		m_pool->ParallelFor((cnt + piece_blocks - 1) / piece_blocks, [&decrypt, piece_blocks, cnt](size_t idx)
+		{
+			decrypt(idx * piece_blocks, std::min(cnt, (idx + 1) * piece_blocks));
+		});
+	}
+	else
+		decrypt(0, cnt);
+}
 
-			m_aes.SetIV(iv);
-			m_aes.DecryptCBC(buffer, buffer, m_crypt_blocksize);
+const uint8_t *DiskImageFile::GetMapping(uint64_t off, size_t size) const
+{
+	if (!m_map || m_is_encrypted)
+		return nullptr;
 
-			rd_len = m_crypt_blocksize - (off & mask);
-			if (rd_len > size)
-				rd_len = size;
+	if (off > m_file_size || size > m_file_size - off)
+		return nullptr;
 
-			memcpy(bdata, buffer + (off & mask), rd_len);
+	return m_map + off;
+}
 
-			bdata += rd_len;
-			off += rd_len;
-			size -= rd_len;
-		}
+bool DiskImageFile::ReadRaw(uint64_t off, void *data, size_t size)
+{
+	uint8_t *bdata = reinterpret_cast<uint8_t *>(data);
 
-		while (size > 0)
-		{
-			blkid = static_cast<uint32_t>(off / m_crypt_blocksize);
-			blkid = bswap_be(blkid);
+	if (m_map)
+	{
+		if (off > m_file_size || size > m_file_size - off)
+			return false;
 
-			m_image.seekg(m_crypt_offset + (off & ~mask));
-			m_image.read(reinterpret_cast<char *>(buffer), m_crypt_blocksize);
+		memcpy(bdata, m_map + off, size);
+		return true;
+	}
 
-			HMAC_SHA1(m_hmac_key, 0x14, reinterpret_cast<const uint8_t *>(&blkid), sizeof(uint32_t), iv);
+	while (size > 0)
+	{
+#ifdef _WIN32
+		OVERLAPPED ov;
+		DWORD rd_len = size > 0x40000000 ? 0x40000000 : static_cast<DWORD>(size);
+		DWORD nread = 0;
 
-			m_aes.SetIV(iv);
-			m_aes.DecryptCBC(buffer, buffer, m_crypt_blocksize);
+		memset(&ov, 0, sizeof(ov));
+		ov.Offset = static_cast<DWORD>(off);
+		ov.OffsetHigh = static_cast<DWORD>(off >> 32);
 
-			rd_len = m_crypt_blocksize;
-			if (rd_len > size)
-				rd_len = size;
+		if (!ReadFile(m_file, bdata, rd_len, &nread, &ov) || nread == 0)
+			return false;
+#else
+		ssize_t nread = pread(m_fd, bdata, size, off);
 
-			memcpy(bdata, buffer, rd_len);
+		if (nread < 0 && errno == EINTR)
+			continue;
+		if (nread <= 0)
+			return false;
+#endif
 
-			bdata += rd_len;
-			off += rd_len;
-			size -= rd_len;
-		}
+		bdata += nread;
+		off += nread;
+		size -= nread;
 	}
+
+	return true;
 }
 
 bool DiskImageFile::SetupEncryptionV1()
@@ -262,11 +446,11 @@ bool DiskImageFile::SetupEncryptionV1()
 	uint8_t tmp_3[0x100];
 	size_t len;
 
-	int64_t hdrsize = sizeof(DmgCryptHeaderV1);
+	if (m_file_size < sizeof(DmgCryptHeaderV1))
+		return false;
 
-	m_image.seekg(-hdrsize, std::ios::end);
-	total_size = m_image.tellg();
-	m_image.read(reinterpret_cast<char *>(&hdr), sizeof(hdr));
+	total_size = m_file_size - sizeof(DmgCryptHeaderV1);
+	ReadRaw(total_size, &hdr, sizeof(hdr));
 
 	if (g_debug & Dbg_Crypto)
 	{
@@ -374,7 +558,7 @@ bool DiskImageFile::SetupEncryptionV1()
 	len = PkcsUnpad(tmp_3, len);
 
 	// memcpy(hmac_key, tmp_3 + 12, 0x14);
-	memcpy(m_hmac_key, tmp_3 + 12, 0x14);
+	m_hmac.SetKey(tmp_3 + 12, 0x14);
 
 	if (g_debug & Dbg_Crypto)
 		std::cout << "Integrity Key:" << std::endl;
@@ -436,8 +620,7 @@ bool DiskImageFile::SetupEncryptionV2()
 
 	data.resize(0x1000);
 
-	m_image.seekg(0);
-	m_image.read(reinterpret_cast<char *>(data.data()), data.size());
+	ReadRaw(0, data.data(), data.size());
 
 	hdr = reinterpret_cast<const DmgCryptHeaderV2 *>(data.data());
 
@@ -459,8 +642,7 @@ bool DiskImageFile::SetupEncryptionV2()
 		keyptr = reinterpret_cast<const DmgKeyPointer *>(data.data() + sizeof(DmgCryptHeaderV2) + key_id * sizeof(DmgKeyPointer));
 
 		kdata.resize(keyptr->key_length);
-		m_image.seekg(keyptr->key_offset.get());
-		m_image.read(reinterpret_cast<char *>(kdata.data()), kdata.size());
+		ReadRaw(keyptr->key_offset.get(), kdata.data(), kdata.size());
 
 		keydata = reinterpret_cast<const DmgKeyData *>(kdata.data());
 
@@ -494,14 +676,14 @@ bool DiskImageFile::SetupEncryptionV2()
 		if (hdr->key_bits == 128)
 		{
 			m_aes.SetKey(blob, AES::AES_128);
-			memcpy(m_hmac_key, blob + 0x10, 0x14);
+			m_hmac.SetKey(blob + 0x10, 0x14);
 			key_ok = true;
 			break;
 		}
 		else if (hdr->key_bits == 256)
 		{
 			m_aes.SetKey(blob, AES::AES_256);
-			memcpy(m_hmac_key, blob + 0x20, 0x14);
+			m_hmac.SetKey(blob + 0x20, 0x14);
 			key_ok = true;
 			break;
 		}
@@ -1,11 +1,18 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
-#include <fstream>
+
+#include <memory>
 
 #include "Aes.h"
+#include "Crypto.h"
 #include "Device.h"
+#include "ThreadPool.h"
 
+// Image file access for the DMG / sparse image devices. Reads are positional
+// (pread / overlapped ReadFile, or memcpy out of a mapping if g_image_mmap is
+// set), so Read may be called from several threads at once.
 class DiskImageFile
 {
 public:
@@ -16,24 +23,44 @@ public:
 	void Close();
 	void Reset();
 
-	void Read(uint64_t off, void *data, size_t size);
+	bool Read(uint64_t off, void *data, size_t size);
+	// Direct pointer into the mapped image, or nullptr if the image is not
+	// mapped or encrypted.
+	const uint8_t *GetMapping(uint64_t off, size_t size) const;
 
 	uint64_t GetContentSize() const { return m_crypt_size; }
+	uint64_t GetFileSize() const { return m_file_size; }
+	int64_t GetModTime() const { return m_mtime; }
+	bool IsEncrypted() const { return m_is_encrypted; }
 
 	bool CheckSetupEncryption();
 
 private:
+	bool ReadRaw(uint64_t off, void *data, size_t size);
+	bool MapImage();
+
 	bool SetupEncryptionV1();
 	bool SetupEncryptionV2();
 	size_t PkcsUnpad(const uint8_t *data, size_t size);
+	void DecryptBlocks(uint8_t *data, uint64_t blkid, size_t cnt) const;
 
-	std::ifstream m_image;
+#ifdef _WIN32
+	void *m_file;
+	void *m_mapping;
+#else
+	int m_fd;
+#endif
+	uint64_t m_file_size;
+	int64_t m_mtime;
+	const uint8_t *m_map;
 
 	bool m_is_encrypted;
 	uint64_t m_crypt_offset;
 	uint64_t m_crypt_size;
 	uint32_t m_crypt_blocksize;
-	uint8_t m_hmac_key[0x14];
+	HmacSha1 m_hmac;
 
 	AES m_aes;
+	// Decrypts large reads in parallel, only created for encrypted images
+	ThreadPool *m_pool;
 };
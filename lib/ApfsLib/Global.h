@@ -25,6 +25,24 @@
 extern int g_debug;
 // Lax mode - defined in ApfsContainer.cpp
 extern bool g_lax;
+// Map disk images into memory instead of reading them - defined in DiskImageFile.cpp
+extern bool g_image_mmap;
+// Size of the decompressed DMG chunk cache in bytes - defined in DeviceDMG.cpp
+extern uint64_t g_dmg_cache_size;
+// Number of DMG chunks to decompress ahead of the reader - defined in DeviceDMG.cpp
+extern unsigned int g_dmg_readahead;
+// Keep the parsed DMG block table in a sidecar file next to the image - defined in DeviceDMG.cpp
+extern bool g_dmg_index;
+// Verify the DMG checksums while decoding - defined in DeviceDMG.cpp
+extern bool g_dmg_verify;
+// Byte budget of the shared B-tree node cache - defined in BTreeNodeCache.cpp
+extern uint64_t g_btree_cache_size;
+// Number of leaf nodes B-tree iterators load ahead, 0 = off - defined in BTree.cpp
+extern unsigned int g_btree_readahead;
+// Read the volume object maps into a flat array at mount - defined in ApfsNodeMapperBTree.cpp
+extern bool g_omap_preload;
+// Number of worker threads of the shared ThreadPool, 0 = one per CPU - defined in ThreadPool.cpp
+extern unsigned int g_threads;
 
 enum DbgFlags
 {
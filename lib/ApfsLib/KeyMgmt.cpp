@@ -774,9 +774,14 @@ bool KeyManager::LoadKeybag(Keybag& bag, uint32_t type, uint64_t block, uint64_t
 
 	data.resize(blockcnt * blocksize);
 
-	m_container.ReadBlocks(data.data(), block, blockcnt);
+	if (!m_container.ReadBlocks(data.data(), block, blockcnt))
+		return false;
 
-	DecryptBlocks(data.data(), block, blockcnt, uuid);
+	if (!DecryptBlocks(data.data(), block, blockcnt, uuid))
+	{
+		std::cerr << "ERROR: LoadKeybag: cannot decrypt keybag at " << block << std::endl;
+		return false;
+	}
 
 	for (k = 0; k < blockcnt; k++)
 	{
@@ -805,10 +810,9 @@ bool KeyManager::LoadKeybag(Keybag& bag, uint32_t type, uint64_t block, uint64_t
 	return true;
 }
 
-void KeyManager::DecryptBlocks(uint8_t* data, uint64_t block, uint64_t cnt, const uint8_t* key)
+bool KeyManager::DecryptBlocks(uint8_t* data, uint64_t block, uint64_t cnt, const uint8_t* key)
 {
 	AesXts xts;
-	size_t k;
 	size_t size;
 	uint64_t uno;
 	uint64_t cs_factor = m_container.GetBlocksize() / 0x200;
@@ -818,11 +822,7 @@ void KeyManager::DecryptBlocks(uint8_t* data, uint64_t block, uint64_t cnt, cons
 	uno = block * cs_factor;
 	size = m_container.GetBlocksize() * cnt;
 
-	for (k = 0; k < size; k += 0x200)
-	{
-		xts.Decrypt(data + k, data + k, 0x200, uno);
-		uno++;
-	}
+	return xts.DecryptUnits(data, data, size, 0x200, uno);
 }
 
 bool KeyManager::VerifyBlob(const bagdata_t & keydata, bagdata_t & contents)
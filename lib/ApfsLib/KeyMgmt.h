@@ -84,7 +84,7 @@ public:
 
 private:
 	bool LoadKeybag(Keybag &bag, uint32_t type, uint64_t block, uint64_t blockcnt, const apfs_uuid_t &uuid);
-	void DecryptBlocks(uint8_t *data, uint64_t block, uint64_t cnt, const uint8_t *key);
+	bool DecryptBlocks(uint8_t *data, uint64_t block, uint64_t cnt, const uint8_t *key);
 
 	bool VerifyBlob(const bagdata_t &keydata, bagdata_t &contents);
 
@@ -1,476 +1,341 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <string>
 
 #include "PList.h"
 
-PLObject::PLObject()
+namespace
 {
-}
-
-PLObject::~PLObject()
-{
-}
-
-const PLInteger * PLObject::toInt() const
-{
-	return dynamic_cast<const PLInteger *>(this);
-}
-
-const PLString * PLObject::toString() const
-{
-	return dynamic_cast<const PLString *>(this);
-}
-
-const PLData * PLObject::toData() const
-{
-	return dynamic_cast<const PLData *>(this);
-}
-
-const PLArray * PLObject::toArray() const
-{
-	return dynamic_cast<const PLArray *>(this);
-}
-
-const PLDict * PLObject::toDict() const
-{
-	return dynamic_cast<const PLDict *>(this);
-}
-
-PLInteger::PLInteger()
-{
-}
-
-PLInteger::~PLInteger()
-{
-}
-
-PLType PLInteger::type() const
-{
-	return PLType_Integer;
-}
-
-PLString::PLString()
-{
-}
-
-PLString::~PLString()
-{
-}
-
-PLType PLString::type() const
-{
-	return PLType_String;
-}
-
-PLData::PLData()
-{
-}
-
-PLData::~PLData()
-{
-}
-
-PLType PLData::type() const
-{
-	return PLType_Data;
-}
-
-PLArray::PLArray()
-{
-}
-
-PLArray::~PLArray()
-{
-	for (std::vector<PLObject *>::iterator it = m_array.begin(); it != m_array.end(); it++)
-		delete *it;
-	m_array.clear();
-}
-
-PLType PLArray::type() const
-{
-	return PLType_Array;
-}
-
-PLObject * PLArray::get(size_t idx) const
-{
-	if (idx < m_array.size())
-		return m_array[idx];
-	else
-		return nullptr;
-}
-
-PLDict::PLDict()
-{
-}
+	// Decoded value of each base64 character; 0x40 marks the '=' padding,
+	// 0x80 everything that is skipped.
+	struct Base64Table
+	{
+		uint8_t v[256];
 
-PLDict::~PLDict()
-{
-	for (std::map<std::string, PLObject*>::iterator it = m_dict.begin(); it != m_dict.end(); it++)
-		delete it->second;
-	m_dict.clear();
-}
+		constexpr Base64Table() : v()
+		{
+			int k = 0;
 
-PLType PLDict::type() const
-{
-	return PLType_Dict;
-}
+			for (k = 0; k < 256; k++)
+				v[k] = 0x80;
+			for (k = 0; k < 26; k++)
+			{
+				v['A' + k] = k;
+				v['a' + k] = k + 0x1A;
+			}
+			for (k = 0; k < 10; k++)
+				v['0' + k] = k + 0x34;
+			v['+'] = 0x3E;
+			v['/'] = 0x3F;
+			v['='] = 0x40;
+		}
+	};
 
-PLObject * PLDict::get(const char * name) const
-{
-	std::map<std::string, PLObject *>::const_iterator it = m_dict.find(name);
+	constexpr Base64Table base64_table;
 
-	if (it != m_dict.cend())
-		return it->second;
-	else
-		return nullptr;
+	// Maximum nesting of dicts / arrays
+	constexpr int max_plist_depth = 64;
 }
 
-PListXmlParser::PListXmlParser(const char * data, size_t size)
-	:
-	m_data(data),
-	m_size(size)
+PListXmlReader::PListXmlReader(const char *data, size_t size) : m_xml(data, size)
 {
 	m_idx = 0;
 }
 
-PListXmlParser::~PListXmlParser()
+PListXmlReader::~PListXmlReader()
 {
-
 }
 
-PLObject * PListXmlParser::Parse()
+bool PListXmlReader::Parse(PListXmlHandler &handler)
 {
-	std::string name;
-	std::string content;
+	std::string_view name;
 	TagType type;
-	PLObject *root = nullptr;
 
 	while (FindTag(name, type))
 	{
 		if (type == TagType::Start && name == "plist")
 		{
-			try
-			{
-				root = ParseObject();
-			}
-			catch (PLException &ex)
-			{
-				delete root;
-				root = nullptr;
+			if (!FindTag(name, type))
+				return Error("Unexpected end of data.");
 
-				fprintf(stderr, "XML PList parse error: %s\n", ex.what());
-			}
+			if (!ParseValue(handler, name, type, 0))
+				return false;
 
-			break;
+			return ExpectEndTag("plist");
 		}
 	}
 
-	return root;
+	return Error("No <plist> tag found.");
 }
 
-PLArray * PListXmlParser::ParseArray()
+bool PListXmlReader::ParseValue(PListXmlHandler &handler, std::string_view name, TagType type, int depth)
 {
-	PLArray *arr = new PLArray();
-	PLObject *obj;
+	std::string_view content;
 
-	for (;;)
+	if (type == TagType::Empty)
 	{
-		obj = ParseObject();
-
-		if (obj)
-			arr->m_array.push_back(obj);
+		if (name == "true")
+			return handler.Bool(true);
+		else if (name == "false")
+			return handler.Bool(false);
+		else if (name == "dict")
+			return handler.StartDict() && handler.EndDict();
+		else if (name == "array")
+			return handler.StartArray() && handler.EndArray();
+		else if (name == "string")
+			return handler.String(std::string_view());
+		else if (name == "data")
+			return handler.Data(std::string_view());
 		else
-			break;
+			return Error("Unexpected empty tag.");
 	}
 
-	return arr;
-}
+	if (type != TagType::Start)
+		return Error("Expected a start tag.");
 
-PLDict * PListXmlParser::ParseDict()
-{
-	PLDict *dict = new PLDict();
-	PLObject *obj;
+	if (name == "dict" || name == "array")
+	{
+		bool is_dict = (name == "dict");
 
-	TagType tagtype;
-	std::string tagname;
-	std::string key;
+		if (depth >= max_plist_depth)
+			return Error("Nesting too deep.");
 
-	for (;;)
-	{
-		FindTag(tagname, tagtype);
+		if (!(is_dict ? handler.StartDict() : handler.StartArray()))
+			return false;
 
-		if (tagname == "dict" && tagtype == TagType::End)
-			break;
+		for (;;)
+		{
+			if (!FindTag(name, type))
+				return Error("Unexpected end of data.");
 
-		if (tagname != "key" || tagtype != TagType::Start)
-			throw PLException("Invalid tag in dict");
+			if (type == TagType::End)
+			{
+				if (name != (is_dict ? "dict" : "array"))
+					return Error("Mismatched end tag.");
+				break;
+			}
 
-		GetContent(key);
+			if (is_dict)
+			{
+				if (name != "key" || type != TagType::Start)
+					return Error("Invalid tag in dict");
 
-		if (key.empty())
-			throw PLException("Empty key in dict");
+				content = GetContent();
 
-		FindTag(tagname, tagtype);
+				if (content.empty())
+					return Error("Empty key in dict");
 
-		if (tagname != "key" || tagtype != TagType::End)
-			throw PLException("Invalid tag type, expected </key>");
+				if (!ExpectEndTag("key"))
+					return false;
 
-		obj = ParseObject();
+				if (!handler.Key(content))
+					return false;
 
-		if (obj)
-			dict->m_dict[key] = obj;
-	}
+				if (!FindTag(name, type))
+					return Error("Unexpected end of data.");
+			}
 
-	return dict;
-}
+			if (!ParseValue(handler, name, type, depth + 1))
+				return false;
+		}
 
-PLObject * PListXmlParser::ParseObject()
-{
-	std::string name;
-	TagType type;
-	std::string content_str;
-	const char *content_start;
-	size_t content_size;
-	PLObject *robj = nullptr;
+		return is_dict ? handler.EndDict() : handler.EndArray();
+	}
 
-	FindTag(name, type);
+	content = GetContent();
 
-	if (type == TagType::Start)
+	if (!ExpectEndTag(name))
+		return false;
+
+	if (name == "integer")
 	{
-		if (name == "integer")
-		{
-			GetContent(content_str);
-			FindTag(name, type);
-			if (name != "integer" || type != TagType::End)
-				throw PLException("Invalid end tag, expected </integer>.");
-
-			PLInteger *obj = new PLInteger();
-			obj->m_value = strtoll(content_str.c_str(), nullptr, 0);
-			robj = obj;
-		}
-		else if (name == "string")
-		{
-			GetContent(content_str);
-			FindTag(name, type);
-			if (name != "string" || type != TagType::End)
-				throw PLException("Invalid end tag, expected </string>.");
-
-			PLString *obj = new PLString();
-			obj->m_string = content_str;
-			robj = obj;
-		}
-		else if (name == "data")
-		{
-			content_start = m_data + m_idx;
-			content_size = GetContentSize();
+		char buf[32];
+		size_t len = content.size() < sizeof(buf) - 1 ? content.size() : sizeof(buf) - 1;
 
-			FindTag(name, type);
-			if (name != "data" || type != TagType::End)
-				throw PLException("Invalid end tag, expected </data>.");
+		memcpy(buf, content.data(), len);
+		buf[len] = 0;
 
-			PLData *obj = new PLData();
-			Base64Decode(obj->m_data, content_start, content_size);
-			robj = obj;
-		}
-		else if (name == "array")
-		{
-			PLArray *obj = ParseArray();
-			if (!obj)
-				return nullptr;
-			robj = obj;
-		}
-		else if (name == "dict")
-		{
-			PLDict *obj = ParseDict();
-			if (!obj)
-				return nullptr;
-			robj = obj;
-		}
-		else
-		{
-			throw PLException("Unexpected start tag.");
-		}
-	}
-	else if (type == TagType::Empty)
-	{
-		if (name == "true")
-		{
-			PLInteger *obj = new PLInteger();
-			obj->m_value = 1;
-			robj = obj;
-		}
-		else if (name == "false")
-		{
-			PLInteger *obj = new PLInteger();
-			obj->m_value = 0;
-			robj = obj;
-		}
-		else
-		{
-			throw PLException("Unexpected empty tag.");
-		}
-	}
-	else if (type == TagType::End)
-	{
-		return nullptr;
+		return handler.Integer(strtoll(buf, nullptr, 0));
 	}
+	else if (name == "string" || name == "real" || name == "date")
+		return handler.String(content);
+	else if (name == "data")
+		return handler.Data(content);
 
-	return robj;
+	return Error("Unexpected start tag.");
 }
 
-void PListXmlParser::Base64Decode(std::vector<uint8_t>& bin, const char * str, size_t size)
+bool PListXmlReader::ExpectEndTag(std::string_view name)
 {
-	int chcnt;
-	uint32_t buf;
-	size_t ip;
-	char ch;
-	uint32_t dec;
+	std::string_view end_name;
+	TagType type;
 
-	bin.clear();
-	bin.reserve(size * 4 / 3);
+	if (!FindTag(end_name, type) || type != TagType::End || end_name != name)
+		return Error("Invalid or missing end tag.");
 
-	chcnt = 0;
-	buf = 0;
+	return true;
+}
+
+bool PListXmlReader::FindTag(std::string_view &name, TagType &type)
+{
+	const char *data = m_xml.data();
+	const size_t size = m_xml.size();
+	const void *p;
+	size_t start;
 
-	for (ip = 0; ip < size; ip++)
+	for (;;)
 	{
-		ch = str[ip];
-
-		if (ch >= 'A' && ch <= 'Z')
-			dec = ch - 'A';
-		else if (ch >= 'a' && ch <= 'z')
-			dec = ch - 'a' + 0x1A;
-		else if (ch >= '0' && ch <= '9')
-			dec = ch - '0' + 0x34;
-		else if (ch == '+')
-			dec = 0x3E;
-		else if (ch == '/')
-			dec = 0x3F;
-		else if (ch != '=')
-			continue;
-		else
-			break;
+		name = std::string_view();
+		type = TagType::None;
 
-		buf = (buf << 6) | dec;
-		chcnt++;
+		if (m_idx >= size)
+			return false;
 
-		if (chcnt == 2)
-			bin.push_back((buf >> 4) & 0xFF);
-		else if (chcnt == 3)
-			bin.push_back((buf >> 2) & 0xFF);
-		else if (chcnt == 4)
+		p = memchr(data + m_idx, '<', size - m_idx);
+		if (!p)
 		{
-			bin.push_back((buf >> 0) & 0xFF);
-			chcnt = 0;
+			m_idx = size;
+			return false;
 		}
-	}
-}
 
-bool PListXmlParser::FindTag(std::string & name, TagType & type)
-{
-	char ch;
-	bool in_name = false;
-
-	name.clear();
-	type = TagType::None;
+		m_idx = static_cast<const char *>(p) - data + 1;
 
-	do {
-		ch = GetChar();
-	} while (ch != '<' && ch != 0);
+		if (m_idx >= size)
+			return false;
 
-	if (ch == 0)
-		return false;
-
-	ch = GetChar();
+		// Skip comments, they may contain anything but "-->"
+		if (m_xml.compare(m_idx, 3, "!--") == 0)
+		{
+			size_t end = m_xml.find("-->", m_idx + 3);
 
-	switch (ch)
-	{
-	case '?':
-		type = TagType::ProcInstr;
-		break;
-	case '!':
-		type = TagType::Doctype;
-		break;
-	case '/':
-		type = TagType::End;
-		in_name = true;
-		break;
-	default:
-		type = TagType::Start;
-		name.push_back(ch);
-		in_name = true;
-		break;
-	}
+			if (end == std::string_view::npos)
+			{
+				m_idx = size;
+				return false;
+			}
 
-	do
-	{
-		ch = GetChar();
+			m_idx = end + 3;
+			continue;
+		}
 
-		switch (ch)
+		switch (data[m_idx])
 		{
-		case 0x09:
-		case 0x0A:
-		case 0x0D:
-		case ' ':
-		case '>':
-			in_name = false;
+		case '?':
+			type = TagType::ProcInstr;
+			m_idx++;
+			break;
+		case '!':
+			type = TagType::Doctype;
+			m_idx++;
 			break;
 		case '/':
-			if (m_data[m_idx] == '>')
-				type = TagType::Empty;
-			in_name = false;
+			type = TagType::End;
+			m_idx++;
+			break;
+		default:
+			type = TagType::Start;
 			break;
 		}
 
-		if (in_name)
-			name.push_back(ch);
-	} while (ch != '>' && ch != 0);
-
-	return true;
-}
+		start = m_idx;
+		while (m_idx < size && data[m_idx] != '>' && data[m_idx] != '/' && data[m_idx] != ' ' && data[m_idx] != '\t' && data[m_idx] != '\n' && data[m_idx] != '\r')
+			m_idx++;
 
-bool PListXmlParser::GetContent(std::string & content)
-{
-	size_t start = m_idx;
+		name = m_xml.substr(start, m_idx - start);
 
-	content.clear();
+		p = memchr(data + m_idx, '>', size - m_idx);
+		if (!p)
+		{
+			m_idx = size;
+			return false;
+		}
 
-	while (m_idx < m_size && m_data[m_idx] != '<')
-		m_idx++;
+		m_idx = static_cast<const char *>(p) - data + 1;
 
-	if (m_idx == m_size)
-		return false;
+		if (type == TagType::Start && data[m_idx - 2] == '/')
+			type = TagType::Empty;
 
-	content.assign(m_data + start, m_idx - start);
+		if (type == TagType::ProcInstr || type == TagType::Doctype)
+			continue;
 
-	return true;
+		return true;
+	}
 }
 
-size_t PListXmlParser::GetContentSize()
+std::string_view PListXmlReader::GetContent()
 {
+	const void *p;
 	size_t start = m_idx;
 
-	while (m_idx < m_size && m_data[m_idx] != '<')
-		m_idx++;
-
-	if (m_idx == m_size)
-		return m_idx - start;
+	p = memchr(m_xml.data() + m_idx, '<', m_xml.size() - m_idx);
+	m_idx = p ? static_cast<const char *>(p) - m_xml.data() : m_xml.size();
 
-	return m_idx - start;
+	return m_xml.substr(start, m_idx - start);
 }
 
-PList::PList()
+bool PListXmlReader::Error(const char *reason)
 {
-	m_root = nullptr;
+	fprintf(stderr, "XML PList parse error: %s\n", reason);
+	return false;
 }
 
-PList::~PList()
+size_t PListBase64Decode(uint8_t *dst, const char *str, size_t size)
 {
-}
+	const uint8_t *src = reinterpret_cast<const uint8_t *>(str);
+	const uint8_t *end = src + size;
+	uint8_t *out = dst;
+	uint32_t a, b, c, d;
+	uint32_t buf = 0;
+	int chcnt = 0;
+	uint8_t dec;
 
-bool PList::parseXML(const char * data, size_t size)
-{
-	(void)data;
-	(void)size;
+	for (;;)
+	{
+		// Fast path: whole groups of four valid characters, which is all
+		// there is between the line breaks.
+		while (chcnt == 0 && end - src >= 4)
+		{
+			a = base64_table.v[src[0]];
+			b = base64_table.v[src[1]];
+			c = base64_table.v[src[2]];
+			d = base64_table.v[src[3]];
 
-	return false;
+			if ((a | b | c | d) & 0xC0)
+				break;
+
+			buf = (a << 18) | (b << 12) | (c << 6) | d;
+			out[0] = (buf >> 16) & 0xFF;
+			out[1] = (buf >> 8) & 0xFF;
+			out[2] = buf & 0xFF;
+
+			out += 3;
+			src += 4;
+		}
+
+		if (src == end)
+			break;
+
+		dec = base64_table.v[*src++];
+
+		if (dec & 0x80)
+			continue;
+		if (dec & 0x40)
+			break;
+
+		buf = (buf << 6) | dec;
+		chcnt++;
+
+		if (chcnt == 2)
+			*out++ = (buf >> 4) & 0xFF;
+		else if (chcnt == 3)
+			*out++ = (buf >> 2) & 0xFF;
+		else if (chcnt == 4)
+		{
+			*out++ = buf & 0xFF;
+			chcnt = 0;
+		}
+	}
+
+	return out - dst;
 }
@@ -1,5 +1,12 @@
+#include <cstring>
+
 #include "Sha1.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SHA1_SHANI
+#include <immintrin.h>
+#endif
+
 inline uint32_t Ch(uint32_t x, uint32_t y, uint32_t z)
 {
 	return (x & y) ^ ((~x) & z);
@@ -20,6 +27,69 @@ inline uint32_t Rotl(int sh, uint32_t v)
 	return (v << sh) | (v >> (32 - sh));
 }
 
+#ifdef SHA1_SHANI
+// SHA-NI version of the block function, four rounds per sha1rnds4. Group g
+// covers rounds 4g .. 4g+3; the message schedule runs a few groups ahead
+// in the four registers of m.
+template<int g>
+__attribute__((target("sha,sse4.1"), always_inline))
+static inline void Sha1RoundsNI(__m128i &abcd, __m128i (&e)[2], __m128i (&m)[4], const uint8_t *data, __m128i mask)
+{
+	if constexpr (g < 4)
+		m[g] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 16 * g)), mask);
+
+	if constexpr (g == 0)
+		e[0] = _mm_add_epi32(e[0], m[0]);
+	else
+		e[g % 2] = _mm_sha1nexte_epu32(e[g % 2], m[g % 4]);
+
+	e[(g + 1) % 2] = abcd;
+
+	if constexpr (g >= 3 && g <= 18)
+		m[(g + 1) % 4] = _mm_sha1msg2_epu32(m[(g + 1) % 4], m[g % 4]);
+
+	abcd = _mm_sha1rnds4_epu32(abcd, e[g % 2], g / 5);
+
+	if constexpr (g >= 1 && g <= 16)
+		m[(g + 3) % 4] = _mm_sha1msg1_epu32(m[(g + 3) % 4], m[g % 4]);
+	if constexpr (g >= 2 && g <= 17)
+		m[(g + 2) % 4] = _mm_xor_si128(m[(g + 2) % 4], m[g % 4]);
+
+	if constexpr (g < 19)
+		Sha1RoundsNI<g + 1>(abcd, e, m, data, mask);
+}
+
+__attribute__((target("sha,sse4.1")))
+static void TransformNI(uint32_t *state, const uint8_t *data, size_t cnt)
+{
+	const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090A0B0C0D0E0FULL);
+	__m128i abcd;
+	__m128i abcd_save;
+	__m128i e_save;
+	__m128i e[2];
+	__m128i m[4];
+
+	abcd = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(state)), 0x1B);
+	e[0] = _mm_set_epi32(static_cast<int>(state[4]), 0, 0, 0);
+
+	for (; cnt > 0; cnt--, data += 64)
+	{
+		abcd_save = abcd;
+		e_save = e[0];
+
+		Sha1RoundsNI<0>(abcd, e, m, data, mask);
+
+		e[0] = _mm_sha1nexte_epu32(e[0], e_save);
+		abcd = _mm_add_epi32(abcd, abcd_save);
+	}
+
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(state), _mm_shuffle_epi32(abcd, 0x1B));
+	state[4] = static_cast<uint32_t>(_mm_extract_epi32(e[0], 3));
+}
+
+static const bool s_shani = __builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1");
+#endif
+
 Sha1::Sha1()
 {
 	Init();
@@ -31,11 +101,7 @@ Sha1::~Sha1()
 
 void Sha1::Init()
 {
-	m_hash[0] = 0x67452301;
-	m_hash[1] = 0xEFCDAB89;
-	m_hash[2] = 0x98BADCFE;
-	m_hash[3] = 0x10325476;
-	m_hash[4] = 0xC3D2E1F0;
+	InitState(m_hash);
 
 	m_bit_cnt = 0;
 	m_buf_idx = 0;
@@ -49,18 +115,37 @@ void Sha1::Update(const void * ptr, size_t size)
 	size_t n;
 	const uint8_t *data = reinterpret_cast<const uint8_t *>(ptr);
 
-	for (n = 0; n < size; n++)
+	m_bit_cnt += (8 * size);
+
+	if (m_buf_idx > 0)
 	{
-		m_buffer[m_buf_idx] = data[n];
-		m_buf_idx++;
-		if (m_buf_idx == 64)
-		{
-			Round();
-			m_buf_idx = 0;
-		}
+		n = 64 - m_buf_idx;
+		if (n > size)
+			n = size;
+
+		memcpy(m_buffer + m_buf_idx, data, n);
+		m_buf_idx += n;
+		data += n;
+		size -= n;
+
+		if (m_buf_idx < 64)
+			return;
+
+		Round();
+		m_buf_idx = 0;
 	}
 
-	m_bit_cnt += (8 * size);
+	// Whole blocks straight from the caller's buffer
+	n = size / 64;
+	if (n > 0)
+	{
+		Transform(m_hash, data, n);
+		data += 64 * n;
+		size -= 64 * n;
+	}
+
+	memcpy(m_buffer, data, size);
+	m_buf_idx = size;
 }
 
 void Sha1::Final(uint8_t * hash)
@@ -99,6 +184,34 @@ void Sha1::Final(uint8_t * hash)
 }
 
 void Sha1::Round()
+{
+	Transform(m_hash, m_buffer, 1);
+}
+
+void Sha1::InitState(uint32_t *state)
+{
+	state[0] = 0x67452301;
+	state[1] = 0xEFCDAB89;
+	state[2] = 0x98BADCFE;
+	state[3] = 0x10325476;
+	state[4] = 0xC3D2E1F0;
+}
+
+void Sha1::Transform(uint32_t *state, const uint8_t *blocks, size_t cnt)
+{
+#ifdef SHA1_SHANI
+	if (s_shani)
+	{
+		TransformNI(state, blocks, cnt);
+		return;
+	}
+#endif
+
+	for (; cnt > 0; cnt--, blocks += 64)
+		TransformC(state, blocks);
+}
+
+void Sha1::TransformC(uint32_t *state, const uint8_t *block)
 {
 	uint32_t w[80];
 	uint32_t a;
@@ -110,15 +223,15 @@ void Sha1::Round()
 	int k;
 
 	for (k = 0; k < 16; k++)
-		w[k] = (m_buffer[4 * k] << 24) | (m_buffer[4 * k + 1] << 16) | (m_buffer[4 * k + 2] << 8) | m_buffer[4 * k + 3];
+		w[k] = (block[4 * k] << 24) | (block[4 * k + 1] << 16) | (block[4 * k + 2] << 8) | block[4 * k + 3];
 	for (k = 16; k < 80; k++)
 		w[k] = Rotl(1, w[k - 3] ^ w[k - 8] ^ w[k - 14] ^ w[k - 16]);
 
-	a = m_hash[0];
-	b = m_hash[1];
-	c = m_hash[2];
-	d = m_hash[3];
-	e = m_hash[4];
+	a = state[0];
+	b = state[1];
+	c = state[2];
+	d = state[3];
+	e = state[4];
 
 	for (k = 0; k < 20; k++)
 	{
@@ -160,11 +273,11 @@ void Sha1::Round()
 		a = T;
 	}
 
-	m_hash[0] = a + m_hash[0];
-	m_hash[1] = b + m_hash[1];
-	m_hash[2] = c + m_hash[2];
-	m_hash[3] = d + m_hash[3];
-	m_hash[4] = e + m_hash[4];
+	state[0] = a + state[0];
+	state[1] = b + state[1];
+	state[2] = c + state[2];
+	state[3] = d + state[3];
+	state[4] = e + state[4];
 }
 
 
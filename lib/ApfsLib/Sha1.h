@@ -13,8 +13,16 @@ public:
 	void Update(const void *data, size_t size);
 	void Final(uint8_t *hash);
 
+	static constexpr size_t state_words = 5;
+
+	// Raw compression function over cnt blocks of 64 bytes, for callers
+	// that do the padding themselves (PBKDF2). Uses SHA-NI if available.
+	static void InitState(uint32_t *state);
+	static void Transform(uint32_t *state, const uint8_t *blocks, size_t cnt);
+
 private:
 	void Round();
+	static void TransformC(uint32_t *state, const uint8_t *block);
 
 	uint8_t m_buffer[64];
 	uint32_t m_hash[5];
@@ -1,11 +1,17 @@
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 
 #include "Sha256.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SHA256_SHANI
+#include <immintrin.h>
+#endif
+
 #ifdef WIN32
 #include <intrin.h>
-#else
+#elif !defined(_rotr) // immintrin.h has it as a macro
 static inline uint32_t _rotr(uint32_t v, int sh)
 {
 	return (v >> sh) | (v << (32 - sh));
@@ -54,6 +60,77 @@ const uint32_t SHA256::m_k[64] = {
 	0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
 };
 
+#ifdef SHA256_SHANI
+// SHA-NI version of the block function. Group g covers rounds 4g .. 4g+3,
+// two per sha256rnds2; the message schedule runs a few groups ahead in the
+// four registers of m.
+template<int g>
+__attribute__((target("sha,sse4.1"), always_inline))
+static inline void Sha256RoundsNI(__m128i &abef, __m128i &cdgh, __m128i (&m)[4], const uint8_t *data, const uint32_t *k, __m128i mask)
+{
+	__m128i msg;
+	__m128i tmp;
+
+	if constexpr (g < 4)
+		m[g] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 16 * g)), mask);
+
+	msg = _mm_add_epi32(m[g % 4], _mm_loadu_si128(reinterpret_cast<const __m128i *>(k + 4 * g)));
+	cdgh = _mm_sha256rnds2_epu32(cdgh, abef, msg);
+
+	if constexpr (g >= 3 && g <= 14)
+	{
+		tmp = _mm_alignr_epi8(m[g % 4], m[(g + 3) % 4], 4);
+		m[(g + 1) % 4] = _mm_add_epi32(m[(g + 1) % 4], tmp);
+		m[(g + 1) % 4] = _mm_sha256msg2_epu32(m[(g + 1) % 4], m[g % 4]);
+	}
+
+	msg = _mm_shuffle_epi32(msg, 0x0E);
+	abef = _mm_sha256rnds2_epu32(abef, cdgh, msg);
+
+	if constexpr (g >= 1 && g <= 12)
+		m[(g + 3) % 4] = _mm_sha256msg1_epu32(m[(g + 3) % 4], m[g % 4]);
+
+	if constexpr (g < 15)
+		Sha256RoundsNI<g + 1>(abef, cdgh, m, data, k, mask);
+}
+
+__attribute__((target("sha,sse4.1")))
+static void TransformNI(uint32_t *state, const uint8_t *data, size_t cnt, const uint32_t *k)
+{
+	const __m128i mask = _mm_set_epi64x(0x0C0D0E0F08090A0BULL, 0x0405060700010203ULL);
+	__m128i abef;
+	__m128i cdgh;
+	__m128i abef_save;
+	__m128i cdgh_save;
+	__m128i tmp;
+	__m128i m[4];
+
+	// The instructions want the state as ABEF / CDGH
+	tmp = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(state)), 0xB1);
+	cdgh = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(state + 4)), 0x1B);
+	abef = _mm_alignr_epi8(tmp, cdgh, 8);
+	cdgh = _mm_blend_epi16(cdgh, tmp, 0xF0);
+
+	for (; cnt > 0; cnt--, data += 64)
+	{
+		abef_save = abef;
+		cdgh_save = cdgh;
+
+		Sha256RoundsNI<0>(abef, cdgh, m, data, k, mask);
+
+		abef = _mm_add_epi32(abef, abef_save);
+		cdgh = _mm_add_epi32(cdgh, cdgh_save);
+	}
+
+	tmp = _mm_shuffle_epi32(abef, 0x1B);
+	cdgh = _mm_shuffle_epi32(cdgh, 0xB1);
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(state), _mm_blend_epi16(tmp, cdgh, 0xF0));
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(state + 4), _mm_alignr_epi8(cdgh, tmp, 8));
+}
+
+static const bool s_shani = __builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1");
+#endif
+
 SHA256::SHA256()
 {
 	Init();
@@ -67,14 +144,7 @@ void SHA256::Init()
 {
 	int i;
 
-	m_hash[0] = 0x6A09E667;
-	m_hash[1] = 0xBB67AE85;
-	m_hash[2] = 0x3C6EF372;
-	m_hash[3] = 0xA54FF53A;
-	m_hash[4] = 0x510E527F;
-	m_hash[5] = 0x9B05688C;
-	m_hash[6] = 0x1F83D9AB;
-	m_hash[7] = 0x5BE0CD19;
+	InitState(m_hash);
 	m_bufferPtr = 0;
 	m_byteCnt = 0;
 
@@ -83,6 +153,44 @@ void SHA256::Init()
 }
 
 void SHA256::Round()
+{
+	int t;
+
+	Transform(m_hash, m_buffer, 1);
+
+	for (t = 0; t < 64; t++)
+		m_buffer[t] = 0;
+
+	m_bufferPtr = 0;
+}
+
+void SHA256::InitState(uint32_t *state)
+{
+	state[0] = 0x6A09E667;
+	state[1] = 0xBB67AE85;
+	state[2] = 0x3C6EF372;
+	state[3] = 0xA54FF53A;
+	state[4] = 0x510E527F;
+	state[5] = 0x9B05688C;
+	state[6] = 0x1F83D9AB;
+	state[7] = 0x5BE0CD19;
+}
+
+void SHA256::Transform(uint32_t *state, const uint8_t *blocks, size_t cnt)
+{
+#ifdef SHA256_SHANI
+	if (s_shani)
+	{
+		TransformNI(state, blocks, cnt, m_k);
+		return;
+	}
+#endif
+
+	for (; cnt > 0; cnt--, blocks += 64)
+		TransformC(state, blocks);
+}
+
+void SHA256::TransformC(uint32_t *state, const uint8_t *block)
 {
 	uint32_t a, b, c, d, e, f, g, h;
 	uint32_t w[64];
@@ -90,18 +198,18 @@ void SHA256::Round()
 	uint32_t t1, t2;
 
 	for (t = 0; t < 16; t++)
-		w[t] = (m_buffer[4*t] << 24) | (m_buffer[4*t+1] << 16) | (m_buffer[4*t+2] << 8) | m_buffer[4*t+3];
+		w[t] = (block[4*t] << 24) | (block[4*t+1] << 16) | (block[4*t+2] << 8) | block[4*t+3];
 	for (t = 16; t < 64; t++)
 		w[t] = s1(w[t-2]) + w[t-7] + s0(w[t-15]) + w[t-16];
 
-	a = m_hash[0];
-	b = m_hash[1];
-	c = m_hash[2];
-	d = m_hash[3];
-	e = m_hash[4];
-	f = m_hash[5];
-	g = m_hash[6];
-	h = m_hash[7];
+	a = state[0];
+	b = state[1];
+	c = state[2];
+	d = state[3];
+	e = state[4];
+	f = state[5];
+	g = state[6];
+	h = state[7];
 
 	for (t = 0; t < 64; t++) {
 		t1 = h + S1(e) + Ch(e, f, g) + m_k[t] + w[t];
@@ -116,33 +224,49 @@ void SHA256::Round()
 		a = t1 + t2;
 	}
 
-	m_hash[0] += a;
-	m_hash[1] += b;
-	m_hash[2] += c;
-	m_hash[3] += d;
-	m_hash[4] += e;
-	m_hash[5] += f;
-	m_hash[6] += g;
-	m_hash[7] += h;
-
-	for (t = 0; t < 64; t++)
-		m_buffer[t] = 0;
-
-	m_bufferPtr = 0;
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+	state[5] += f;
+	state[6] += g;
+	state[7] += h;
 }
 
 void SHA256::Update(const void *data, size_t cnt)
 {
-	size_t i;
+	size_t n;
 	const uint8_t *bdata = reinterpret_cast<const uint8_t *>(data);
 
-	for (i = 0; i < cnt; i++) {
-		m_buffer[m_bufferPtr++] = bdata[i];
-		if (m_bufferPtr == 64)
-			Round();
+	m_byteCnt += cnt;
+
+	if (m_bufferPtr > 0) {
+		n = 64 - m_bufferPtr;
+		if (n > cnt)
+			n = cnt;
+
+		memcpy(m_buffer + m_bufferPtr, bdata, n);
+		m_bufferPtr += static_cast<uint32_t>(n);
+		bdata += n;
+		cnt -= n;
+
+		if (m_bufferPtr < 64)
+			return;
+
+		Round();
 	}
 
-	m_byteCnt += cnt;
+	// Whole blocks straight from the caller's buffer
+	n = cnt / 64;
+	if (n > 0) {
+		Transform(m_hash, bdata, n);
+		bdata += 64 * n;
+		cnt -= 64 * n;
+	}
+
+	memcpy(m_buffer, bdata, cnt);
+	m_bufferPtr = static_cast<uint32_t>(cnt);
 }
 
 void SHA256::Final(uint8_t *hash)
@@ -151,7 +275,7 @@ void SHA256::Final(uint8_t *hash)
 	int i;
 
 	m_buffer[m_bufferPtr] = 0x80;
-	if (m_bufferPtr >= 55)
+	if (m_bufferPtr >= 56)
 		Round();
 
 	len_h = static_cast<uint32_t>(m_byteCnt >> 29);
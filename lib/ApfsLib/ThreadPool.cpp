@@ -0,0 +1,146 @@
+#include <atomic>
+#include <memory>
+
+#include "Global.h"
+#include "ThreadPool.h"
+
+unsigned int g_threads = 0;
+
+ThreadPool::ThreadPool(unsigned int threads)
+{
+	unsigned int k;
+
+	m_shutdown = false;
+
+	if (threads == 0)
+		threads = g_threads;
+	if (threads == 0)
+		threads = std::thread::hardware_concurrency();
+	if (threads == 0)
+		threads = 1;
+
+	m_threads.reserve(threads);
+	for (k = 0; k < threads; k++)
+		m_threads.emplace_back(&ThreadPool::WorkerMain, this);
+}
+
+ThreadPool &ThreadPool::Get()
+{
+	static ThreadPool pool;
+	return pool;
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_shutdown = true;
+		m_jobs.clear();
+	}
+
+	m_cond.notify_all();
+
+	for (auto &t : m_threads)
+		t.join();
+}
+
+void ThreadPool::Submit(std::function<void()> job)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_jobs.push_back(std::move(job));
+	}
+
+	m_cond.notify_one();
+}
+
+void ThreadPool::ParallelFor(size_t count, const std::function<void(size_t)> &fn)
+{
+	struct State
+	{
+		std::atomic<size_t> next;
+		size_t count;
+		const std::function<void(size_t)> *fn;
+
+		std::mutex mutex;
+		std::condition_variable cond;
+		size_t active;
+	};
+
+	std::shared_ptr<State> st = std::make_shared<State>();
+	size_t helpers;
+	size_t k;
+
+	if (count == 0)
+		return;
+
+	st->next = 0;
+	st->count = count;
+	st->fn = &fn;
+	st->active = 0;
+
+	auto work = [](State &st)
+	{
+		size_t idx;
+
+		while ((idx = st.next++) < st.count)
+			(*st.fn)(idx);
+	};
+
+	helpers = m_threads.size();
+	if (helpers > count - 1)
+		helpers = count - 1;
+
+	for (k = 0; k < helpers; k++)
+	{
+		Submit([st, work]()
+		{
+			{
+				std::lock_guard<std::mutex> lock(st->mutex);
+
+				// Nothing left, and the caller may already be gone.
+				if (st->next >= st->count)
+					return;
+
+				st->active++;
+			}
+
+			work(*st);
+
+			{
+				std::lock_guard<std::mutex> lock(st->mutex);
+				st->active--;
+			}
+
+			st->cond.notify_all();
+		});
+	}
+
+	work(*st);
+
+	std::unique_lock<std::mutex> lock(st->mutex);
+	st->cond.wait(lock, [&st] { return st->active == 0; });
+}
+
+void ThreadPool::WorkerMain()
+{
+	std::function<void()> job;
+
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+
+			m_cond.wait(lock, [this] { return m_shutdown || !m_jobs.empty(); });
+
+			if (m_shutdown)
+				return;
+
+			job = std::move(m_jobs.front());
+			m_jobs.pop_front();
+		}
+
+		job();
+		job = nullptr;
+	}
+}
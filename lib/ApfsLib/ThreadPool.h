@@ -0,0 +1,44 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool
+{
+public:
+	// threads == 0 means one thread per CPU (or g_threads, if set).
+	ThreadPool(unsigned int threads = 0);
+	// Jobs that have not been started yet are discarded.
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool &o) = delete;
+	ThreadPool &operator=(const ThreadPool &o) = delete;
+
+	// The pool shared by all components, created on first use with
+	// g_threads workers. Users that submit jobs have to wait for them
+	// before they go away; the pool lives until the program exits.
+	static ThreadPool &Get();
+
+	void Submit(std::function<void()> job);
+
+	// Runs fn(0) ... fn(count - 1) on the pool and returns when all calls
+	// are done. The calling thread takes part in the work, so this may also
+	// be used from inside a job.
+	void ParallelFor(size_t count, const std::function<void(size_t)> &fn);
+
+	unsigned int GetThreadCount() const { return static_cast<unsigned int>(m_threads.size()); }
+
+private:
+	void WorkerMain();
+
+	std::vector<std::thread> m_threads;
+	std::deque<std::function<void()>> m_jobs;
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	bool m_shutdown;
+};
@@ -20,6 +20,8 @@
 #include "Unicode.h"
 
 #include <cassert>
+#include <cstdlib>
+#include <cstring>
 
 #include <iostream>
 #include <iomanip>
@@ -41,9 +43,253 @@ extern "C" {
 #include <lzvn_decode_base.h>
 }
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FLETCHER_AVX2
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define FLETCHER_NEON
+#include <arm_neon.h>
+#endif
+
 static Crc32 g_crc(true, 0x1EDC6F41);
 
+namespace
+{
+	// Per-thread zlib stream. Set up once and reset for every chunk, instead
+	// of allocating a new inflate state each time.
+	class ZLibContext
+	{
+	public:
+		ZLibContext()
+		{
+			memset(&m_strm, 0, sizeof(m_strm));
+			m_strm.zalloc = Z_NULL;
+			m_strm.zfree = Z_NULL;
+			m_init = (inflateInit2(&m_strm, 15) == Z_OK);
+		}
+
+		~ZLibContext()
+		{
+			if (m_init)
+				inflateEnd(&m_strm);
+		}
+
+		z_stream *Get()
+		{
+			if (!m_init || inflateReset(&m_strm) != Z_OK)
+				return nullptr;
+			return &m_strm;
+		}
+
+	private:
+		z_stream m_strm;
+		bool m_init;
+	};
+
+	// bzip2 has no way to reset a stream. Instead, the blocks it allocates
+	// (most notably the multi-MB tt array) are kept per thread and handed
+	// out again on the next BZ2_bzDecompressInit.
+	class BZ2Allocator
+	{
+		// Keeps the block size, padded to preserve malloc alignment
+		static constexpr size_t header_size = 16;
+		static constexpr size_t max_free = 8;
+
+	public:
+		~BZ2Allocator()
+		{
+			for (void *blk : m_free)
+				free(blk);
+		}
+
+		static void *Alloc(void *opaque, int items, int size)
+		{
+			BZ2Allocator *self = reinterpret_cast<BZ2Allocator *>(opaque);
+			size_t bytes = static_cast<size_t>(items) * static_cast<size_t>(size);
+			size_t k;
+			uint8_t *blk;
+
+			for (k = 0; k < self->m_free.size(); k++)
+			{
+				blk = reinterpret_cast<uint8_t *>(self->m_free[k]);
+
+				if (*reinterpret_cast<size_t *>(blk) == bytes)
+				{
+					self->m_free[k] = self->m_free.back();
+					self->m_free.pop_back();
+					return blk + header_size;
+				}
+			}
+
+			blk = reinterpret_cast<uint8_t *>(malloc(bytes + header_size));
+			if (!blk)
+				return nullptr;
+
+			*reinterpret_cast<size_t *>(blk) = bytes;
+			return blk + header_size;
+		}
+
+		static void Free(void *opaque, void *ptr)
+		{
+			BZ2Allocator *self = reinterpret_cast<BZ2Allocator *>(opaque);
+			uint8_t *blk;
+
+			if (!ptr)
+				return;
+
+			blk = reinterpret_cast<uint8_t *>(ptr) - header_size;
+
+			if (self->m_free.size() < max_free)
+				self->m_free.push_back(blk);
+			else
+				free(blk);
+		}
+
+	private:
+		std::vector<void *> m_free;
+	};
+}
+
+// The vector versions of Fletcher64 keep, per lane j, the sum a[j] of the
+// words in that lane and the sum b[j] of the running a[j] after every step.
+// Over n words this gives sum1 += sum(a) and
+// sum2 += n * sum1 + lanes * sum(b) - sum(j * a[j]), without any reduction
+// in between. Up to this many words the exact sums fit in 64 bits, like
+// those of the scalar loop, so both produce the same result.
+static constexpr size_t fletcher_vector_max = 0x10000;
+
+static void Fletcher64Combine(uint64_t &sum1, uint64_t &sum2, const uint64_t *a, const uint64_t *b, size_t lanes, size_t n)
+{
+	uint64_t sa = 0;
+	uint64_t sb = 0;
+	uint64_t sja = 0;
+	size_t j;
+
+	for (j = 0; j < lanes; j++)
+	{
+		sa += a[j];
+		sb += b[j];
+		sja += j * a[j];
+	}
+
+	sum2 += n * sum1 + lanes * sb - sja;
+	sum1 += sa;
+}
+
+#ifdef FLETCHER_AVX2
+// Eight words per step, zero extended to 64 bit lanes.
+__attribute__((target("avx2")))
+static size_t Fletcher64AVX2(const uint32_t *data, size_t cnt, uint64_t &sum1, uint64_t &sum2)
+{
+	alignas(32) uint64_t a[8];
+	alignas(32) uint64_t b[8];
+	__m256i a0 = _mm256_setzero_si256();
+	__m256i a1 = _mm256_setzero_si256();
+	__m256i b0 = _mm256_setzero_si256();
+	__m256i b1 = _mm256_setzero_si256();
+	size_t n = cnt & ~static_cast<size_t>(7);
+	size_t k;
+
+	for (k = 0; k < n; k += 8)
+	{
+		a0 = _mm256_add_epi64(a0, _mm256_cvtepu32_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + k))));
+		a1 = _mm256_add_epi64(a1, _mm256_cvtepu32_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + k + 4))));
+		b0 = _mm256_add_epi64(b0, a0);
+		b1 = _mm256_add_epi64(b1, a1);
+	}
+
+	_mm256_store_si256(reinterpret_cast<__m256i *>(a), a0);
+	_mm256_store_si256(reinterpret_cast<__m256i *>(a + 4), a1);
+	_mm256_store_si256(reinterpret_cast<__m256i *>(b), b0);
+	_mm256_store_si256(reinterpret_cast<__m256i *>(b + 4), b1);
+
+	Fletcher64Combine(sum1, sum2, a, b, 8, n);
+
+	return n;
+}
+
+static const bool s_avx2 = __builtin_cpu_supports("avx2");
+#endif
+
+#ifdef FLETCHER_NEON
+// Eight words per step, widened to 64 bit lanes.
+static size_t Fletcher64NEON(const uint32_t *data, size_t cnt, uint64_t &sum1, uint64_t &sum2)
+{
+	uint64_t a[8];
+	uint64_t b[8];
+	uint64x2_t av[4];
+	uint64x2_t bv[4];
+	uint32x4_t d0;
+	uint32x4_t d1;
+	size_t n = cnt & ~static_cast<size_t>(7);
+	size_t k;
+	int j;
+
+	for (j = 0; j < 4; j++)
+	{
+		av[j] = vdupq_n_u64(0);
+		bv[j] = vdupq_n_u64(0);
+	}
+
+	for (k = 0; k < n; k += 8)
+	{
+		d0 = vld1q_u32(data + k);
+		d1 = vld1q_u32(data + k + 4);
+
+		av[0] = vaddw_u32(av[0], vget_low_u32(d0));
+		av[1] = vaddw_high_u32(av[1], d0);
+		av[2] = vaddw_u32(av[2], vget_low_u32(d1));
+		av[3] = vaddw_high_u32(av[3], d1);
+
+		for (j = 0; j < 4; j++)
+			bv[j] = vaddq_u64(bv[j], av[j]);
+	}
+
+	for (j = 0; j < 4; j++)
+	{
+		vst1q_u64(a + 2 * j, av[j]);
+		vst1q_u64(b + 2 * j, bv[j]);
+	}
+
+	Fletcher64Combine(sum1, sum2, a, b, 8, n);
+
+	return n;
+}
+#endif
+
 uint64_t Fletcher64(const uint32_t *data, size_t cnt, uint64_t init)
+{
+	size_t k = 0;
+
+	uint64_t sum1 = init & 0xFFFFFFFFU;
+	uint64_t sum2 = (init >> 32);
+
+	if (cnt <= fletcher_vector_max)
+	{
+#ifdef FLETCHER_AVX2
+		if (s_avx2)
+			k = Fletcher64AVX2(data, cnt, sum1, sum2);
+#endif
+#ifdef FLETCHER_NEON
+		k = Fletcher64NEON(data, cnt, sum1, sum2);
+#endif
+	}
+
+	for (; k < cnt; k++)
+	{
+		sum1 = (sum1 + data[k]);
+		sum2 = (sum2 + sum1);
+	}
+
+	sum1 = sum1 % 0xFFFFFFFF;
+	sum2 = sum2 % 0xFFFFFFFF;
+
+	return (static_cast<uint64_t>(sum2) << 32) | static_cast<uint64_t>(sum1);
+}
+
+uint64_t Fletcher64Scalar(const uint32_t *data, size_t cnt, uint64_t init)
 {
 	size_t k;
 
@@ -269,10 +515,7 @@ uint32_t HashFilename(const uint8_t* utf8str, uint16_t name_len, bool case_fold)
 	}
 #endif
 
-	g_crc.SetCRC(0xFFFFFFFF);
-	g_crc.Calc(reinterpret_cast<const uint8_t *>(utf32_nfd.data()), utf32_nfd.size() * sizeof(char32_t));
-
-	hash = g_crc.GetCRC();
+	hash = g_crc.Update(0xFFFFFFFF, reinterpret_cast<const uint8_t *>(utf32_nfd.data()), utf32_nfd.size() * sizeof(char32_t));
 
 	hash = ((hash & 0x3FFFFF) << 10) | (name_len & 0x3FF);
 
@@ -429,38 +672,33 @@ bool GetPassword(std::string &pw)
 
 size_t DecompressZLib(uint8_t *dst, size_t dst_size, const uint8_t *src, size_t src_size)
 {
-	// size_t nwr = 0;
+	thread_local ZLibContext ctx;
+	z_stream *strm;
 	int ret;
 
-	z_stream strm;
-
-	memset(&strm, 0, sizeof(strm));
-	strm.zalloc = Z_NULL;
-	strm.zfree = Z_NULL;
-	strm.avail_in = src_size;
-	strm.avail_out = dst_size;
-	strm.next_in = const_cast<uint8_t *>(src);
-	strm.next_out = dst;
-
-	ret = inflateInit2(&strm, 15);
-	if (ret != Z_OK)
+	strm = ctx.Get();
+	if (!strm)
 	{
 		std::cerr << "DecompressZLib: inflateInit failed." << std::endl;
 		return 0;
 	}
 
+	strm->avail_in = src_size;
+	strm->avail_out = dst_size;
+	strm->next_in = const_cast<uint8_t *>(src);
+	strm->next_out = dst;
+
 	do {
-		ret = inflate(&strm, Z_NO_FLUSH);
+		ret = inflate(strm, Z_NO_FLUSH);
+		// Corrupt stream, nothing of the output can be trusted
 		if (ret == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR)
-		{
-			strm.avail_out = 0;
+			return 0;
+		// Truncated input or output full, no progress possible
+		if (ret == Z_BUF_ERROR)
 			break;
-		}
 	} while (ret != Z_STREAM_END);
 
-	inflateEnd(&strm);
-
-	return dst_size - strm.avail_out;
+	return dst_size - strm->avail_out;
 }
 
 size_t DecompressADC(uint8_t * dst, size_t dst_size, const uint8_t * src, size_t src_size)
@@ -537,11 +775,20 @@ size_t DecompressLZVN(uint8_t * dst, size_t dst_size, const uint8_t * src, size_
 
 size_t DecompressBZ2(uint8_t * dst, size_t dst_size, const uint8_t * src, size_t src_size)
 {
+	thread_local BZ2Allocator alloc;
 	bz_stream strm;
 
 	memset(&strm, 0, sizeof(strm));
 
-	BZ2_bzDecompressInit(&strm, 0, 0);
+	strm.bzalloc = BZ2Allocator::Alloc;
+	strm.bzfree = BZ2Allocator::Free;
+	strm.opaque = &alloc;
+
+	if (BZ2_bzDecompressInit(&strm, 0, 0) != BZ_OK)
+	{
+		std::cerr << "DecompressBZ2: BZ2_bzDecompressInit failed." << std::endl;
+		return 0;
+	}
 
 	strm.next_in = const_cast<char *>(reinterpret_cast<const char *>(src));
 	strm.avail_in = src_size;
@@ -557,7 +804,10 @@ size_t DecompressBZ2(uint8_t * dst, size_t dst_size, const uint8_t * src, size_t
 
 size_t DecompressLZFSE(uint8_t * dst, size_t dst_size, const uint8_t * src, size_t src_size)
 {
-	return lzfse_decode_buffer(dst, dst_size, src, src_size, nullptr);
+	// Without a scratch buffer, lzfse would malloc one on every call.
+	thread_local std::vector<uint8_t> scratch(lzfse_decode_scratch_size());
+
+	return lzfse_decode_buffer(dst, dst_size, src, src_size, scratch.data());
 }
 
 int log2(uint32_t val)
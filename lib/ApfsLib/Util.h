@@ -28,6 +28,8 @@
 #include "ApfsTypes.h"
 
 uint64_t Fletcher64(const uint32_t *data, size_t cnt, uint64_t init);
+// Fletcher64 without the AVX2 / NEON paths, to check them against.
+uint64_t Fletcher64Scalar(const uint32_t *data, size_t cnt, uint64_t init);
 bool VerifyBlock(const void *block, size_t size);
 bool IsZero(const uint8_t *data, size_t size);
 bool IsEmptyBlock(const void *data, size_t blksize);
@@ -1,6 +1,7 @@
 #include "APFSHandler.hpp"
 #include "../utils.hpp"
 #include "APFSWriter.hpp"
+#include <ApfsLib/DeviceDMG.h>
 
 constexpr int APFS_ROOT_INODE = 2;
 constexpr int MEGABYTE_SIZE = 1024 * 1024;
@@ -83,6 +84,40 @@ bool APFSHandler::write() {
     return true;
 }
 
+// Checks the DMG checksums of the partitions that write() has decoded
+// completely, so the image does not have to be decompressed a second time.
+bool APFSHandler::verify_checksums() {
+    DeviceDMG* dmg = dynamic_cast<DeviceDMG*>(device);
+    size_t unchecked = 0;
+
+    if (!dmg || !dmg->IsVerifying()) {
+        Utilities::print(Utilities::MSG_STATUS_WARNING,
+                         "%s is not a UDIF image, there are no checksums to verify.\n",
+                         device_path.c_str());
+        return true;
+    }
+
+    if (!dmg->CheckReadChecksums(unchecked)) {
+        Utilities::print(
+          Utilities::MSG_STATUS_ERROR, "Checksum verification of %s failed.\n", device_path.c_str());
+        return false;
+    }
+
+    if (unchecked > 0) {
+        Utilities::print(Utilities::MSG_STATUS_WARNING,
+                         "%zu partition(s) of %s were not read completely and could not be "
+                         "checked. Run with -k alone to verify the whole image.\n",
+                         unchecked,
+                         device_path.c_str());
+    } else {
+        Utilities::print(Utilities::MSG_STATUS_SUCCESS,
+                         "Partition checksums of %s are valid.\n",
+                         device_path.c_str());
+    }
+
+    return true;
+}
+
 APFSHandler::~APFSHandler() {
     delete container;
 }
@@ -20,4 +20,5 @@ class APFSHandler {
     ~APFSHandler();
     bool init();
     bool write();
+    bool verify_checksums();
 };
@@ -19,7 +19,7 @@
 constexpr int BUFFER_SIZE = 4096;
 constexpr int APFS_ROOT_INODE = 2;
 
-static bool is_inode_compressed(ApfsDir::Inode inode) {
+static bool is_inode_compressed(const ApfsCatalog::Inode& inode) {
     return (inode.bsd_flags & APFS_UF_COMPRESSED) != 0;
 }
 
@@ -39,31 +39,42 @@ APFSWriter::~APFSWriter() {
 }
 
 bool APFSWriter::write_contents_of_tree(uint64_t inode) {
+    // Read all metadata in one pass over the fs tree instead of looking up
+    // every directory, inode and attribute separately.
+    if (!dir->BuildCatalog(catalog)) {
+        fprintf(stderr, "Unable to read the file system tree.\n");
+        return false;
+    }
+
     return write_contents_of_tree_with_name(inode, output_prefix);
 }
 
 bool APFSWriter::write_contents_of_tree_with_name(uint64_t inode, const std::string& out) {
-    std::vector<ApfsDir::DirRec> dir_list;
-    dir->ListDirectory(dir_list, inode);
+    const ApfsCatalog::Inode* dir_inode = catalog.GetInode(inode);
+    if (!dir_inode) {
+        return true;
+    }
+
+    for (size_t i = 0; i < dir_inode->child_cnt; i++) {
+        const ApfsCatalog::Child& child = catalog.GetChild(*dir_inode, i);
 
-    for (size_t i = 0; i < dir_list.size(); i++) {
         // do not keep calling printf
         if (count % 50 == 0) {
             Utilities::print_progress(count, total_object_count, false);
         }
         count++;
 
-        mode_t mode = (dir_list[i].flags & DREC_TYPE_MASK) << 12;
+        mode_t mode = (child.flags & DREC_TYPE_MASK) << 12;
         bool status = true;
         if (S_ISDIR(mode)) {
-            std::string name = out + "/" + dir_list[i].name;
-            status = handle_directory(dir_list[i].file_id, name);
+            std::string name = out + "/" + catalog.GetName(child);
+            status = handle_directory(child.file_id, name);
         } else if (S_ISREG(mode)) {
-            std::string name = out + "/" + dir_list[i].name;
-            status = handle_regular_file(dir_list[i].file_id, name);
+            std::string name = out + "/" + catalog.GetName(child);
+            status = handle_regular_file(child.file_id, name);
         } else if (S_ISLNK(mode)) {
-            std::string name = out + "/" + dir_list[i].name;
-            status = handle_symlink(dir_list[i].file_id, name);
+            std::string name = out + "/" + catalog.GetName(child);
+            status = handle_symlink(child.file_id, name);
         } else {
             fprintf(stderr, "Unknown object type: mode is %d\n", mode);
         }
@@ -78,10 +89,13 @@ bool APFSWriter::write_contents_of_tree_with_name(uint64_t inode, const std::str
 }
 
 bool APFSWriter::handle_regular_file(uint64_t inode, std::string name) {
-    ApfsDir::Inode inodeobj;
-    dir->GetInode(inodeobj, inode);
+    const ApfsCatalog::Inode* inodeobj = catalog.GetInode(inode);
+    if (!inodeobj) {
+        fprintf(stderr, "Unable to find inode for %s\n", name.c_str());
+        return false;
+    }
 
-    if (is_inode_compressed(inodeobj)) {
+    if (is_inode_compressed(*inodeobj)) {
         return handle_compressed_file(inode, name);
     }
 
@@ -89,7 +103,7 @@ bool APFSWriter::handle_regular_file(uint64_t inode, std::string name) {
     Utilities::win32_get_sanitized_filename(name, '.');
 #endif
 
-    mode_t mode = inodeobj.mode;
+    mode_t mode = inodeobj->mode;
     std::vector<uint8_t> file_contents(4096);
 
     std::ofstream output(name, std::ios::binary);
@@ -99,12 +113,13 @@ bool APFSWriter::handle_regular_file(uint64_t inode, std::string name) {
         return false;
     }
 
-    uint64_t size = inodeobj.ds_size;
+    uint64_t size = inodeobj->size;
     uint64_t curpos = 0;
     file_contents.resize(size);
 
     for (curpos = 0; curpos < size / BUFFER_SIZE; curpos++) {
-        dir->ReadFile(file_contents.data(), inodeobj.private_id, curpos * BUFFER_SIZE, BUFFER_SIZE);
+        dir->ReadFile(
+          file_contents.data(), catalog, inodeobj->private_id, curpos * BUFFER_SIZE, BUFFER_SIZE);
         output.write((char*)file_contents.data(), BUFFER_SIZE);
         if (!output.good()) {
             std::error_code ec(errno, std::system_category());
@@ -114,8 +129,11 @@ bool APFSWriter::handle_regular_file(uint64_t inode, std::string name) {
     }
 
     if (size % BUFFER_SIZE) {
-        dir->ReadFile(
-          file_contents.data(), inodeobj.private_id, curpos * BUFFER_SIZE, size % BUFFER_SIZE);
+        dir->ReadFile(file_contents.data(),
+                      catalog,
+                      inodeobj->private_id,
+                      curpos * BUFFER_SIZE,
+                      size % BUFFER_SIZE);
         output.write((char*)file_contents.data(), size % BUFFER_SIZE);
         if (!output.good()) {
             std::error_code ec(errno, std::system_category());
@@ -137,7 +155,7 @@ bool APFSWriter::handle_compressed_file(uint64_t inode, std::string& name) {
     Utilities::win32_get_sanitized_filename(name, '.');
 #endif
 
-    bool rc = dir->GetAttribute(compressed, inode, "com.apple.decmpfs");
+    bool rc = dir->GetAttribute(compressed, catalog, inode, ApfsCatalog::ATTR_DECMPFS);
     if (!rc) {
         fprintf(stderr,
                 "File %s seems to be compressed, but has no com.apple.decmpfs attribute. "
@@ -146,7 +164,7 @@ bool APFSWriter::handle_compressed_file(uint64_t inode, std::string& name) {
         return false;
     }
 
-    DecompressFile(*dir, inode, file_contents, compressed);
+    DecompressFile(*dir, catalog, inode, file_contents, compressed);
 
     std::ofstream output(name, std::ios::binary);
     if (!output.good()) {
@@ -182,7 +200,7 @@ bool APFSWriter::handle_symlink(uint64_t inode, std::string& name) {
     Utilities::win32_get_sanitized_filename(name, '.');
 #endif
     std::vector<uint8_t> buffer;
-    bool rc = dir->GetAttribute(buffer, inode, "com.apple.fs.symlink");
+    bool rc = dir->GetAttribute(buffer, catalog, inode, ApfsCatalog::ATTR_SYMLINK);
     if (!rc) {
         fprintf(stderr, "Unable to find target for symlink %s\n", name.c_str());
         return false;
@@ -1,4 +1,5 @@
 #pragma once
+#include <ApfsLib/ApfsCatalog.h>
 #include <ApfsLib/ApfsDir.h>
 #include <ApfsLib/ApfsVolume.h>
 
@@ -6,6 +7,7 @@ class APFSWriter {
     uint64_t total_object_count = 0;
     uint64_t count = 0;
     ApfsDir* dir = nullptr;
+    ApfsCatalog catalog;
     ApfsVolume* volume = nullptr;
     std::string output_prefix;
 
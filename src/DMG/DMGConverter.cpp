@@ -0,0 +1,358 @@
+#include "DMGConverter.hpp"
+#include "../utils.hpp"
+#include <ApfsLib/ThreadPool.h>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#ifdef WIN32
+#include <windows.h>
+#include <winioctl.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+constexpr uint64_t ZERO_BUFFER_SIZE = 1024 * 1024;
+constexpr uint64_t COPY_BUFFER_SIZE = 4 * 1024 * 1024;
+constexpr size_t PROGRESS_INTERVAL = 64;
+
+DMGConverter::DMGConverter(const std::string& input_path, const std::string& output_path) {
+    this->input_path = input_path;
+    this->output_path = output_path;
+}
+
+DMGConverter::~DMGConverter() {
+    close_output();
+}
+
+bool DMGConverter::convert() {
+    if (!dmg.Open(input_path.c_str())) {
+        Utilities::print(
+          Utilities::MSG_STATUS_ERROR, "Unable to open image %s.\n", input_path.c_str());
+        return false;
+    }
+
+    size_t count = dmg.GetSectionCount();
+    if (count == 0) {
+        dmg.Close();
+        return convert_device();
+    }
+
+    if (!open_output(dmg.GetSize())) {
+        return false;
+    }
+
+    ThreadPool& pool = ThreadPool::Get();
+    std::atomic<bool> failed(false);
+    std::atomic<size_t> done(0);
+    std::mutex progress_mutex;
+
+    pool.ParallelFor(count, [&](size_t idx) {
+        // One section buffer per thread, reused across sections
+        thread_local std::vector<uint8_t> buffer;
+        uint64_t offset;
+        uint64_t length;
+        bool ok;
+
+        if (failed) {
+            return;
+        }
+
+        dmg.GetSectionExtent(idx, offset, length);
+
+        if (dmg.IsZeroSection(idx)) {
+            // Regular files were truncated to size, so this is already a hole.
+            ok = output_is_file || write_zeros(offset, length);
+        } else {
+            buffer.resize(length);
+            ok = dmg.ReadSection(idx, buffer.data());
+            if (!ok) {
+                Utilities::print(Utilities::MSG_STATUS_ERROR,
+                                 "Unable to decode section at offset %" PRIu64 ".\n",
+                                 offset);
+            } else {
+                ok = write_output(buffer.data(), offset, length);
+            }
+        }
+
+        if (!ok) {
+            failed = true;
+        }
+
+        size_t finished = ++done;
+        if (finished % PROGRESS_INTERVAL == 0) {
+            std::lock_guard<std::mutex> lock(progress_mutex);
+            Utilities::print_progress(finished, count, false);
+        }
+    });
+
+    Utilities::print_progress(done, count, true);
+    close_output();
+
+    if (failed) {
+        return false;
+    }
+
+    if (dmg.IsVerifying() && !dmg.CheckChecksums(pool)) {
+        Utilities::print(
+          Utilities::MSG_STATUS_ERROR, "Checksum verification of %s failed.\n", input_path.c_str());
+        return false;
+    }
+
+    Utilities::print(Utilities::MSG_STATUS_SUCCESS,
+                     "Wrote %" PRIu64 " MB to %s\n",
+                     dmg.GetSize() / (1024 * 1024),
+                     output_path.c_str());
+    return true;
+}
+
+bool DMGConverter::convert_device() {
+    std::unique_ptr<Device> dev(Device::OpenDevice(input_path.c_str()));
+    if (!dev) {
+        Utilities::print(
+          Utilities::MSG_STATUS_ERROR, "Unable to open image %s.\n", input_path.c_str());
+        return false;
+    }
+
+    uint64_t size = dev->GetSize();
+    if (!open_output(size)) {
+        return false;
+    }
+
+    std::vector<uint8_t> buffer(COPY_BUFFER_SIZE);
+    uint64_t offset = 0;
+    bool ok = true;
+
+    // Only the ranges the image has stored are read and written.
+    while (ok && offset < size) {
+        uint64_t data = dev->SeekData(offset);
+
+        // Regular files were truncated to size, so this is already a hole.
+        if (data > offset && !output_is_file) {
+            ok = write_zeros(offset, data - offset);
+        }
+
+        uint64_t hole = ok && data < size ? dev->SeekHole(data) : data;
+
+        for (offset = data; ok && offset < hole;) {
+            uint64_t chunk = hole - offset < COPY_BUFFER_SIZE ? hole - offset : COPY_BUFFER_SIZE;
+
+            ok = dev->Read(buffer.data(), offset, chunk);
+            if (!ok) {
+                Utilities::print(Utilities::MSG_STATUS_ERROR,
+                                 "Unable to read image at offset %" PRIu64 ".\n",
+                                 offset);
+            } else {
+                ok = write_output(buffer.data(), offset, chunk);
+            }
+
+            offset += chunk;
+        }
+
+        Utilities::print_progress(offset >> 20, size >> 20, false);
+    }
+
+    Utilities::print_progress(offset >> 20, size >> 20, true);
+    close_output();
+    dev->Close();
+
+    if (!ok) {
+        return false;
+    }
+
+    Utilities::print(Utilities::MSG_STATUS_SUCCESS,
+                     "Wrote %" PRIu64 " MB to %s\n",
+                     size / (1024 * 1024),
+                     output_path.c_str());
+    return true;
+}
+
+bool DMGConverter::verify() {
+    if (!dmg.Open(input_path.c_str())) {
+        Utilities::print(
+          Utilities::MSG_STATUS_ERROR, "Unable to open image %s.\n", input_path.c_str());
+        return false;
+    }
+
+    if (dmg.GetSectionCount() == 0) {
+        Utilities::print(
+          Utilities::MSG_STATUS_ERROR, "%s is not a UDIF image.\n", input_path.c_str());
+        return false;
+    }
+
+    ThreadPool& pool = ThreadPool::Get();
+    if (!dmg.CheckChecksums(pool)) {
+        Utilities::print(
+          Utilities::MSG_STATUS_ERROR, "Checksum verification of %s failed.\n", input_path.c_str());
+        return false;
+    }
+
+    Utilities::print(
+      Utilities::MSG_STATUS_SUCCESS, "Checksums of %s are valid.\n", input_path.c_str());
+    return true;
+}
+
+#ifdef WIN32
+
+bool DMGConverter::open_output(uint64_t size) {
+    HANDLE file = CreateFileA(output_path.c_str(),
+                              GENERIC_READ | GENERIC_WRITE,
+                              0,
+                              NULL,
+                              OPEN_ALWAYS,
+                              FILE_ATTRIBUTE_NORMAL,
+                              NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        Utilities::print(
+          Utilities::MSG_STATUS_ERROR, "Unable to open output %s.\n", output_path.c_str());
+        return false;
+    }
+    output = file;
+
+    output_is_file = GetFileType(file) == FILE_TYPE_DISK && output_path.rfind("\\\\.\\", 0) != 0;
+    if (output_is_file) {
+        LARGE_INTEGER end;
+        DWORD returned;
+
+        // Best effort; without it the skipped ranges are still read back as zeros.
+        DeviceIoControl(file, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &returned, NULL);
+
+        end.QuadPart = 0;
+        SetFilePointerEx(file, end, NULL, FILE_BEGIN);
+        SetEndOfFile(file);
+        end.QuadPart = size;
+        if (!SetFilePointerEx(file, end, NULL, FILE_BEGIN) || !SetEndOfFile(file)) {
+            Utilities::print(
+              Utilities::MSG_STATUS_ERROR, "Unable to resize output %s.\n", output_path.c_str());
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void DMGConverter::close_output() {
+    if (output) {
+        CloseHandle(output);
+        output = nullptr;
+    }
+}
+
+bool DMGConverter::write_output(const uint8_t* data, uint64_t offset, uint64_t length) {
+    while (length > 0) {
+        OVERLAPPED ov;
+        DWORD chunk = length > 0x40000000 ? 0x40000000 : static_cast<DWORD>(length);
+        DWORD written = 0;
+
+        memset(&ov, 0, sizeof(ov));
+        ov.Offset = static_cast<DWORD>(offset);
+        ov.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+        if (!WriteFile(output, data, chunk, &written, &ov) || written == 0) {
+            Utilities::print(Utilities::MSG_STATUS_ERROR,
+                             "Unable to write to output %s at offset %" PRIu64 ".\n",
+                             output_path.c_str(),
+                             offset);
+            return false;
+        }
+
+        data += written;
+        offset += written;
+        length -= written;
+    }
+
+    return true;
+}
+
+#else
+
+bool DMGConverter::open_output(uint64_t size) {
+    output = open(output_path.c_str(), O_WRONLY | O_CREAT, 0644);
+    if (output == -1) {
+        Utilities::print(Utilities::MSG_STATUS_ERROR,
+                         "Unable to open output %s: %s\n",
+                         output_path.c_str(),
+                         strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(output, &st) != 0) {
+        Utilities::print(Utilities::MSG_STATUS_ERROR,
+                         "Unable to stat output %s: %s\n",
+                         output_path.c_str(),
+                         strerror(errno));
+        return false;
+    }
+
+    output_is_file = S_ISREG(st.st_mode);
+    if (output_is_file) {
+        // Truncating to 0 first drops any old data, so the zero sections
+        // that are skipped end up as holes.
+        if (ftruncate(output, 0) != 0 || ftruncate(output, size) != 0) {
+            Utilities::print(Utilities::MSG_STATUS_ERROR,
+                             "Unable to resize output %s: %s\n",
+                             output_path.c_str(),
+                             strerror(errno));
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void DMGConverter::close_output() {
+    if (output != -1) {
+        close(output);
+        output = -1;
+    }
+}
+
+bool DMGConverter::write_output(const uint8_t* data, uint64_t offset, uint64_t length) {
+    while (length > 0) {
+        ssize_t written = pwrite(output, data, length, offset);
+
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (written <= 0) {
+            Utilities::print(Utilities::MSG_STATUS_ERROR,
+                             "Unable to write to output %s at offset %" PRIu64 ": %s\n",
+                             output_path.c_str(),
+                             offset,
+                             strerror(errno));
+            return false;
+        }
+
+        data += written;
+        offset += written;
+        length -= written;
+    }
+
+    return true;
+}
+
+#endif // WIN32
+
+bool DMGConverter::write_zeros(uint64_t offset, uint64_t length) {
+    static const std::vector<uint8_t> zeros(ZERO_BUFFER_SIZE, 0);
+
+    while (length > 0) {
+        uint64_t chunk = length < ZERO_BUFFER_SIZE ? length : ZERO_BUFFER_SIZE;
+
+        if (!write_output(zeros.data(), offset, chunk)) {
+            return false;
+        }
+
+        offset += chunk;
+        length -= chunk;
+    }
+
+    return true;
+}
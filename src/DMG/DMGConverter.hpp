@@ -0,0 +1,35 @@
+#pragma once
+#include <ApfsLib/DeviceDMG.h>
+#include <cinttypes>
+#include <string>
+
+// Converts a UDIF image into a flat raw image (or straight onto a block
+// device), decompressing the sections on all cores. With g_dmg_verify set,
+// the image checksums are checked in the same pass. Other images (sparse
+// images, raw files) are copied, skipping the ranges they do not store.
+class DMGConverter {
+    std::string input_path;
+    std::string output_path;
+    DeviceDMG dmg;
+
+#ifdef WIN32
+    void* output = nullptr;
+#else
+    int output = -1;
+#endif
+    // Holes can be left in regular files; block devices need written zeros.
+    bool output_is_file = true;
+
+    bool open_output(uint64_t size);
+    void close_output();
+    bool write_output(const uint8_t* data, uint64_t offset, uint64_t length);
+    bool write_zeros(uint64_t offset, uint64_t length);
+    bool convert_device();
+
+  public:
+    DMGConverter(const std::string& input_path, const std::string& output_path);
+    ~DMGConverter();
+    bool convert();
+    // Only decodes the image and checks its checksums.
+    bool verify();
+};
@@ -0,0 +1,130 @@
+// Runs the accelerated and the table/scalar versions of the checksums on the
+// same buffers, checks that they agree and prints their throughput.
+// Returns non-zero if any result differs.
+#include <ApfsLib/Crc32.h>
+#include <ApfsLib/Util.h>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+static int failures = 0;
+
+template <typename F>
+static double measure_mbps(size_t bytes, F&& fn) {
+    size_t rounds = (256 * 1024 * 1024) / (bytes + 64) + 1;
+    volatile uint64_t sink = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < rounds; i++) {
+        sink = sink + fn();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    return static_cast<double>(rounds) * bytes / elapsed.count() / (1024 * 1024);
+}
+
+static void check_crc32c(const std::vector<uint8_t>& buffer) {
+    Crc32 table(true, 0x1EDC6F41, false);
+    Crc32 accel(true, 0x1EDC6F41);
+    static const size_t sizes[] = { 4, 20, 80, 255, 256, 1024, 4096, 65536, 1024 * 1024 };
+
+    printf("CRC32C: %s\n", accel.IsAccelerated() ? "hardware" : "no hardware support, table only");
+
+    // Standard check value of CRC32C
+    const uint8_t check[] = { '1', '2', '3', '4', '5', '6', '7', '8', '9' };
+    if ((table.Update(0xFFFFFFFF, check, sizeof(check)) ^ 0xFFFFFFFF) != 0xE3069283) {
+        printf("  table CRC32C of \"123456789\" is wrong\n");
+        failures++;
+    }
+
+    // All lengths and misalignments of short inputs, then the benchmark sizes.
+    for (size_t offs = 0; offs < 8; offs++) {
+        for (size_t size = 0; size <= 256; size++) {
+            uint32_t a = table.Update(0xFFFFFFFF, buffer.data() + offs, size);
+            uint32_t b = accel.Update(0xFFFFFFFF, buffer.data() + offs, size);
+            if (a != b) {
+                printf("  MISMATCH offs %zu size %zu: %08X != %08X\n", offs, size, a, b);
+                failures++;
+            }
+        }
+    }
+
+    for (size_t size : sizes) {
+        const uint8_t* data = buffer.data() + 1;
+        uint32_t a = table.Update(0xFFFFFFFF, data, size);
+        uint32_t b = accel.Update(0xFFFFFFFF, data, size);
+
+        if (a != b) {
+            printf("  MISMATCH size %zu: %08X != %08X\n", size, a, b);
+            failures++;
+        }
+
+        double mbps_table = measure_mbps(size, [&] { return table.Update(0xFFFFFFFF, data, size); });
+        double mbps_accel = measure_mbps(size, [&] { return accel.Update(0xFFFFFFFF, data, size); });
+        printf("  %8zu bytes: table %9.1f MB/s, accelerated %9.1f MB/s\n", size, mbps_table, mbps_accel);
+    }
+}
+
+static void check_fletcher64(const std::vector<uint8_t>& buffer) {
+    const uint32_t* words = reinterpret_cast<const uint32_t*>(buffer.data());
+    // Fletcher64 only takes the vector path up to 0x10000 words.
+    static const size_t limit = 0x10000;
+    static const size_t sizes[] = { 14, 1022, 4094, 16382, 65534 };
+    std::vector<uint32_t> ones(limit + 16, 0xFFFFFFFF);
+
+    printf("Fletcher64:\n");
+
+    for (size_t cnt = 0; cnt <= 64; cnt++) {
+        for (uint64_t init : { UINT64_C(0), UINT64_C(0xFFFFFFFEFFFFFFFE), UINT64_C(0x123456789ABCDEF) }) {
+            uint64_t a = Fletcher64Scalar(words, cnt, init);
+            uint64_t b = Fletcher64(words, cnt, init);
+            if (a != b) {
+                printf("  MISMATCH cnt %zu: %016" PRIX64 " != %016" PRIX64 "\n", cnt, a, b);
+                failures++;
+            }
+        }
+    }
+
+    // Around the vector limit, with random words and with the worst case
+    // for the lane sums, all bits set.
+    for (size_t cnt = limit - 16; cnt <= limit + 16; cnt++) {
+        for (const uint32_t* data : { words, static_cast<const uint32_t*>(ones.data()) }) {
+            uint64_t a = Fletcher64Scalar(data, cnt, 0xFFFFFFFEFFFFFFFE);
+            uint64_t b = Fletcher64(data, cnt, 0xFFFFFFFEFFFFFFFE);
+            if (a != b) {
+                printf("  MISMATCH cnt %zu: %016" PRIX64 " != %016" PRIX64 "\n", cnt, a, b);
+                failures++;
+            }
+        }
+    }
+
+    // Block sizes as VerifyBlock sees them (the checksum itself is skipped).
+    for (size_t cnt : sizes) {
+        const uint32_t* data = words + 2;
+        double mbps_scalar = measure_mbps(cnt * 4, [&] { return Fletcher64Scalar(data, cnt, 0); });
+        double mbps_vector = measure_mbps(cnt * 4, [&] { return Fletcher64(data, cnt, 0); });
+        printf("  %8zu bytes: scalar %9.1f MB/s, vector %9.1f MB/s\n", cnt * 4, mbps_scalar, mbps_vector);
+    }
+}
+
+int main() {
+    std::vector<uint8_t> buffer(1024 * 1024 + 64);
+    std::mt19937 rng(1);
+
+    for (uint8_t& b : buffer) {
+        b = static_cast<uint8_t>(rng());
+    }
+
+    check_crc32c(buffer);
+    check_fletcher64(buffer);
+
+    if (failures) {
+        printf("%d mismatches\n", failures);
+        return 1;
+    }
+
+    printf("All results match.\n");
+    return 0;
+}
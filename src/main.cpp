@@ -1,12 +1,15 @@
 #include "APFS/APFSHandler.hpp"
 #include "APFS/APFSWriter.hpp"
+#include "DMG/DMGConverter.hpp"
 #include "utils.hpp"
 #include <ApfsLib/ApfsContainer.h>
 #include <ApfsLib/ApfsDir.h>
 #include <ApfsLib/ApfsVolume.h>
 #include <ApfsLib/GptPartitionMap.h>
+#include <ApfsLib/Global.h>
 #include <cassert>
 #include <cinttypes>
+#include <cstdlib>
 #include <filesystem>
 #include <getopt.h>
 #include <iostream>
@@ -18,12 +21,24 @@ bool dmgextract_verbose = false;
 #define APFS_ROOT_INODE 2
 
 void usage(const char* name) {
-    fprintf(stderr, "Usage: %s -i filesystem[.dmg] -o extractdir [-v]\n", name);
+    fprintf(stderr, "Usage: %s -i filesystem[.dmg] -o extractdir [-c cache_mb] [-b cache_mb] [-a chunks] [-j threads] [-m] [-p] [-x] [-k] [-v]\n", name);
+    fprintf(stderr, "       %s -i image[.dmg] -r rawimage [-j threads] [-m] [-k]\n", name);
+    fprintf(stderr, "       %s -i image.dmg -k [-j threads] [-m]\n", name);
+    fprintf(stderr, "  -r rawimage  Convert the DMG or sparse image into a raw image file or onto a block device\n");
+    fprintf(stderr, "  -c cache_mb  Size of the decompressed DMG chunk cache in MiB (default 64)\n");
+    fprintf(stderr, "  -b cache_mb  Size of the APFS B-tree node cache in MiB (default 64)\n");
+    fprintf(stderr, "  -a chunks    Number of DMG chunks to decompress ahead, 0 to disable (default 4)\n");
+    fprintf(stderr, "  -j threads   Number of worker threads (default: one per CPU)\n");
+    fprintf(stderr, "  -m           Map the image file into memory instead of reading it\n");
+    fprintf(stderr, "  -p           Read the volume object maps into memory once, faster for full extractions\n");
+    fprintf(stderr, "  -x           Keep the DMG block table in image.dmg.idx to speed up the next open\n");
+    fprintf(stderr, "  -k           Verify the DMG checksums; with -o, only of the partitions read while extracting\n");
 }
 
 int main(int argc, char** argv) {
     const char* device_name = nullptr;
     const char* output_dir = nullptr;
+    const char* raw_output = nullptr;
     char opt;
 
 #ifdef WIN32
@@ -32,7 +47,7 @@ int main(int argc, char** argv) {
                      "for symlink support.\n");
 #endif // WIN32
 
-    while ((opt = getopt(argc, argv, "i:o:v")) != -1) {
+    while ((opt = getopt(argc, argv, "i:o:r:c:b:a:j:mpxkv")) != -1) {
         switch (opt) {
             case 'i': {
                 device_name = optarg;
@@ -44,6 +59,51 @@ int main(int argc, char** argv) {
                 break;
             }
 
+            case 'r': {
+                raw_output = optarg;
+                break;
+            }
+
+            case 'c': {
+                g_dmg_cache_size = strtoull(optarg, nullptr, 10) * 1024 * 1024;
+                break;
+            }
+
+            case 'b': {
+                g_btree_cache_size = strtoull(optarg, nullptr, 10) * 1024 * 1024;
+                break;
+            }
+
+            case 'a': {
+                g_dmg_readahead = strtoul(optarg, nullptr, 10);
+                break;
+            }
+
+            case 'j': {
+                g_threads = strtoul(optarg, nullptr, 10);
+                break;
+            }
+
+            case 'm': {
+                g_image_mmap = true;
+                break;
+            }
+
+            case 'p': {
+                g_omap_preload = true;
+                break;
+            }
+
+            case 'x': {
+                g_dmg_index = true;
+                break;
+            }
+
+            case 'k': {
+                g_dmg_verify = true;
+                break;
+            }
+
             case 'v': {
                 dmgextract_verbose = true;
                 break;
@@ -61,6 +121,23 @@ int main(int argc, char** argv) {
         }
     }
 
+    if (device_name != nullptr && raw_output != nullptr) {
+        if (std::filesystem::is_regular_file(raw_output)) {
+            Utilities::print(
+              Utilities::MSG_STATUS_ERROR,
+              "Will not overwrite an existing file. Please delete/move it and try again.\n");
+            return 2;
+        }
+
+        DMGConverter converter(device_name, raw_output);
+        return !converter.convert();
+    }
+
+    if (device_name != nullptr && g_dmg_verify && output_dir == nullptr) {
+        DMGConverter verifier(device_name, "");
+        return verifier.verify() ? 0 : 3;
+    }
+
     if (device_name == nullptr || output_dir == nullptr) {
         usage(argv[0]);
         return 1;
@@ -76,7 +153,14 @@ int main(int argc, char** argv) {
 
     APFSHandler handler(device_name, output_dir);
     if (handler.init()) {
-        return !handler.write();
+        if (!handler.write()) {
+            return 1;
+        }
+        // With -k the sections are checksummed while they are decoded.
+        if (g_dmg_verify && !handler.verify_checksums()) {
+            return 3;
+        }
+        return 0;
     }
 
     Utilities::print(Utilities::MSG_STATUS_WARNING, "Not APFS. Trying HFS+ instead...\n");